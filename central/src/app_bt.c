@@ -8,6 +8,12 @@
  */
 
 #include <app_bt.h>
+#include <app_bt_cache.h>
+#include <app_bt_timesync.h>
+#include <app_bt_fed.h>
+#include <app_bt_health.h>
+#include <app_bt_sched.h>
+#include <app_bt_scan.h>
 #include <zephyr/types.h>
 #include <stddef.h>
 #include <errno.h>
@@ -20,42 +26,88 @@
 #include <bluetooth/services/nus.h>
 #include <bluetooth/services/nus_client.h>
 #include <zephyr/sys/byteorder.h>
+#include <zephyr/settings/settings.h>
 #include <zephyr/logging/log.h>
 
 LOG_MODULE_REGISTER(app_bt, LOG_LEVEL_DBG);
 
-#define SCAN_INTERVAL 0x00A0 /* 160 ms */
-#define SCAN_WINDOW   0x0030 /* 30 ms */
 #define INIT_INTERVAL 0x0010 /* 10 ms */
 #define INIT_WINDOW   0x0010 /* 10 ms */
-#define CONN_INTERVAL 40     /* 50 ms */
+#define INIT_TIMEOUT  100    /* 1 s, queued candidates may have gone away */
 #define CONN_LATENCY  0
-#define CONN_TIMEOUT  MIN(MAX((CONN_INTERVAL * 125 * \
+#define TX_RETRY_DELAY_MS 5
+#define CONN_TIMEOUT_FOR(interval, latency) MIN(MAX(((1 + (latency)) * (interval) * 125 * \
 			       MAX(CONFIG_BT_MAX_CONN, 6) / 1000), 10), 3200)
+#define CONN_PARAM_UPDATE_TIMEOUT_MS 2000
+#define TX_LATENCY_REPORT_COUNT 16
+#define LINK_WQ_STACK_SIZE 1024
+#define LINK_WQ_PRIORITY K_LOWEST_APPLICATION_THREAD_PRIO
 
 //#define LOG_DISABLE 1
 
 static const char adv_target_name[] = "Whack-A-Mole Button";
-static bool 	  adv_target_name_found;
 
 static void start_scan(void);
 static void gatt_discover(struct bt_conn *conn, struct bt_nus_client *nus_client);
+static void tx_batch_link_drop(uint32_t con_index);
 
 static app_bt_callback_t m_callback;
 
+/* Schedule for a full set of links. New links are created with this interval until they are ready,
+ * so the interval doesn't change as more links join. */
+static struct app_bt_sched_plan_t m_sched_setup;
+
 static struct bt_conn *conn_connecting;
 static struct bt_conn_info conn_info;
 static uint8_t volatile conn_count;
 static bool volatile is_disconnecting;
 
+/* Link bring-up stages. Every link runs MTU exchange as soon as it is connected,
+ * while the single GATT discovery manager instance is shared through a FIFO. */
+enum per_state_t {PER_STATE_IDLE, PER_STATE_CONNECTED, PER_STATE_DISC_QUEUED, PER_STATE_DISCOVERING, PER_STATE_READY};
+
 static struct per_context_t {
 	bool used;
 	bool ready;
 	struct bt_conn *conn;
 	struct bt_nus_client nus_client;
 	uint32_t index;
+	enum per_state_t state;
+	bool handles_from_cache;
+	bool conn_param_applied;
+	atomic_t tx_credits;
+	// Queue time of the writes in flight, oldest first, to measure the command latency
+	uint32_t tx_t_queued[CONFIG_APP_BT_TX_CREDITS];
+	uint8_t tx_inflight_head;
+	uint32_t t_found;
+	uint32_t t_connected;
+	uint32_t t_mtu_done;
+	uint32_t t_ready;
+	int8_t rssi;
+	// Link layer state, for the on-air time estimates
+	uint8_t tx_phy, rx_phy;
+	uint16_t tx_max_len, rx_max_len;
+	bool phy_2m_requested;
 } per_context[CONFIG_BT_MAX_CONN] = {0};
 
+/* Advertisers matching the target name, waiting for the initiator to become available */
+#define CANDIDATE_QUEUE_LEN CONFIG_APP_BT_CANDIDATE_QUEUE_LEN
+static struct {
+	bt_addr_le_t addr;
+	uint32_t t_found;
+} candidate_queue[CANDIDATE_QUEUE_LEN];
+static uint8_t candidate_head, candidate_count;
+static uint32_t conn_connecting_t_found;
+
+/* Links waiting for the GATT discovery manager, in connection order */
+static struct per_context_t *discovery_queue[CONFIG_BT_MAX_CONN];
+static uint8_t discovery_head, discovery_count;
+static struct per_context_t *per_discovering;
+
+/* Start of the current setup session, ie. when the first link was found with no other links present */
+static uint32_t t_session_start;
+static uint32_t setup_time_sum;
+
 static struct per_context_t *get_free_per_context(void)
 {
 	for(int i = 0; i < CONFIG_BT_MAX_CONN; i++) {
@@ -87,10 +139,81 @@ static struct per_context_t *get_per_context_from_client(struct bt_nus_client *c
 	return NULL;
 }
 
+static bool candidate_queue_contains(const bt_addr_le_t *addr)
+{
+	for(int i = 0; i < candidate_count; i++) {
+		if(bt_addr_le_cmp(&candidate_queue[(candidate_head + i) % CANDIDATE_QUEUE_LEN].addr, addr) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool candidate_queue_push(const bt_addr_le_t *addr)
+{
+	if(candidate_count >= CANDIDATE_QUEUE_LEN || candidate_queue_contains(addr)) {
+		return false;
+	}
+	int i = (candidate_head + candidate_count) % CANDIDATE_QUEUE_LEN;
+	bt_addr_le_copy(&candidate_queue[i].addr, addr);
+	candidate_queue[i].t_found = k_uptime_get_32();
+	candidate_count++;
+	return true;
+}
+
+static bool candidate_queue_pop(bt_addr_le_t *addr, uint32_t *t_found)
+{
+	if(candidate_count == 0) {
+		return false;
+	}
+	bt_addr_le_copy(addr, &candidate_queue[candidate_head].addr);
+	*t_found = candidate_queue[candidate_head].t_found;
+	candidate_head = (candidate_head + 1) % CANDIDATE_QUEUE_LEN;
+	candidate_count--;
+	return true;
+}
+
+static void discovery_queue_push(struct per_context_t *peripheral)
+{
+	discovery_queue[(discovery_head + discovery_count) % CONFIG_BT_MAX_CONN] = peripheral;
+	discovery_count++;
+	peripheral->state = PER_STATE_DISC_QUEUED;
+}
+
+static struct per_context_t *discovery_queue_pop(void)
+{
+	struct per_context_t *peripheral;
+	if(discovery_count == 0) {
+		return NULL;
+	}
+	peripheral = discovery_queue[discovery_head];
+	discovery_head = (discovery_head + 1) % CONFIG_BT_MAX_CONN;
+	discovery_count--;
+	return peripheral;
+}
+
+static void discovery_queue_remove(struct per_context_t *peripheral)
+{
+	int kept = 0;
+	for(int i = 0; i < discovery_count; i++) {
+		struct per_context_t *entry = discovery_queue[(discovery_head + i) % CONFIG_BT_MAX_CONN];
+		if(entry != peripheral) {
+			discovery_queue[(discovery_head + kept++) % CONFIG_BT_MAX_CONN] = entry;
+		}
+	}
+	discovery_count = kept;
+}
+
 static void fwd_event_con_num_change(uint32_t con_num)
 {
 	static struct app_bt_evt_t evt = {.type = APP_BT_EVT_CON_NUM_CHANGE};
 	evt.num_connected = con_num;
+	evt.ready_mask = 0;
+	for (int i = 0; i < CONFIG_BT_MAX_CONN; i++) {
+		if (per_context[i].ready) {
+			evt.ready_mask |= BIT(i);
+		}
+	}
 	m_callback(&evt);
 }
 
@@ -98,6 +221,7 @@ static void fwd_event_rx_data(uint32_t con_index, const uint8_t *data, uint16_t
 {
 	static struct app_bt_evt_t rx_evt = {.type = APP_BT_EVT_RX_DATA};
 	rx_evt.con_index = con_index;
+	rx_evt.rssi = per_context[con_index].rssi;
 	rx_evt.data = data;
 	rx_evt.data_len = len;
 	m_callback(&rx_evt);
@@ -111,20 +235,7 @@ static void fwd_event_ctrl_link_con_discon(struct bt_conn *conn, bool connected)
 	m_callback(&ctrl_con_discon_evt);
 }
 
-static bool target_adv_name_found(struct bt_data *data, void *user_data)
-{
-	if (data->type == BT_DATA_NAME_COMPLETE) {
-		//LOG_INF("Dev with name found: %.*s", data->data_len, data->data);
-		if(memcmp(data->data, adv_target_name, strlen(adv_target_name)) == 0) {
-			adv_target_name_found = true;
-		}
-		return false;
-	}
-	return true;
-}
-
-static void device_found(const bt_addr_le_t *addr, int8_t rssi, uint8_t type,
-			 struct net_buf_simple *ad)
+static void connect_next_candidate(void)
 {
 	struct bt_conn_le_create_param create_param = {
 		.options = BT_CONN_LE_OPT_NONE,
@@ -132,70 +243,69 @@ static void device_found(const bt_addr_le_t *addr, int8_t rssi, uint8_t type,
 		.window = INIT_WINDOW,
 		.interval_coded = 0,
 		.window_coded = 0,
-		.timeout = 0,
+		.timeout = INIT_TIMEOUT,
 	};
 	struct bt_le_conn_param conn_param = {
-		.interval_min = CONN_INTERVAL,
-		.interval_max = CONN_INTERVAL,
+		.interval_min = m_sched_setup.interval,
+		.interval_max = m_sched_setup.interval,
 		.latency = CONN_LATENCY,
-		.timeout = CONN_TIMEOUT,
+		.timeout = CONN_TIMEOUT_FOR(m_sched_setup.interval, CONN_LATENCY),
 	};
 	char addr_str[BT_ADDR_LE_STR_LEN];
+	bt_addr_le_t addr;
+	uint32_t t_found;
 	int err;
 
-	if (conn_connecting) {
-		return;
-	}
-
-	/* We're only interested in connectable events */
-	if (type != BT_GAP_ADV_TYPE_ADV_IND &&
-	    type != BT_GAP_ADV_TYPE_ADV_DIRECT_IND &&
-	    type != BT_GAP_ADV_TYPE_EXT_ADV) {
-		return;
-	}
-
-	bt_addr_le_to_str(addr, addr_str, sizeof(addr_str));
-	//LOG_INF("Device found: %s (RSSI %d)", addr_str, rssi);
+	while (!conn_connecting && conn_count < CONFIG_BT_MAX_CONN &&
+	       candidate_queue_pop(&addr, &t_found)) {
+		// The candidate might have been connected through an earlier report
+		struct bt_conn *existing = bt_conn_lookup_addr_le(BT_ID_DEFAULT, &addr);
+		if (existing) {
+			bt_conn_unref(existing);
+			continue;
+		}
 
-	// Look for the target device name in the advertise payload, and return if it is not found
-	adv_target_name_found = false;
-	bt_data_parse(ad, target_adv_name_found, 0);
-	if (!adv_target_name_found) {
-		return;
-	}
+		// The initiator can not run in parallel with the scanner
+		app_bt_scan_stop();
 
-	if (bt_le_scan_stop()) {
-		LOG_INF("Scanning successfully stopped");
+		err = bt_conn_le_create(&addr, &create_param, &conn_param,
+					&conn_connecting);
+		if (err) {
+			bt_addr_le_to_str(&addr, addr_str, sizeof(addr_str));
+			LOG_WRN("Create conn to %s failed (%d)", addr_str, err);
+			conn_connecting = NULL;
+			continue;
+		}
+		conn_connecting_t_found = t_found;
 		return;
 	}
 
-	err = bt_conn_le_create(addr, &create_param, &conn_param,
-				&conn_connecting);
-	if (err) {
-		LOG_WRN("Create conn to %s failed (%d)", addr_str, err);
+	if (!conn_connecting) {
 		start_scan();
 	}
 }
 
-static void start_scan(void)
+// Called by the scan module for connectable advertisers with the target name only
+static void device_found(const bt_addr_le_t *addr)
 {
-	struct bt_le_scan_param scan_param = {
-		.type       = BT_HCI_LE_SCAN_PASSIVE,
-		.options    = BT_LE_SCAN_OPT_NONE,
-		.interval   = SCAN_INTERVAL,
-		.window     = SCAN_WINDOW,
-	};
-	int err;
+	if (conn_count == 0 && !conn_connecting && candidate_count == 0) {
+		t_session_start = k_uptime_get_32();
+		setup_time_sum = 0;
+	}
 
-	err = bt_le_scan_start(&scan_param, device_found);
-	if (err) {
-		LOG_ERR("Scanning failed to start (err %d)", err);
-		return;
+	// Queue the candidate, and connect to it straight away if the initiator is idle
+	if (candidate_queue_push(addr)) {
+		connect_next_candidate();
 	}
+}
 
-	LOG_INF("Scanning successfully started");
+static void start_scan(void)
+{
+	app_bt_scan_update(conn_count, conn_connecting != NULL);
 }
 
+static void start_next_discovery(void);
+
 #if defined(CONFIG_BT_GATT_CLIENT)
 static void mtu_exchange_cb(struct bt_conn *conn, uint8_t err,
 			    struct bt_gatt_exchange_params *params)
@@ -203,7 +313,10 @@ static void mtu_exchange_cb(struct bt_conn *conn, uint8_t err,
 	LOG_INF("MTU exchange %u %s (%u)", bt_conn_index(conn),
 	       err == 0U ? "successful" : "failed", bt_gatt_get_mtu(conn));
 	struct per_context_t *peripheral = get_per_context_from_conn(conn);
-	gatt_discover(conn, &peripheral->nus_client);
+	if (peripheral) {
+		peripheral->t_mtu_done = k_uptime_get_32();
+		gatt_discover(conn, &peripheral->nus_client);
+	}
 }
 
 static struct bt_gatt_exchange_params mtu_exchange_params[CONFIG_BT_MAX_CONN];
@@ -230,13 +343,351 @@ static int mtu_exchange(struct bt_conn *conn)
 }
 #endif /* CONFIG_BT_GATT_CLIENT */
 
+static void setup_time_report(struct per_context_t *peripheral)
+{
+	uint32_t link_time = peripheral->t_ready - peripheral->t_found;
+	int num_ready = 0;
+
+	for(int i = 0; i < CONFIG_BT_MAX_CONN; i++) {
+		if(per_context[i].used && per_context[i].ready) {
+			num_ready++;
+		}
+	}
+	setup_time_sum += link_time;
+
+	LOG_INF("Link %i ready: found->conn %u ms, conn->mtu %u ms, mtu->ready %u ms, total %u ms",
+		peripheral->index, peripheral->t_connected - peripheral->t_found,
+		peripheral->t_mtu_done - peripheral->t_connected,
+		peripheral->t_ready - peripheral->t_mtu_done, link_time);
+	LOG_INF("%i link(s) ready %u ms after the first was found (sum of per link setup times %u ms)",
+		num_ready, peripheral->t_ready - t_session_start, setup_time_sum);
+}
+
+/* Connection parameters follow the game phase. All links share the interval, see app_bt_sched.h.
+ * Updates are issued one link at a time so the update procedures don't compete for the same intervals. */
+static const char *conn_mode_str[] = {"idle", "active"};
+static atomic_t m_conn_mode_requested = ATOMIC_INIT(APP_BT_CONN_MODE_IDLE);
+static enum app_bt_conn_mode_t m_conn_mode = APP_BT_CONN_MODE_IDLE;
+static struct bt_le_conn_param m_conn_param = {
+	.interval_min = CONFIG_APP_BT_CONN_INTERVAL_IDLE,
+	.interval_max = CONFIG_APP_BT_CONN_INTERVAL_IDLE,
+	.latency = CONFIG_APP_BT_CONN_LATENCY_IDLE,
+	.timeout = CONN_TIMEOUT_FOR(CONFIG_APP_BT_CONN_INTERVAL_IDLE, CONFIG_APP_BT_CONN_LATENCY_IDLE),
+};
+static struct per_context_t *per_param_updating;
+static uint32_t t_param_update, t_mode_switch;
+
+// Parameters of the current mode, without peripheral latency for the links the health monitor asks it for
+static void link_conn_param(uint32_t con_index, struct bt_le_conn_param *param)
+{
+	*param = m_conn_param;
+	if (param->latency > 0 && app_bt_health_no_latency(con_index)) {
+		param->latency = 0;
+		param->timeout = CONN_TIMEOUT_FOR(param->interval_max, 0);
+	}
+}
+
+/* Command latency, from queued to transmitted, since the last mode switch */
+static struct {
+	uint32_t sum_us;
+	uint32_t max_us;
+	uint32_t count;
+	bool report_pending;
+} tx_latency;
+static struct k_spinlock tx_latency_lock;
+
+static void tx_latency_log(const char *when)
+{
+	k_spinlock_key_t key = k_spin_lock(&tx_latency_lock);
+	uint32_t count = tx_latency.count;
+	uint32_t avg_us = count ? tx_latency.sum_us / count : 0;
+	uint32_t max_us = tx_latency.max_us;
+	k_spin_unlock(&tx_latency_lock, key);
+
+	LOG_INF("TX latency %s, %s mode: avg %u us, max %u us (%u cmds)", when, conn_mode_str[m_conn_mode],
+		avg_us, max_us, count);
+}
+
+static void tx_latency_add(uint32_t latency_us)
+{
+	bool report = false;
+
+	k_spinlock_key_t key = k_spin_lock(&tx_latency_lock);
+	tx_latency.sum_us += latency_us;
+	tx_latency.max_us = MAX(tx_latency.max_us, latency_us);
+	tx_latency.count++;
+	if (tx_latency.report_pending && tx_latency.count >= TX_LATENCY_REPORT_COUNT) {
+		tx_latency.report_pending = false;
+		report = true;
+	}
+	k_spin_unlock(&tx_latency_lock, key);
+
+	if (report) {
+		tx_latency_log("after switch");
+	}
+}
+
+/* On-air time of the LED commands and the trial results, estimated from the PHY and the data length
+ * of the link, since the last switch to the active mode. The same frames are also costed on the 1M
+ * PHY with 27 octet packets, which the links used before the PHY and data length negotiation. */
+#define LL_OCTETS_DEFAULT	27
+#define L2CAP_HDR_LEN		4
+#define ATT_HDR_LEN		3
+#define T_IFS_US		150
+
+static struct {
+	uint32_t led_count;
+	uint64_t led_us, led_us_base;
+	uint32_t td_count;
+	uint64_t td_us, td_us_base;
+} airtime;
+static struct k_spinlock airtime_lock;
+
+// Preamble, access address, header and CRC around the payload
+static uint32_t pdu_air_us(uint8_t phy, uint32_t payload)
+{
+	if (phy == BT_GAP_LE_PHY_2M) {
+		return (2 + 4 + 2 + payload + 3) * 4;
+	}
+	return (1 + 4 + 2 + payload + 3) * 8;
+}
+
+// An ATT PDU split into link layer packets, each answered by an empty packet
+static uint32_t att_air_us(uint8_t phy, uint16_t max_octets, uint32_t att_len)
+{
+	uint32_t left = L2CAP_HDR_LEN + att_len;
+	uint32_t t_us = 0;
+
+	while (left > 0) {
+		uint32_t octets = MIN(left, max_octets);
+		t_us += pdu_air_us(phy, octets) + T_IFS_US + pdu_air_us(phy, 0) + T_IFS_US;
+		left -= octets;
+	}
+	return t_us;
+}
+
+static void airtime_add(bool led, uint8_t phy, uint16_t max_octets, uint16_t len)
+{
+	uint32_t t_us = att_air_us(phy, max_octets, ATT_HDR_LEN + len);
+	uint32_t t_base_us = att_air_us(BT_GAP_LE_PHY_1M, LL_OCTETS_DEFAULT, ATT_HDR_LEN + len);
+
+	k_spinlock_key_t key = k_spin_lock(&airtime_lock);
+	if (led) {
+		airtime.led_count++;
+		airtime.led_us += t_us;
+		airtime.led_us_base += t_base_us;
+	}
+	else {
+		airtime.td_count++;
+		airtime.td_us += t_us;
+		airtime.td_us_base += t_base_us;
+	}
+	k_spin_unlock(&airtime_lock, key);
+}
+
+static void conn_param_work_handler(struct k_work *work);
+K_WORK_DELAYABLE_DEFINE(m_work_conn_param, conn_param_work_handler);
+
+static void conn_param_set(enum app_bt_conn_mode_t mode)
+{
+	uint16_t interval = CONFIG_APP_BT_CONN_INTERVAL_IDLE;
+	uint16_t latency = CONFIG_APP_BT_CONN_LATENCY_IDLE;
+
+	if (mode == APP_BT_CONN_MODE_ACTIVE) {
+		struct app_bt_sched_plan_t plan;
+		app_bt_sched_plan(conn_count, CONFIG_APP_BT_CONN_INTERVAL_ACTIVE, &plan);
+		interval = plan.interval;
+		latency = 0;
+	}
+	m_conn_param.interval_min = m_conn_param.interval_max = interval;
+	m_conn_param.latency = latency;
+	m_conn_param.timeout = CONN_TIMEOUT_FOR(interval, latency);
+}
+
+// Runs from the system work queue only, the links are updated one at a time
+static void conn_param_work_handler(struct k_work *work)
+{
+	enum app_bt_conn_mode_t mode = atomic_get(&m_conn_mode_requested);
+	int err;
+
+	if (mode != m_conn_mode) {
+		tx_latency_log("before switch");
+		m_conn_mode = mode;
+		app_bt_scan_game_set(mode == APP_BT_CONN_MODE_ACTIVE);
+		conn_param_set(mode);
+		for (int i = 0; i < CONFIG_BT_MAX_CONN; i++) {
+			per_context[i].conn_param_applied = false;
+		}
+		k_spinlock_key_t key = k_spin_lock(&tx_latency_lock);
+		memset(&tx_latency, 0, sizeof(tx_latency));
+		tx_latency.report_pending = true;
+		k_spin_unlock(&tx_latency_lock, key);
+		if (mode == APP_BT_CONN_MODE_ACTIVE) {
+			key = k_spin_lock(&airtime_lock);
+			memset(&airtime, 0, sizeof(airtime));
+			k_spin_unlock(&airtime_lock, key);
+		}
+		t_mode_switch = k_uptime_get_32();
+		LOG_INF("Conn mode %s: interval %u, latency %u", conn_mode_str[mode],
+			m_conn_param.interval_max, m_conn_param.latency);
+	}
+
+	if (per_param_updating) {
+		uint32_t elapsed = k_uptime_get_32() - t_param_update;
+		if (elapsed < CONN_PARAM_UPDATE_TIMEOUT_MS) {
+			k_work_reschedule(&m_work_conn_param, K_MSEC(CONN_PARAM_UPDATE_TIMEOUT_MS - elapsed));
+			return;
+		}
+		// Keep the current parameters rather than retrying forever
+		LOG_WRN("Link %i: conn param update timed out", per_param_updating->index);
+		per_param_updating->conn_param_applied = true;
+		per_param_updating = NULL;
+	}
+
+	for (int i = 0; i < CONFIG_BT_MAX_CONN; i++) {
+		struct per_context_t *peripheral = &per_context[i];
+		if (!peripheral->used || !peripheral->ready || peripheral->conn_param_applied) {
+			continue;
+		}
+		struct bt_le_conn_param param;
+		link_conn_param(i, &param);
+		err = bt_conn_le_param_update(peripheral->conn, &param);
+		if (err) {
+			LOG_WRN("Link %i: conn param update failed (err %d)", i, err);
+			peripheral->conn_param_applied = true;
+			continue;
+		}
+		per_param_updating = peripheral;
+		t_param_update = k_uptime_get_32();
+		k_work_reschedule(&m_work_conn_param, K_MSEC(CONN_PARAM_UPDATE_TIMEOUT_MS));
+		return;
+	}
+
+	if (t_mode_switch) {
+		LOG_INF("All links in %s mode after %u ms", conn_mode_str[m_conn_mode],
+			k_uptime_get_32() - t_mode_switch);
+		t_mode_switch = 0;
+	}
+}
+
+/* RSSI of the pad links, read from the controller periodically so the game can log it along with
+ * the results without waiting for an HCI command. The reads, and the health mitigations, block on
+ * the HCI command response, so they run on a low priority work queue of their own: on the system
+ * work queue they would hold back the TX complete callbacks that time stamp the sync and the LED
+ * commands. */
+K_THREAD_STACK_DEFINE(m_link_wq_stack, LINK_WQ_STACK_SIZE);
+static struct k_work_q m_link_wq;
+
+static void rssi_work_handler(struct k_work *work);
+K_WORK_DELAYABLE_DEFINE(m_work_rssi, rssi_work_handler);
+
+static int rssi_read(struct bt_conn *conn, int8_t *rssi)
+{
+	struct bt_hci_cp_read_rssi *cp;
+	struct bt_hci_rp_read_rssi *rp;
+	struct net_buf *buf, *rsp = NULL;
+	uint16_t handle;
+	int err;
+
+	err = bt_hci_get_conn_handle(conn, &handle);
+	if (err) {
+		return err;
+	}
+	buf = bt_hci_cmd_create(BT_HCI_OP_READ_RSSI, sizeof(*cp));
+	if (!buf) {
+		return -ENOBUFS;
+	}
+	cp = net_buf_add(buf, sizeof(*cp));
+	cp->handle = sys_cpu_to_le16(handle);
+	err = bt_hci_cmd_send_sync(BT_HCI_OP_READ_RSSI, buf, &rsp);
+	if (err) {
+		return err;
+	}
+	rp = (void *)rsp->data;
+	*rssi = rp->rssi;
+	net_buf_unref(rsp);
+	return 0;
+}
+
+static void rssi_work_handler(struct k_work *work)
+{
+	for (int i = 0; i < CONFIG_BT_MAX_CONN; i++) {
+		struct per_context_t *peripheral = &per_context[i];
+		int8_t rssi;
+		if (peripheral->ready && rssi_read(peripheral->conn, &rssi) == 0) {
+			peripheral->rssi = rssi;
+			app_bt_health_rssi(i, rssi);
+		}
+	}
+	k_work_reschedule_for_queue(&m_link_wq, &m_work_rssi, K_MSEC(CONFIG_APP_BT_RSSI_PERIOD_MS));
+}
+
+/* Link layer payload for a whole write: L2CAP header, ATT write command header and the message */
+#define LL_OCTETS_CMD		(L2CAP_HDR_LEN + ATT_HDR_LEN + APP_BT_TX_MSG_LEN_MAX)
+// Time for the payload on the 1M PHY, so the length still holds on a link that falls back from 2M
+#define LL_TIME_US(octets)	MAX(((octets) + 14) * 8, 328)
+
+static void link_radio_setup(struct per_context_t *peripheral)
+{
+	int err;
+
+#if defined(CONFIG_APP_BT_PHY_2M)
+	err = bt_conn_le_phy_update(peripheral->conn, BT_CONN_LE_PHY_PARAM_2M);
+	peripheral->phy_2m_requested = (err == 0);
+	if (err) {
+		LOG_WRN("Link %i: 2M PHY request failed (err %d), staying on 1M", peripheral->index, err);
+	}
+#endif
+#if defined(CONFIG_APP_BT_DATA_LEN)
+	struct bt_conn_le_data_len_param data_len = {
+		.tx_max_len = LL_OCTETS_CMD,
+		.tx_max_time = LL_TIME_US(LL_OCTETS_CMD),
+	};
+	err = bt_conn_le_data_len_update(peripheral->conn, &data_len);
+	if (err) {
+		LOG_WRN("Link %i: data length request failed (err %d), staying at %u octets", peripheral->index,
+			err, LL_OCTETS_DEFAULT);
+	}
+#endif
+}
+
+static void health_param_refresh(uint32_t con_index)
+{
+	per_context[con_index].conn_param_applied = false;
+	k_work_reschedule(&m_work_conn_param, K_NO_WAIT);
+}
+
+static void link_ready(struct per_context_t *peripheral)
+{
+	peripheral->ready = true;
+	peripheral->state = PER_STATE_READY;
+	peripheral->t_ready = k_uptime_get_32();
+	setup_time_report(peripheral);
+	app_bt_timesync_start(peripheral->index);
+	app_bt_health_link_add(peripheral->index, peripheral->conn);
+	// Leave the setup parameters for the ones of the current game phase
+	peripheral->conn_param_applied = false;
+	k_work_reschedule(&m_work_conn_param, K_NO_WAIT);
+	fwd_event_con_num_change(conn_count);
+}
+
 static void discovery_complete(struct bt_gatt_dm *dm,
 			       void *context)
 {
 	struct bt_nus_client *nus = context;
+	struct per_context_t *peripheral = get_per_context_from_client(nus);
 
 	LOG_INF("Service discovery completed");
 
+	per_discovering = NULL;
+
+	// The link might have dropped while the discovery was running
+	if (!peripheral || peripheral->state != PER_STATE_DISCOVERING) {
+		bt_gatt_dm_data_release(dm);
+		start_next_discovery();
+		return;
+	}
+
 	bt_gatt_dm_data_print(dm);
 
 	bt_nus_handles_assign(dm, nus);
@@ -244,19 +695,21 @@ static void discovery_complete(struct bt_gatt_dm *dm,
 
 	bt_gatt_dm_data_release(dm);
 
-	start_scan();
+#if defined(CONFIG_APP_BT_GATT_CACHE)
+	app_bt_cache_store(bt_conn_get_dst(peripheral->conn), &nus->handles);
+#endif
 
-	struct per_context_t *peripheral = get_per_context_from_client(nus);
-	if (peripheral) {
-		peripheral->ready = true;
-		fwd_event_con_num_change(conn_count);
-	}
+	link_ready(peripheral);
+
+	start_next_discovery();
 }
 
 static void discovery_service_not_found(struct bt_conn *conn,
 					void *context)
 {
 	LOG_WRN("Service not found!");
+	per_discovering = NULL;
+	start_next_discovery();
 }
 
 static void discovery_error(struct bt_conn *conn,
@@ -264,6 +717,8 @@ static void discovery_error(struct bt_conn *conn,
 			    void *context)
 {
 	LOG_ERR("Error while discovering GATT database: (%d)", err);
+	per_discovering = NULL;
+	start_next_discovery();
 }
 
 struct bt_gatt_dm_cb discovery_cb = {
@@ -272,22 +727,89 @@ struct bt_gatt_dm_cb discovery_cb = {
 	.error_found       = discovery_error,
 };
 
-static void gatt_discover(struct bt_conn *conn, struct bt_nus_client *nus_client)
+static void start_next_discovery(void)
 {
+	struct per_context_t *peripheral;
 	int err;
 
-	/*if (conn != default_conn) {
+	// The discovery manager only handles one link at the time
+	while (!per_discovering && (peripheral = discovery_queue_pop()) != NULL) {
+		err = bt_gatt_dm_start(peripheral->conn,
+				       BT_UUID_NUS_SERVICE,
+				       &discovery_cb,
+				       &peripheral->nus_client);
+		if (err) {
+			LOG_ERR("could not start the discovery procedure, error code: %d", err);
+			peripheral->state = PER_STATE_CONNECTED;
+			continue;
+		}
+		peripheral->state = PER_STATE_DISCOVERING;
+		per_discovering = peripheral;
+	}
+}
+
+#if defined(CONFIG_APP_BT_GATT_CACHE)
+static void gatt_cache_subscribe_cb(struct bt_conn *conn, uint8_t err,
+				    struct bt_gatt_subscribe_params *params)
+{
+	struct bt_nus_client *nus = CONTAINER_OF(params, struct bt_nus_client, tx_notif_params);
+	struct per_context_t *peripheral = get_per_context_from_client(nus);
+
+	params->subscribe = NULL;
+	if (!err || !peripheral || !peripheral->handles_from_cache) {
 		return;
-	}*/
+	}
 
-	err = bt_gatt_dm_start(conn,
-			       BT_UUID_NUS_SERVICE,
-			       &discovery_cb,
-			       nus_client);
+	// The cached handles are stale, drop them and fall back to a full discovery
+	LOG_WRN("CCC write with cached handles failed (err %d), rediscovering", err);
+	app_bt_cache_invalidate(bt_conn_get_dst(peripheral->conn));
+	peripheral->handles_from_cache = false;
+	peripheral->ready = false;
+	peripheral->state = PER_STATE_CONNECTED;
+	// Undo link_ready(), it runs again when the discovery completes. The health link holds a reference.
+	app_bt_timesync_stop(peripheral->index);
+	app_bt_health_link_remove(peripheral->index);
+	fwd_event_con_num_change(conn_count);
+	gatt_discover(peripheral->conn, nus);
+}
+
+static bool gatt_cache_restore(struct per_context_t *peripheral)
+{
+	struct bt_nus_client_handles handles;
+	int err;
+
+	if (!app_bt_cache_get(bt_conn_get_dst(peripheral->conn), &handles)) {
+		return false;
+	}
+
+	// All the peripherals run the same firmware, so the handles are stable between connections
+	peripheral->nus_client.conn = peripheral->conn;
+	peripheral->nus_client.handles = handles;
+	peripheral->nus_client.tx_notif_params.subscribe = gatt_cache_subscribe_cb;
+	err = bt_nus_subscribe_receive(&peripheral->nus_client);
 	if (err) {
-		LOG_ERR("could not start the discovery procedure, error code: %d", err);
-		start_scan();
+		LOG_WRN("Subscribe with cached handles failed (err %d)", err);
+		app_bt_cache_invalidate(bt_conn_get_dst(peripheral->conn));
+		return false;
 	}
+
+	LOG_INF("Link %i restored from GATT cache", peripheral->index);
+	peripheral->handles_from_cache = true;
+	link_ready(peripheral);
+	return true;
+}
+#endif
+
+static void gatt_discover(struct bt_conn *conn, struct bt_nus_client *nus_client)
+{
+	struct per_context_t *peripheral = get_per_context_from_client(nus_client);
+
+	if (!peripheral || peripheral->state != PER_STATE_CONNECTED) {
+		return;
+	}
+
+	discovery_queue_push(peripheral);
+	start_next_discovery();
 }
 
 static void connected(struct bt_conn *conn, uint8_t reason)
@@ -305,26 +827,45 @@ static void connected(struct bt_conn *conn, uint8_t reason)
 			bt_conn_unref(conn_connecting);
 			conn_connecting = NULL;
 
-			start_scan();
+			connect_next_candidate();
 			return;
 		}
 
 		conn_connecting = NULL;
 
 		conn_count++;
-		
-		if (conn_count < CONFIG_BT_MAX_CONN) {
-			//start_scan(); // Try to skip this, in order to speed up the connection procedure
-		}
 
 		struct per_context_t *peripheral = get_free_per_context();
 		if (peripheral) {
+			app_bt_tx_reset(peripheral->index);
+			atomic_set(&peripheral->tx_credits, CONFIG_APP_BT_TX_CREDITS);
+			peripheral->tx_inflight_head = 0;
+			app_bt_sched_link_add(peripheral->index, conn);
 			peripheral->conn = conn;
 			peripheral->ready = false;
+			peripheral->handles_from_cache = false;
+			peripheral->state = PER_STATE_CONNECTED;
+			peripheral->t_found = conn_connecting_t_found;
+			peripheral->t_connected = k_uptime_get_32();
+			peripheral->t_mtu_done = peripheral->t_connected;
+			peripheral->rssi = BT_HCI_LE_RSSI_NOT_AVAILABLE;
+			peripheral->tx_phy = peripheral->rx_phy = BT_GAP_LE_PHY_1M;
+			peripheral->tx_max_len = peripheral->rx_max_len = LL_OCTETS_DEFAULT;
+			// Link layer procedures, they run alongside the MTU exchange and the discovery
+			link_radio_setup(peripheral);
 		}
 
 		LOG_DBG("Connected (%u): %s", conn_count, addr);
 
+		// Connect the next queued candidate, or resume scanning, while this link is being set up
+		connect_next_candidate();
+
+#if defined(CONFIG_APP_BT_GATT_CACHE)
+		if (peripheral) {
+			gatt_cache_restore(peripheral);
+		}
+#endif
+
 #if defined(CONFIG_BT_SMP)
 		int err = bt_conn_set_security(conn, BT_SECURITY_L2);
 
@@ -334,11 +875,29 @@ static void connected(struct bt_conn *conn, uint8_t reason)
 #endif
 
 #if defined(CONFIG_BT_GATT_CLIENT)
-		mtu_exchange(conn);
+		if (mtu_exchange(conn) && peripheral) {
+			gatt_discover(conn, &peripheral->nus_client);
+		}
+#else
+		if (peripheral) {
+			gatt_discover(conn, &peripheral->nus_client);
+		}
 #endif
 	}
 	// The central/phone connected
 	else {
+		// Ask the app to join the schedule of the pad links
+		struct bt_le_conn_param param = {
+			.interval_min = m_sched_setup.interval,
+			.interval_max = m_sched_setup.interval,
+			.latency = CONN_LATENCY,
+			.timeout = CONN_TIMEOUT_FOR(m_sched_setup.interval, CONN_LATENCY),
+		};
+		int err = bt_conn_le_param_update(conn, &param);
+		if (err) {
+			LOG_WRN("Ctrl link conn param update failed (err %d)", err);
+		}
+		app_bt_sched_link_add(APP_BT_SCHED_SLOT_CTRL, conn);
 		fwd_event_ctrl_link_con_discon(conn, true);
 	}
 }
@@ -357,21 +916,46 @@ static void disconnected(struct bt_conn *conn, uint8_t reason)
 
 		struct per_context_t *peripheral = get_per_context_from_conn(conn);
 		if (peripheral) {
+			if (peripheral->state == PER_STATE_DISC_QUEUED) {
+				discovery_queue_remove(peripheral);
+			}
+			app_bt_tx_reset(peripheral->index);
+			tx_batch_link_drop(peripheral->index);
+			atomic_set(&peripheral->tx_credits, CONFIG_APP_BT_TX_CREDITS);
+			peripheral->tx_inflight_head = 0;
+			app_bt_timesync_stop(peripheral->index);
+			app_bt_health_link_remove(peripheral->index);
+			app_bt_sched_link_remove(peripheral->index);
+			if (per_param_updating == peripheral) {
+				per_param_updating = NULL;
+				k_work_reschedule(&m_work_conn_param, K_NO_WAIT);
+			}
+
+			struct app_bt_tx_stats_t stats;
+			app_bt_tx_stats_get(peripheral->index, &stats);
+			LOG_INF("TX link %i: queued %u, sent %u, dropped %u, collapsed %u", peripheral->index,
+				stats.queued, stats.sent, stats.dropped, stats.collapsed);
 			peripheral->used = false;
+			peripheral->ready = false;
+			peripheral->state = PER_STATE_IDLE;
 		} 
 
 		if ((conn_count == 1U) && is_disconnecting) {
 			is_disconnecting = false;
-			start_scan();
 		}
 		conn_count--;
 
 		LOG_INF("Disconnected (count %i): %s (reason 0x%02x)", conn_count, addr, reason);
 
+		if (!is_disconnecting) {
+			start_scan();
+		}
+
 		fwd_event_con_num_change(conn_count);
 	}
 	// The central (phone) disconnected
 	else {
+		app_bt_sched_link_remove(APP_BT_SCHED_SLOT_CTRL);
 		fwd_event_ctrl_link_con_discon(conn, false);
 	}
 }
@@ -398,6 +982,17 @@ static void le_param_updated(struct bt_conn *conn, uint16_t interval,
 
 	LOG_DBG("LE conn param updated: %s int 0x%04x lat %d to %d",
 	       addr, interval, latency, timeout);
+
+	struct per_context_t *peripheral = get_per_context_from_conn(conn);
+	app_bt_sched_link_add(peripheral ? peripheral->index : APP_BT_SCHED_SLOT_CTRL, conn);
+	if (peripheral && peripheral == per_param_updating) {
+		// Parameters requested for an older mode are applied again
+		struct bt_le_conn_param param;
+		link_conn_param(peripheral->index, &param);
+		peripheral->conn_param_applied = (interval == param.interval_max && latency == param.latency);
+		per_param_updating = NULL;
+		k_work_reschedule(&m_work_conn_param, K_NO_WAIT);
+	}
 }
 
 #if defined(CONFIG_BT_SMP)
@@ -427,6 +1022,18 @@ static void le_phy_updated(struct bt_conn *conn,
 
 	LOG_INF("LE PHY Updated: %s Tx 0x%x, Rx 0x%x", addr, param->tx_phy,
 	       param->rx_phy);
+
+	struct per_context_t *peripheral = get_per_context_from_conn(conn);
+	if (peripheral) {
+		peripheral->tx_phy = param->tx_phy;
+		peripheral->rx_phy = param->rx_phy;
+		// No retry, a pad without 2M support stays on 1M for the lifetime of the link
+		if (peripheral->phy_2m_requested && param->tx_phy != BT_GAP_LE_PHY_2M) {
+			LOG_WRN("Link %i: pad did not take the 2M PHY, falling back to 1M", peripheral->index);
+		}
+		peripheral->phy_2m_requested = false;
+		app_bt_health_phy(peripheral->index, param->tx_phy);
+	}
 }
 #endif /* CONFIG_BT_USER_PHY_UPDATE */
 
@@ -441,6 +1048,16 @@ static void le_data_len_updated(struct bt_conn *conn,
 	LOG_INF("Data length updated: %s max tx %u (%u us) max rx %u (%u us)",
 	       addr, info->tx_max_len, info->tx_max_time, info->rx_max_len,
 	       info->rx_max_time);
+
+	struct per_context_t *peripheral = get_per_context_from_conn(conn);
+	if (peripheral) {
+		peripheral->tx_max_len = info->tx_max_len;
+		peripheral->rx_max_len = info->rx_max_len;
+		if (info->tx_max_len < LL_OCTETS_CMD) {
+			LOG_WRN("Link %i: pad takes %u octets, long commands are split over several packets",
+				peripheral->index, info->tx_max_len);
+		}
+	}
 }
 #endif /* CONFIG_BT_USER_DATA_LEN_UPDATE */
 
@@ -482,28 +1099,224 @@ static void disconnect(struct bt_conn *conn, void *data)
 static uint8_t nus_data_received(struct bt_nus_client *nus, const uint8_t *data, uint16_t len)
 {
 	struct per_context_t *peripheral = get_per_context_from_client(nus);
-	LOG_INF("BT RX (con ind %i): %.*s", peripheral->index, len, data);
+	if (proto_type_peek(data, len) == PROTO_MSG_TIMESYNC_RSP) {
+		union proto_msg_t msg;
+		uint8_t type;
+		if (proto_decode(data, len, &type, &msg) == 0) {
+			app_bt_timesync_rx(peripheral->index, &msg.timesync_rsp);
+		}
+		return BT_GATT_ITER_CONTINUE;
+	}
+	if (proto_type_peek(data, len) == PROTO_MSG_TRIAL_DONE) {
+		airtime_add(false, peripheral->rx_phy, peripheral->rx_max_len, len);
+	}
+	LOG_DBG("BT RX (con ind %i): type %i, %i bytes", peripheral->index, proto_type_peek(data, len), len);
 	fwd_event_rx_data(peripheral->index, data, len);
 	return BT_GATT_ITER_CONTINUE;
 }
-static volatile int packets_queued = 0;
 static void nus_data_sent(struct bt_nus_client *nus, uint8_t err, const uint8_t *const data, uint16_t len)
 {
-	packets_queued--;
+	if (err) {
+		LOG_WRN("NUS write failed (err %d)", err);
+	}
+}
+
+static void tx_pump_work_handler(struct k_work *work);
+K_WORK_DELAYABLE_DEFINE(m_work_tx_pump, tx_pump_work_handler);
+
+/* Multicast batches. The batch id stored with the queued messages is the index in this list + 1 */
+#define TX_BATCH_NUM 4
+static struct tx_batch_t {
+	bool used;
+	uint32_t con_mask;
+	uint32_t pending_mask;
+	uint32_t sent_mask;
+	uint32_t t_first, t_last;
+	app_bt_send_multi_cb_t cb;
+} tx_batch[TX_BATCH_NUM];
+static struct k_spinlock tx_batch_lock;
+static uint32_t tx_batch_skew_worst_us;
+
+#define TX_USER_DATA(con_index, batch, flags) UINT_TO_POINTER((con_index) | ((batch) << 8) | ((flags) << 16))
+#define TX_USER_DATA_CON_INDEX(user_data) (POINTER_TO_UINT(user_data) & 0xFF)
+#define TX_USER_DATA_BATCH(user_data) ((POINTER_TO_UINT(user_data) >> 8) & 0xFF)
+#define TX_USER_DATA_FLAGS(user_data) (POINTER_TO_UINT(user_data) >> 16)
+
+static void tx_batch_link_done(uint32_t con_index, uint8_t batch, bool sent)
+{
+	struct tx_batch_t *b = &tx_batch[batch - 1];
+	struct tx_batch_t done;
+	uint32_t now = k_cycle_get_32();
+
+	k_spinlock_key_t key = k_spin_lock(&tx_batch_lock);
+	if (!b->used || (b->pending_mask & BIT(con_index)) == 0) {
+		k_spin_unlock(&tx_batch_lock, key);
+		return;
+	}
+	if (sent) {
+		if (b->sent_mask == 0) {
+			b->t_first = now;
+		}
+		b->t_last = now;
+		b->sent_mask |= BIT(con_index);
+	}
+	b->pending_mask &= ~BIT(con_index);
+	done = *b;
+	if (b->pending_mask == 0) {
+		b->used = false;
+	}
+	k_spin_unlock(&tx_batch_lock, key);
+
+	if (done.pending_mask == 0) {
+		// Spread between the first and the last link reporting the write as transmitted
+		uint32_t skew_us = k_cyc_to_us_floor32(done.t_last - done.t_first);
+		if (skew_us > tx_batch_skew_worst_us) {
+			tx_batch_skew_worst_us = skew_us;
+		}
+		LOG_DBG("Batch %i done, mask 0x%x sent 0x%x skew %u us (worst %u us)", batch,
+			done.con_mask, done.sent_mask, skew_us, tx_batch_skew_worst_us);
+		if (done.cb) {
+			done.cb(done.con_mask, done.sent_mask, skew_us);
+		}
+	}
+}
+
+static void tx_discard_cb(uint32_t con_index, uint8_t batch)
+{
+	tx_batch_link_done(con_index, batch, false);
+}
+
+/* A link that drops loses the writes already handed to GATT without a TX complete callback, so its
+ * copies of the batches in flight are released here, or the batches would never complete. */
+static void tx_batch_link_drop(uint32_t con_index)
+{
+	for (int b = 0; b < TX_BATCH_NUM; b++) {
+		k_spinlock_key_t key = k_spin_lock(&tx_batch_lock);
+		bool pending = tx_batch[b].used && (tx_batch[b].pending_mask & BIT(con_index));
+		k_spin_unlock(&tx_batch_lock, key);
+		if (pending) {
+			tx_batch_link_done(con_index, b + 1, false);
+		}
+	}
+}
+
+static void tx_complete_cb(struct bt_conn *conn, void *user_data)
+{
+	struct per_context_t *peripheral = &per_context[TX_USER_DATA_CON_INDEX(user_data)];
+	uint8_t batch = TX_USER_DATA_BATCH(user_data);
+
+	if (TX_USER_DATA_FLAGS(user_data) & APP_BT_TX_FLAG_TIMESTAMP) {
+		app_bt_timesync_sent(peripheral->index, timesync_now_us());
+	}
+
+	app_bt_tx_sent(peripheral->index);
+	if (batch != APP_BT_TX_BATCH_NONE) {
+		tx_batch_link_done(peripheral->index, batch, true);
+	}
+	if (peripheral->used && peripheral->conn == conn) {
+		// Writes without response complete in order
+		uint32_t t_queued = peripheral->tx_t_queued[peripheral->tx_inflight_head];
+		peripheral->tx_inflight_head = (peripheral->tx_inflight_head + 1) % CONFIG_APP_BT_TX_CREDITS;
+		uint32_t latency_us = k_cyc_to_us_floor32(k_cycle_get_32() - t_queued);
+		tx_latency_add(latency_us);
+		app_bt_health_tx_latency(peripheral->index, latency_us);
+		atomic_inc(&peripheral->tx_credits);
+		k_work_reschedule(&m_work_tx_pump, K_NO_WAIT);
+	}
+}
+
+// Runs from the system work queue only, so the links are drained by a single consumer
+static void tx_pump_work_handler(struct k_work *work)
+{
+	struct app_bt_tx_msg_t msg;
+	bool retry = false;
+	int err;
+
+	for (int i = 0; i < CONFIG_BT_MAX_CONN; i++) {
+		struct per_context_t *peripheral = &per_context[i];
+		if (!peripheral->used || !peripheral->ready) {
+			continue;
+		}
+		while (atomic_get(&peripheral->tx_credits) > 0 && app_bt_tx_get(i, &msg)) {
+			uint8_t slot = (peripheral->tx_inflight_head + CONFIG_APP_BT_TX_CREDITS -
+					atomic_get(&peripheral->tx_credits)) % CONFIG_APP_BT_TX_CREDITS;
+			peripheral->tx_t_queued[slot] = msg.t_queued;
+			err = bt_gatt_write_without_response_cb(peripheral->conn, peripheral->nus_client.handles.rx,
+								msg.data, msg.len, false, tx_complete_cb,
+								TX_USER_DATA(i, msg.batch, msg.flags));
+			if (err) {
+				// Out of buffers, keep the message and try again when a write completes
+				app_bt_tx_unget(i, &msg);
+				if (atomic_get(&peripheral->tx_credits) == CONFIG_APP_BT_TX_CREDITS) {
+					retry = true;
+				}
+				break;
+			}
+			atomic_dec(&peripheral->tx_credits);
+			if (proto_type_peek(msg.data, msg.len) == PROTO_MSG_LED) {
+				airtime_add(true, peripheral->tx_phy, peripheral->tx_max_len, msg.len);
+			}
+		}
+	}
+
+	if (retry) {
+		k_work_reschedule(&m_work_tx_pump, K_MSEC(TX_RETRY_DELAY_MS));
+	}
+}
+
+static int timesync_send(uint32_t con_index, const uint8_t *data, uint16_t len)
+{
+	// Sync requests are timestamped when the stack reports them as transmitted
+	uint8_t flags = (proto_type_peek(data, len) == PROTO_MSG_TIMESYNC_REQ) ? APP_BT_TX_FLAG_TIMESTAMP : 0;
+	int ret;
+
+	if (!per_context[con_index].ready) {
+		return -EBUSY;
+	}
+	ret = app_bt_tx_put(con_index, data, len, APP_BT_TX_PRIO_CMD, APP_BT_TX_BATCH_NONE, flags);
+	if (ret == 0) {
+		k_work_reschedule(&m_work_tx_pump, K_NO_WAIT);
+	}
+	return ret;
 }
 
 int app_bt_init(app_bt_callback_t callback)
 {
 	int err;
 
+#if defined(CONFIG_APP_BT_GATT_CACHE)
+	err = app_bt_cache_init();
+	if (err) {
+		return err;
+	}
+#endif
+
 	err = bt_enable(NULL);
 	if (err) {
 		LOG_ERR("Bluetooth init failed (err %d)", err);
 		return err;
 	}
 
+	err = app_bt_sched_init();
+	if (err) {
+		return err;
+	}
+	app_bt_sched_plan(CONFIG_BT_MAX_CONN, 0, &m_sched_setup);
+
+#if defined(CONFIG_SETTINGS)
+	// Loads the bonding information and the GATT cache
+	settings_load();
+#endif
+
 	m_callback = callback;
 
+	app_bt_tx_init(tx_discard_cb);
+	app_bt_timesync_init(timesync_send);
+	struct k_work_queue_config wq_cfg = {.name = "link_wq"};
+	k_work_queue_start(&m_link_wq, m_link_wq_stack, K_THREAD_STACK_SIZEOF(m_link_wq_stack),
+			   LINK_WQ_PRIORITY, &wq_cfg);
+	app_bt_health_init(health_param_refresh, &m_link_wq);
+
 	LOG_INF("Bluetooth initialized");
 
 	struct bt_nus_client_init_param init = {
@@ -524,29 +1337,107 @@ int app_bt_init(app_bt_callback_t callback)
 
 	bt_conn_cb_register(&conn_callbacks);
 
+	app_bt_scan_init(adv_target_name, device_found);
+#if defined(CONFIG_APP_FED_MASTER)
+	app_bt_scan_name_add(APP_BT_FED_SATELLITE_NAME);
+#endif
 	start_scan();
 
+	k_work_reschedule_for_queue(&m_link_wq, &m_work_rssi, K_MSEC(CONFIG_APP_BT_RSSI_PERIOD_MS));
+
 	return 0;
 }
 
-int app_bt_send_str(uint32_t con_index, const uint8_t *string, uint16_t len)
+int app_bt_send_prio(uint32_t con_index, const uint8_t *string, uint16_t len, enum app_bt_tx_prio_t prio)
 {
 	int ret;
 	if (con_index >= CONFIG_BT_MAX_CONN) {
 		return -EINVAL;
 	}
-	if (per_context[con_index].ready) {
-		ret = bt_nus_client_send(&(per_context[con_index].nus_client), string, len);
-		if (ret < 0) {
-			LOG_ERR("ERROR sending to client %i: %i. PQ %i", con_index, ret, packets_queued);
-			return ret;
+	if (!per_context[con_index].ready) {
+		return -EBUSY;
+	}
+	ret = app_bt_tx_put(con_index, string, len, prio, APP_BT_TX_BATCH_NONE, 0);
+	if (ret < 0) {
+		LOG_ERR("ERROR queuing to client %i: %i", con_index, ret);
+		return ret;
+	}
+	k_work_reschedule(&m_work_tx_pump, K_NO_WAIT);
+	return 0;
+}
+
+int app_bt_send_multi(uint32_t con_mask, const uint8_t *string, uint16_t len,
+		      enum app_bt_tx_prio_t prio, app_bt_send_multi_cb_t cb)
+{
+	uint8_t batch = APP_BT_TX_BATCH_NONE;
+	uint32_t ready_mask = 0;
+
+	for (int i = 0; i < CONFIG_BT_MAX_CONN; i++) {
+		if (per_context[i].ready) {
+			ready_mask |= BIT(i);
+		}
+	}
+	con_mask &= ready_mask;
+	if (con_mask == 0) {
+		return -ENOTCONN;
+	}
+
+	k_spinlock_key_t key = k_spin_lock(&tx_batch_lock);
+	for (int i = 0; i < TX_BATCH_NUM; i++) {
+		if (!tx_batch[i].used) {
+			tx_batch[i].used = true;
+			tx_batch[i].con_mask = con_mask;
+			tx_batch[i].pending_mask = con_mask;
+			tx_batch[i].sent_mask = 0;
+			tx_batch[i].cb = cb;
+			batch = i + 1;
+			break;
 		}
-		packets_queued++;
 	}
-	else return -EBUSY;
+	k_spin_unlock(&tx_batch_lock, key);
+	if (batch == APP_BT_TX_BATCH_NONE) {
+		// Out of batch slots, the messages are still sent but without a batch callback
+		LOG_WRN("No free TX batch, sending untracked");
+	}
+
+	// Queue to every link before the pump runs, so the writes go to the controller back to back
+	for (int i = 0; i < CONFIG_BT_MAX_CONN; i++) {
+		if (con_mask & BIT(i)) {
+			app_bt_tx_put(i, string, len, prio, batch, 0);
+		}
+	}
+	k_work_reschedule(&m_work_tx_pump, K_NO_WAIT);
 	return 0;
 }
 
+uint32_t app_bt_send_multi_skew_worst_us(void)
+{
+	return tx_batch_skew_worst_us;
+}
+
+void app_bt_airtime_stats_get(struct app_bt_airtime_stats_t *stats)
+{
+	k_spinlock_key_t key = k_spin_lock(&airtime_lock);
+	stats->led_count = airtime.led_count;
+	stats->led_avg_us = airtime.led_count ? (uint32_t)(airtime.led_us / airtime.led_count) : 0;
+	stats->led_avg_us_base = airtime.led_count ? (uint32_t)(airtime.led_us_base / airtime.led_count) : 0;
+	stats->td_count = airtime.td_count;
+	stats->td_avg_us = airtime.td_count ? (uint32_t)(airtime.td_us / airtime.td_count) : 0;
+	stats->td_avg_us_base = airtime.td_count ? (uint32_t)(airtime.td_us_base / airtime.td_count) : 0;
+	k_spin_unlock(&airtime_lock, key);
+}
+
+void app_bt_conn_mode_set(enum app_bt_conn_mode_t mode)
+{
+	atomic_set(&m_conn_mode_requested, mode);
+	k_work_reschedule(&m_work_conn_param, K_NO_WAIT);
+}
+
+int app_bt_send_str(uint32_t con_index, const uint8_t *string, uint16_t len)
+{
+	return app_bt_send_prio(con_index, string, len, APP_BT_TX_PRIO_CMD);
+}
+
 void app_bt_disconnect_all(void)
 {
 	LOG_DBG("Disconnecting all...");
@@ -4,22 +4,56 @@
 #include <zephyr/kernel.h>
 #include <zephyr/bluetooth/conn.h>
 #include <color.h>
+#include <app_bt_tx.h>
 
 enum {APP_BT_EVT_CON_NUM_CHANGE, APP_BT_EVT_RX_DATA, APP_BT_EVT_CTRL_CONNECTED, APP_BT_EVT_CTRL_DISCONNECTED};
 
 struct app_bt_evt_t {
     uint32_t type;
     uint32_t num_connected;
+    // Pads ready to take commands, by con_index. Wide enough for every PAwR pad index.
+    uint64_t ready_mask;
     const uint8_t *data;
     uint16_t data_len;
     uint32_t con_index;
+    // Latest RSSI of the link the data came from, BT_HCI_LE_RSSI_NOT_AVAILABLE if not known yet
+    int8_t rssi;
 	struct bt_conn *ctrl_conn;
 };
 
 typedef void (*app_bt_callback_t)(struct app_bt_evt_t *event);
 
+// Estimated on-air time of the LED commands and trial results since the game started, on the PHY and
+// data length of each link, and on the 1M PHY with 27 octet packets for comparison
+struct app_bt_airtime_stats_t {
+    uint32_t led_count;
+    uint32_t led_avg_us;
+    uint32_t led_avg_us_base;
+    uint32_t td_count;
+    uint32_t td_avg_us;
+    uint32_t td_avg_us_base;
+};
+
+// Idle uses a long interval with peripheral latency, active a short interval for quick command delivery
+enum app_bt_conn_mode_t {APP_BT_CONN_MODE_IDLE, APP_BT_CONN_MODE_ACTIVE};
+
+// Called once every link in a multicast has sent or discarded the message. The skew is the time between the first and last link sending it.
+typedef void (*app_bt_send_multi_cb_t)(uint32_t con_mask, uint32_t sent_mask, uint32_t skew_us);
+
 int app_bt_init(app_bt_callback_t callback);
 
 int app_bt_send_str(uint32_t con_index, const uint8_t *string, uint16_t len);
 
+int app_bt_send_prio(uint32_t con_index, const uint8_t *string, uint16_t len, enum app_bt_tx_prio_t prio);
+
+int app_bt_send_multi(uint32_t con_mask, const uint8_t *string, uint16_t len,
+		      enum app_bt_tx_prio_t prio, app_bt_send_multi_cb_t cb);
+
+uint32_t app_bt_send_multi_skew_worst_us(void);
+
+void app_bt_airtime_stats_get(struct app_bt_airtime_stats_t *stats);
+
+// Switch the connection parameters of all the links. Links connected later use the current mode once they are ready.
+void app_bt_conn_mode_set(enum app_bt_conn_mode_t mode);
+
 #endif
@@ -0,0 +1,183 @@
+#include <app_bt_cache.h>
+#include <zephyr/settings/settings.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(app_bt_cache, LOG_LEVEL_INF);
+
+#define CACHE_SIZE CONFIG_APP_BT_GATT_CACHE_SIZE
+#define CACHE_SETTINGS_ROOT "nus_cache"
+
+struct cache_entry_t {
+	bt_addr_le_t addr;
+	struct bt_nus_client_handles handles;
+	uint32_t age;
+	bool valid;
+};
+
+static struct cache_entry_t cache[CACHE_SIZE];
+static uint32_t cache_age_counter;
+static atomic_t cache_dirty_mask;
+
+static struct k_spinlock cache_lock;
+
+static void cache_save_work_handler(struct k_work *work);
+K_WORK_DEFINE(m_work_cache_save, cache_save_work_handler);
+
+static int cache_find(const bt_addr_le_t *addr)
+{
+	for (int i = 0; i < CACHE_SIZE; i++) {
+		if (cache[i].valid && bt_addr_le_cmp(&cache[i].addr, addr) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+static int cache_find_free_or_oldest(void)
+{
+	int oldest = 0;
+	for (int i = 0; i < CACHE_SIZE; i++) {
+		if (!cache[i].valid) {
+			return i;
+		}
+		if (cache[i].age < cache[oldest].age) {
+			oldest = i;
+		}
+	}
+	return oldest;
+}
+
+static int cache_settings_set(const char *name, size_t len, settings_read_cb read_cb, void *cb_arg)
+{
+	struct cache_entry_t entry;
+	int index = atoi(name);
+
+	if (index < 0 || index >= CACHE_SIZE || len != sizeof(entry)) {
+		return -EINVAL;
+	}
+	if (read_cb(cb_arg, &entry, sizeof(entry)) != sizeof(entry)) {
+		return -EIO;
+	}
+	cache[index] = entry;
+	if (entry.age >= cache_age_counter) {
+		cache_age_counter = entry.age + 1;
+	}
+	return 0;
+}
+
+SETTINGS_STATIC_HANDLER_DEFINE(app_bt_cache, CACHE_SETTINGS_ROOT, NULL, cache_settings_set, NULL, NULL);
+
+static void cache_save_work_handler(struct k_work *work)
+{
+	char key[sizeof(CACHE_SETTINGS_ROOT) + 4];
+	struct cache_entry_t entry;
+	uint32_t dirty = atomic_clear(&cache_dirty_mask);
+	int err;
+
+	for (int i = 0; i < CACHE_SIZE; i++) {
+		if ((dirty & BIT(i)) == 0) {
+			continue;
+		}
+		k_spinlock_key_t key_lock = k_spin_lock(&cache_lock);
+		entry = cache[i];
+		k_spin_unlock(&cache_lock, key_lock);
+
+		snprintf(key, sizeof(key), CACHE_SETTINGS_ROOT "/%i", i);
+		if (entry.valid) {
+			err = settings_save_one(key, &entry, sizeof(entry));
+		} else {
+			err = settings_delete(key);
+		}
+		if (err) {
+			LOG_ERR("Failed to save cache entry %i (err %i)", i, err);
+		}
+	}
+}
+
+int app_bt_cache_init(void)
+{
+	int err = settings_subsys_init();
+	if (err) {
+		LOG_ERR("Settings init failed (err %i)", err);
+		return err;
+	}
+	return 0;
+}
+
+bool app_bt_cache_get(const bt_addr_le_t *addr, struct bt_nus_client_handles *handles)
+{
+	bool found = false;
+	k_spinlock_key_t key = k_spin_lock(&cache_lock);
+	int index = cache_find(addr);
+	if (index >= 0) {
+		*handles = cache[index].handles;
+		found = true;
+	}
+	k_spin_unlock(&cache_lock, key);
+	return found;
+}
+
+void app_bt_cache_store(const bt_addr_le_t *addr, const struct bt_nus_client_handles *handles)
+{
+	k_spinlock_key_t key = k_spin_lock(&cache_lock);
+	int index = cache_find(addr);
+	if (index >= 0 && memcmp(&cache[index].handles, handles, sizeof(*handles)) == 0) {
+		// Already up to date, only refresh the age in RAM to avoid wearing the flash
+		cache[index].age = cache_age_counter++;
+		k_spin_unlock(&cache_lock, key);
+		return;
+	}
+	if (index < 0) {
+		index = cache_find_free_or_oldest();
+	}
+	bt_addr_le_copy(&cache[index].addr, addr);
+	cache[index].handles = *handles;
+	cache[index].age = cache_age_counter++;
+	cache[index].valid = true;
+	k_spin_unlock(&cache_lock, key);
+
+	atomic_or(&cache_dirty_mask, BIT(index));
+	k_work_submit(&m_work_cache_save);
+}
+
+uint32_t app_bt_cache_addr_get(bt_addr_le_t *addrs, uint32_t max)
+{
+	uint32_t num = 0;
+	uint32_t age_limit = UINT32_MAX;
+
+	k_spinlock_key_t key = k_spin_lock(&cache_lock);
+	// Pick the youngest entry below the previous one, until the list is full
+	while (num < max) {
+		int newest = -1;
+		for (int i = 0; i < CACHE_SIZE; i++) {
+			if (cache[i].valid && cache[i].age < age_limit &&
+			    (newest < 0 || cache[i].age > cache[newest].age)) {
+				newest = i;
+			}
+		}
+		if (newest < 0) {
+			break;
+		}
+		bt_addr_le_copy(&addrs[num++], &cache[newest].addr);
+		age_limit = cache[newest].age;
+	}
+	k_spin_unlock(&cache_lock, key);
+	return num;
+}
+
+void app_bt_cache_invalidate(const bt_addr_le_t *addr)
+{
+	k_spinlock_key_t key = k_spin_lock(&cache_lock);
+	int index = cache_find(addr);
+	if (index >= 0) {
+		cache[index].valid = false;
+	}
+	k_spin_unlock(&cache_lock, key);
+
+	if (index >= 0) {
+		atomic_or(&cache_dirty_mask, BIT(index));
+		k_work_submit(&m_work_cache_save);
+	}
+}
@@ -0,0 +1,22 @@
+#ifndef __APP_BT_CACHE_H
+#define __APP_BT_CACHE_H
+
+#include <zephyr/kernel.h>
+#include <zephyr/bluetooth/addr.h>
+#include <bluetooth/services/nus_client.h>
+
+int app_bt_cache_init(void);
+
+// Look up the NUS handles previously discovered on the peripheral with the given address
+bool app_bt_cache_get(const bt_addr_le_t *addr, struct bt_nus_client_handles *handles);
+
+// Store the NUS handles for a peripheral. The flash write is deferred to the system work queue.
+void app_bt_cache_store(const bt_addr_le_t *addr, const struct bt_nus_client_handles *handles);
+
+// Copy the addresses of the known peripherals, most recently used first. Returns the number of addresses.
+uint32_t app_bt_cache_addr_get(bt_addr_le_t *addrs, uint32_t max);
+
+// Remove a stale entry, ie. if the cached handles turned out not to work
+void app_bt_cache_invalidate(const bt_addr_le_t *addr);
+
+#endif
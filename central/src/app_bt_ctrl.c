@@ -24,20 +24,88 @@ static const struct bt_data sd[] = {
 };
 
 static struct bt_conn *current_conn = 0;
+static app_bt_ctrl_callback_t m_callback;
+
+/* Game updates are packed into one notification, up to the MTU, and sent when the next one does
+ * not fit or at the flush deadline. In the binary protocol the frames are length prefixed after a
+ * PROTO_MSG_CTRL_BATCH header. The legacy frames have a fixed length per letter, and are simply
+ * put back to back. */
+#if defined(CONFIG_APP_CTRL_PROTO_LEGACY)
+#define TX_AGG_HDR_LEN		0
+#define TX_AGG_FRAME_OVERHEAD	0
+#else
+#define TX_AGG_HDR_LEN		1
+#define TX_AGG_FRAME_OVERHEAD	1
+#endif
+
+static struct {
+	uint8_t buf[CONFIG_BT_L2CAP_TX_MTU - 3];
+	uint16_t len;
+	uint16_t frames;
+} tx_agg;
+static struct app_bt_ctrl_tx_stats_t m_tx_stats;
+K_MUTEX_DEFINE(m_tx_mutex);
+
+static void tx_flush_work_handler(struct k_work *work);
+K_WORK_DELAYABLE_DEFINE(m_work_tx_flush, tx_flush_work_handler);
+
+/* Recent updates are kept in a ring, along with a snapshot of the game state provided by the game.
+ * A reconnecting app gets the snapshot, then the updates sent after it, once it has enabled
+ * notifications. Live updates are held back until then, so they come after the catch-up. */
+#define REPLAY_LEN CONFIG_APP_CTRL_REPLAY_LEN
+
+static struct {
+	struct {
+		uint8_t len;
+		uint8_t data[PROTO_FRAME_MAX];
+	} frame[REPLAY_LEN];
+	// Sequence number of the next update, update n is kept in frame[n % REPLAY_LEN]
+	uint32_t seq_next;
+	struct proto_snapshot_t snapshot;
+	bool snapshot_valid;
+	// First update that is not included in the snapshot
+	uint32_t snapshot_seq;
+#if defined(CONFIG_APP_CTRL_PROTO_LEGACY)
+	// Result of the last game, the snapshot does not carry the times the legacy app shows with it
+	struct proto_game_finish_t game_finish;
+	bool game_finish_valid;
+#endif
+} replay;
+static atomic_t catchup_pending;
+
+static void catchup_work_handler(struct k_work *work);
+K_WORK_DEFINE(m_work_catchup, catchup_work_handler);
 
 static void bt_receive_cb(struct bt_conn *conn, const uint8_t *const data,
 			  uint16_t len)
 {
-	LOG_INF("CTRL data received, %i bytes", len);
+	LOG_DBG("CTRL data received, %i bytes", len);
+	if (m_callback) {
+		struct app_bt_ctrl_evt_t evt = {.type = APP_BT_CTRL_EVT_RX_DATA, .data = data, .data_len = len};
+		m_callback(&evt);
+	}
+}
+
+static void bt_send_enabled_cb(enum bt_nus_send_status status)
+{
+	if (status == BT_NUS_SEND_STATUS_ENABLED && atomic_get(&catchup_pending)) {
+		k_work_submit(&m_work_catchup);
+	}
+	if (status == BT_NUS_SEND_STATUS_ENABLED && m_callback) {
+		struct app_bt_ctrl_evt_t evt = {.type = APP_BT_CTRL_EVT_SUBSCRIBED};
+		m_callback(&evt);
+	}
 }
 
 static struct bt_nus_cb nus_cb = {
 	.received = bt_receive_cb,
+	.send_enabled = bt_send_enabled_cb,
 };
 
 int app_bt_ctrl_connected(struct bt_conn *conn)
 {
 	LOG_INF("Connected!");
+	atomic_set(&catchup_pending, 1);
 	current_conn = conn;
 	return 0;
 }
@@ -51,6 +119,8 @@ int app_bt_ctrl_disconnected(struct bt_conn *conn)
 
 int app_bt_ctrl_init(app_bt_ctrl_callback_t callback)
 {
+	m_callback = callback;
+
 	int err = bt_nus_init(&nus_cb);
 	if (err) {
 		LOG_ERR("Failed to initialize UART service (err: %d)", err);
@@ -69,17 +139,329 @@ int app_bt_ctrl_init(app_bt_ctrl_callback_t callback)
 	return 0;
 }
 
-int app_bt_ctrl_send_str(const uint8_t *string, uint16_t len)
-{	
+static int ctrl_notify(const uint8_t *data, uint16_t len)
+{
 	int err;
 	if (current_conn == 0) {
 		LOG_WRN("No controller connected. Ignoring peripheral TX");
 		return -ENOTCONN;
 	}
-	err = bt_nus_send(current_conn, string, len); 
+	err = bt_nus_send(current_conn, data, len);
 	if (err < 0) {
 		LOG_WRN("Failed to send data over BLE connection");
+		m_tx_stats.send_errors++;
 		return err;
 	}
+	m_tx_stats.notifications++;
+	m_tx_stats.bytes += len;
 	return 0;
 }
+
+// Send the aggregated frames. Called with the TX mutex held.
+static int tx_agg_flush(void)
+{
+	int err = 0;
+
+	if (tx_agg.frames == 0) {
+		return 0;
+	}
+#if !defined(CONFIG_APP_CTRL_PROTO_LEGACY)
+	// A single frame goes without the batch header
+	if (tx_agg.frames == 1) {
+		err = ctrl_notify(&tx_agg.buf[2], tx_agg.len - 2);
+	}
+	else
+#endif
+	{
+		err = ctrl_notify(tx_agg.buf, tx_agg.len);
+	}
+	tx_agg.len = 0;
+	tx_agg.frames = 0;
+	k_work_cancel_delayable(&m_work_tx_flush);
+	return err;
+}
+
+static void tx_flush_work_handler(struct k_work *work)
+{
+	k_mutex_lock(&m_tx_mutex, K_FOREVER);
+	if (tx_agg.frames > 0) {
+		m_tx_stats.flush_deadline++;
+	}
+	tx_agg_flush();
+	k_mutex_unlock(&m_tx_mutex);
+}
+
+/* Add a frame to the notification being aggregated, sending it first if the frame does not fit
+ * the MTU. The first frame sets the flush deadline, later frames do not push it out.
+ * Called with the TX mutex held. */
+static int tx_agg_add(const uint8_t *frame, uint16_t len)
+{
+	uint16_t mtu = MIN(app_bt_ctrl_mtu_get(), sizeof(tx_agg.buf));
+	uint16_t frame_len = len + TX_AGG_FRAME_OVERHEAD;
+	int err = 0;
+
+	if (mtu == 0) {
+		return -ENOTCONN;
+	}
+
+	m_tx_stats.frames++;
+	if (tx_agg.frames > 0 && tx_agg.len + frame_len > mtu) {
+		m_tx_stats.flush_full++;
+		err = tx_agg_flush();
+	}
+	if (tx_agg.frames == 0) {
+		tx_agg.len = TX_AGG_HDR_LEN;
+#if !defined(CONFIG_APP_CTRL_PROTO_LEGACY)
+		tx_agg.buf[0] = PROTO_HDR(PROTO_MSG_CTRL_BATCH);
+#endif
+	}
+	if (tx_agg.len + frame_len > mtu) {
+		// Larger than the MTU on its own, it will be split by the stack
+		return ctrl_notify(frame, len);
+	}
+#if !defined(CONFIG_APP_CTRL_PROTO_LEGACY)
+	tx_agg.buf[tx_agg.len++] = len;
+#endif
+	memcpy(&tx_agg.buf[tx_agg.len], frame, len);
+	tx_agg.len += len;
+	if (tx_agg.frames++ == 0) {
+		k_work_schedule(&m_work_tx_flush, K_MSEC(CONFIG_APP_CTRL_TX_FLUSH_MS));
+	}
+	return err;
+}
+
+int app_bt_ctrl_send_str(const uint8_t *string, uint16_t len)
+{
+	int err;
+
+	// Frames sent as is still go after the aggregated ones
+	k_mutex_lock(&m_tx_mutex, K_FOREVER);
+	tx_agg_flush();
+	m_tx_stats.frames++;
+	err = ctrl_notify(string, len);
+	k_mutex_unlock(&m_tx_mutex);
+	return err;
+}
+
+void app_bt_ctrl_flush(void)
+{
+	k_mutex_lock(&m_tx_mutex, K_FOREVER);
+	if (tx_agg.frames > 0) {
+		m_tx_stats.flush_explicit++;
+	}
+	tx_agg_flush();
+	k_mutex_unlock(&m_tx_mutex);
+}
+
+void app_bt_ctrl_tx_stats_get(struct app_bt_ctrl_tx_stats_t *stats)
+{
+	k_mutex_lock(&m_tx_mutex, K_FOREVER);
+	*stats = m_tx_stats;
+	k_mutex_unlock(&m_tx_mutex);
+}
+
+uint16_t app_bt_ctrl_mtu_get(void)
+{
+	struct bt_conn *conn = current_conn;
+
+	return conn ? bt_nus_get_mtu(conn) : 0;
+}
+
+#if defined(CONFIG_APP_CTRL_PROTO_LEGACY)
+#define PUT_BE16(buf, i, val) do{buf[i++] = (uint8_t)((val) >> 8); buf[i++] = (uint8_t)(val);}while(0)
+
+// Single letter framing understood by the original control app, big endian fields
+static int legacy_encode(uint8_t type, const void *msg, uint8_t *buf)
+{
+	int i = 0;
+	switch (type) {
+		case PROTO_MSG_CHG_START: {
+			const struct proto_chg_start_t *m = msg;
+			buf[i++] = 'A';
+			buf[i++] = m->pad;
+			buf[i++] = m->num_players;
+			PUT_BE16(buf, i, m->target_ms);
+			break;
+		}
+		case PROTO_MSG_CHG_FINISH: {
+			const struct proto_chg_finish_t *m = msg;
+			buf[i++] = 'B';
+			buf[i++] = m->pad;
+			PUT_BE16(buf, i, m->time_ms);
+			PUT_BE16(buf, i, m->target_ms);
+			buf[i++] = m->success;
+			PUT_BE16(buf, i, m->points);
+			PUT_BE16(buf, i, m->fouls);
+			break;
+		}
+		case PROTO_MSG_ROUND_START: {
+			const struct proto_round_start_t *m = msg;
+			buf[i++] = 'C';
+			buf[i++] = m->round;
+			buf[i++] = m->round_total;
+			buf[i++] = m->num_players;
+			PUT_BE16(buf, i, m->target_ms);
+			break;
+		}
+		case PROTO_MSG_GAME_START:
+			buf[i++] = 'D';
+			break;
+		case PROTO_MSG_GAME_FINISH: {
+			const struct proto_game_finish_t *m = msg;
+			buf[i++] = 'E';
+			PUT_BE16(buf, i, m->score);
+			PUT_BE16(buf, i, m->min_ms);
+			PUT_BE16(buf, i, m->max_ms);
+			PUT_BE16(buf, i, m->avg_ms);
+			break;
+		}
+		case PROTO_MSG_NUM_CON: {
+			const struct proto_num_con_t *m = msg;
+			buf[i++] = 'F';
+			buf[i++] = m->num;
+			break;
+		}
+		default:
+			// No legacy framing, the message is new to the binary protocol
+			return 0;
+	}
+	return i;
+}
+#endif
+
+static int ctrl_encode(uint8_t type, const void *msg, uint8_t *buf)
+{
+#if defined(CONFIG_APP_CTRL_PROTO_LEGACY)
+	return legacy_encode(type, msg, buf);
+#else
+	return proto_encode(type, msg, buf, PROTO_FRAME_MAX);
+#endif
+}
+
+// Called with the TX mutex held
+static void replay_put(const uint8_t *frame, uint8_t len)
+{
+	uint32_t slot = replay.seq_next++ % REPLAY_LEN;
+
+	replay.frame[slot].len = len;
+	memcpy(replay.frame[slot].data, frame, len);
+}
+
+// Called with the TX mutex held
+static void snapshot_add(const struct proto_snapshot_t *snap)
+{
+	uint8_t buf[PROTO_FRAME_MAX];
+	int len;
+
+#if defined(CONFIG_APP_CTRL_PROTO_LEGACY)
+	// The legacy app has no snapshot message, so rebuild the state from the ones it knows
+	struct proto_num_con_t num_con = {.num = snap->num_players};
+	len = ctrl_encode(PROTO_MSG_NUM_CON, &num_con, buf);
+	tx_agg_add(buf, len);
+	if (snap->state == PROTO_GAME_RUNNING) {
+		struct proto_round_start_t round = {.round = snap->round, .round_total = snap->round_total,
+						    .num_players = snap->num_players, .target_ms = snap->target_ms};
+		len = ctrl_encode(PROTO_MSG_GAME_START, NULL, buf);
+		tx_agg_add(buf, len);
+		len = ctrl_encode(PROTO_MSG_ROUND_START, &round, buf);
+		tx_agg_add(buf, len);
+		if (snap->challenges > 0) {
+			// The app resets the score on the game start, and adds up the points and fouls of the results.
+			// A single result with all the points so far brings it back to the current score.
+			struct proto_chg_finish_t result = {.success = (snap->last_ms > 0 && snap->last_ms < snap->target_ms),
+							    .time_ms = snap->last_ms, .target_ms = snap->target_ms,
+							    .points = (uint16_t)(snap->score + snap->fouls),
+							    .fouls = snap->fouls};
+			len = ctrl_encode(PROTO_MSG_CHG_FINISH, &result, buf);
+			tx_agg_add(buf, len);
+		}
+	}
+	else if (snap->state == PROTO_GAME_FINISHED) {
+		struct proto_game_finish_t finish = {.score = snap->score};
+		len = ctrl_encode(PROTO_MSG_GAME_FINISH, replay.game_finish_valid ? &replay.game_finish : &finish, buf);
+		tx_agg_add(buf, len);
+	}
+#else
+	len = ctrl_encode(PROTO_MSG_SNAPSHOT, snap, buf);
+	if (len > 0) {
+		tx_agg_add(buf, len);
+	}
+#endif
+}
+
+static void catchup_work_handler(struct k_work *work)
+{
+	uint32_t seq, seq_oldest, replayed = 0;
+
+	k_mutex_lock(&m_tx_mutex, K_FOREVER);
+	atomic_set(&catchup_pending, 0);
+	if (current_conn == 0) {
+		k_mutex_unlock(&m_tx_mutex);
+		return;
+	}
+	tx_agg_flush();
+	seq = 0;
+	if (replay.snapshot_valid) {
+		snapshot_add(&replay.snapshot);
+		seq = replay.snapshot_seq;
+	}
+	seq_oldest = (replay.seq_next > REPLAY_LEN) ? replay.seq_next - REPLAY_LEN : 0;
+	if (seq < seq_oldest) {
+		m_tx_stats.replay_lost += seq_oldest - seq;
+		seq = seq_oldest;
+	}
+	for (; seq < replay.seq_next; seq++) {
+		uint32_t slot = seq % REPLAY_LEN;
+		tx_agg_add(replay.frame[slot].data, replay.frame[slot].len);
+		replayed++;
+	}
+	tx_agg_flush();
+	m_tx_stats.catchups++;
+	m_tx_stats.replayed += replayed;
+	k_mutex_unlock(&m_tx_mutex);
+
+	LOG_INF("Ctrl catch-up: snapshot %s, %u updates replayed", replay.snapshot_valid ? "sent" : "none",
+		replayed);
+}
+
+int app_bt_ctrl_send_msg(uint8_t type, const void *msg)
+{
+	uint8_t buf[PROTO_FRAME_MAX];
+	int len, err = 0;
+
+	if (type == PROTO_MSG_SNAPSHOT) {
+		// Kept for a reconnecting app, the connected app follows the state from the updates
+		k_mutex_lock(&m_tx_mutex, K_FOREVER);
+		replay.snapshot = *(const struct proto_snapshot_t *)msg;
+		replay.snapshot_valid = true;
+		replay.snapshot_seq = replay.seq_next;
+		k_mutex_unlock(&m_tx_mutex);
+		return 0;
+	}
+
+	len = ctrl_encode(type, msg, buf);
+	if (len < 0) {
+		LOG_ERR("Failed to encode ctrl message %i (err %i)", type, len);
+		return len;
+	}
+	if (len == 0) {
+		return 0;
+	}
+
+	k_mutex_lock(&m_tx_mutex, K_FOREVER);
+	replay_put(buf, len);
+#if defined(CONFIG_APP_CTRL_PROTO_LEGACY)
+	if (type == PROTO_MSG_GAME_FINISH) {
+		replay.game_finish = *(const struct proto_game_finish_t *)msg;
+		replay.game_finish_valid = true;
+	}
+	else if (type == PROTO_MSG_GAME_START) {
+		replay.game_finish_valid = false;
+	}
+#endif
+	if (!atomic_get(&catchup_pending)) {
+		err = tx_agg_add(buf, len);
+	}
+	k_mutex_unlock(&m_tx_mutex);
+	return err;
+}
@@ -3,8 +3,10 @@
 
 #include <zephyr/kernel.h>
 #include <zephyr/bluetooth/conn.h>
+#include <proto.h>
 
-enum {APP_BT_CTRL_EVT_RX_DATA};
+// SUBSCRIBED: the peer enabled notifications, so frames can be sent to it from now on
+enum {APP_BT_CTRL_EVT_RX_DATA, APP_BT_CTRL_EVT_SUBSCRIBED};
 
 struct app_bt_ctrl_evt_t {
     uint32_t type;
@@ -12,6 +14,22 @@ struct app_bt_ctrl_evt_t {
     uint16_t data_len;
 };
 
+struct app_bt_ctrl_tx_stats_t {
+    // Frames given to the link, and the notifications and bytes they were sent in
+    uint32_t frames;
+    uint32_t notifications;
+    uint32_t bytes;
+    uint32_t send_errors;
+    // Why the aggregated notifications were sent: next frame did not fit, deadline, or app_bt_ctrl_flush()
+    uint32_t flush_full;
+    uint32_t flush_deadline;
+    uint32_t flush_explicit;
+    // Reconnect catch-ups, the updates replayed, and the updates lost because the replay ring wrapped
+    uint32_t catchups;
+    uint32_t replayed;
+    uint32_t replay_lost;
+};
+
 typedef void (*app_bt_ctrl_callback_t)(struct app_bt_ctrl_evt_t *event);
 
 int app_bt_ctrl_connected(struct bt_conn *conn);
@@ -20,6 +38,20 @@ int app_bt_ctrl_disconnected(struct bt_conn *conn);
 
 int app_bt_ctrl_init(app_bt_ctrl_callback_t callback);
 
+// Send a frame in a notification of its own, after any aggregated frames
 int app_bt_ctrl_send_str(const uint8_t *string, uint16_t len);
 
+// Largest payload that fits one notification on the control link, 0 if the app is not connected
+uint16_t app_bt_ctrl_mtu_get(void);
+
+// Send a game update to the control app, encoded as set by CONFIG_APP_CTRL_PROTO_LEGACY. The update
+// is aggregated with the following ones, and sent within CONFIG_APP_CTRL_TX_FLUSH_MS.
+// A PROTO_MSG_SNAPSHOT is not sent, but kept for an app that reconnects, along with the updates after it.
+int app_bt_ctrl_send_msg(uint8_t type, const void *msg);
+
+// Send the aggregated updates now
+void app_bt_ctrl_flush(void);
+
+void app_bt_ctrl_tx_stats_get(struct app_bt_ctrl_tx_stats_t *stats);
+
 #endif
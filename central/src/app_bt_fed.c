@@ -0,0 +1,272 @@
+#include <app_bt_fed.h>
+#include <timesync.h>
+#include <zephyr/sys/byteorder.h>
+
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(app_bt_fed, LOG_LEVEL_INF);
+
+#define SATELLITES_MAX	CONFIG_APP_FED_SATELLITES_MAX
+
+BUILD_ASSERT(APP_BT_FED_PADS_DIRECT + SATELLITES_MAX * APP_BT_FED_PADS_PR_SATELLITE <= 64,
+	     "The global pad index space must fit the 64 bit pad masks of the game");
+BUILD_ASSERT(APP_BT_FED_PADS_DIRECT + SATELLITES_MAX * APP_BT_FED_PADS_PR_SATELLITE <= CONFIG_APP_GAME_PADS_MAX,
+	     "CONFIG_APP_GAME_PADS_MAX must hold the pad indexes of all the satellites");
+
+static struct fed_sat_t {
+	bool used;
+	uint32_t con_index;
+	uint8_t ready_mask;
+	uint32_t sent;
+	uint32_t rx;
+	struct proto_fed_status_t status;
+} sats[SATELLITES_MAX];
+
+// Links reported ready by app_bt, satellites included
+static uint32_t link_ready_mask;
+static uint32_t sat_link_mask;
+
+static struct k_spinlock fed_lock;
+
+static app_bt_callback_t m_callback;
+
+static struct fed_sat_t *sat_from_link(uint32_t con_index)
+{
+	for (int i = 0; i < SATELLITES_MAX; i++) {
+		if (sats[i].used && sats[i].con_index == con_index) {
+			return &sats[i];
+		}
+	}
+	return NULL;
+}
+
+static uint64_t global_ready_mask(void)
+{
+	uint64_t mask = link_ready_mask & ~sat_link_mask & BIT_MASK(APP_BT_FED_PADS_DIRECT);
+
+	for (int i = 0; i < SATELLITES_MAX; i++) {
+		if (sats[i].used) {
+			mask |= (uint64_t)sats[i].ready_mask << (APP_BT_FED_PADS_DIRECT + i * APP_BT_FED_PADS_PR_SATELLITE);
+		}
+	}
+	return mask;
+}
+
+static void fwd_con_num_change(void)
+{
+	struct app_bt_evt_t evt = {.type = APP_BT_EVT_CON_NUM_CHANGE};
+	k_spinlock_key_t key = k_spin_lock(&fed_lock);
+
+	evt.ready_mask = global_ready_mask();
+	k_spin_unlock(&fed_lock, key);
+	evt.num_connected = __builtin_popcountll(evt.ready_mask);
+	m_callback(&evt);
+}
+
+static void status_rx(uint32_t con_index, const struct proto_fed_status_t *status)
+{
+	k_spinlock_key_t key = k_spin_lock(&fed_lock);
+	struct fed_sat_t *sat = sat_from_link(con_index);
+	bool changed;
+
+	if (!sat) {
+		for (int i = 0; i < SATELLITES_MAX; i++) {
+			if (!sats[i].used) {
+				sat = &sats[i];
+				memset(sat, 0, sizeof(*sat));
+				sat->used = true;
+				sat->con_index = con_index;
+				sat_link_mask |= BIT(con_index);
+				LOG_INF("Satellite on link %i takes slot %i", con_index, i);
+				break;
+			}
+		}
+		if (!sat) {
+			k_spin_unlock(&fed_lock, key);
+			LOG_WRN("No slot left for the satellite on link %i", con_index);
+			return;
+		}
+		// The link was counted as a pad until now
+		changed = true;
+	}
+	else {
+		changed = (sat->ready_mask != status->ready_mask);
+	}
+	sat->ready_mask = status->ready_mask;
+	sat->status = *status;
+	k_spin_unlock(&fed_lock, key);
+
+	if (changed) {
+		fwd_con_num_change();
+	}
+}
+
+static void pad_rx(struct app_bt_evt_t *evt)
+{
+	const struct proto_fed_rx_hdr_t *hdr = (const struct proto_fed_rx_hdr_t *)evt->data;
+	struct app_bt_evt_t pad_evt = *evt;
+	k_spinlock_key_t key;
+	struct fed_sat_t *sat;
+
+	if (evt->data_len <= sizeof(*hdr) || hdr->pad >= APP_BT_FED_PADS_PR_SATELLITE) {
+		return;
+	}
+	key = k_spin_lock(&fed_lock);
+	sat = sat_from_link(evt->con_index);
+	if (sat) {
+		sat->rx++;
+		pad_evt.con_index = APP_BT_FED_PADS_DIRECT + (sat - sats) * APP_BT_FED_PADS_PR_SATELLITE + hdr->pad;
+	}
+	k_spin_unlock(&fed_lock, key);
+	if (!sat) {
+		return;
+	}
+	pad_evt.data = evt->data + sizeof(*hdr);
+	pad_evt.data_len = evt->data_len - sizeof(*hdr);
+	pad_evt.rssi = hdr->rssi;
+	m_callback(&pad_evt);
+}
+
+void app_bt_fed_init(app_bt_callback_t callback)
+{
+	m_callback = callback;
+}
+
+void app_bt_fed_evt(struct app_bt_evt_t *evt)
+{
+	union proto_msg_t msg;
+	uint8_t type;
+
+	switch (evt->type) {
+		case APP_BT_EVT_CON_NUM_CHANGE: {
+			k_spinlock_key_t key = k_spin_lock(&fed_lock);
+			link_ready_mask = evt->ready_mask;
+			for (int i = 0; i < SATELLITES_MAX; i++) {
+				if (sats[i].used && !(link_ready_mask & BIT(sats[i].con_index))) {
+					LOG_INF("Satellite in slot %i lost", i);
+					sat_link_mask &= ~BIT(sats[i].con_index);
+					sats[i].used = false;
+				}
+			}
+			k_spin_unlock(&fed_lock, key);
+			fwd_con_num_change();
+			break;
+		}
+		case APP_BT_EVT_RX_DATA:
+			switch (proto_type_peek(evt->data, evt->data_len)) {
+				case PROTO_MSG_FED_STATUS:
+					if (proto_decode(evt->data, evt->data_len, &type, &msg) == 0) {
+						status_rx(evt->con_index, &msg.fed_status);
+					}
+					break;
+				case PROTO_MSG_FED_RX:
+					pad_rx(evt);
+					break;
+				default:
+					// Satellites only send federation frames
+					if (!(sat_link_mask & BIT(evt->con_index))) {
+						m_callback(evt);
+					}
+					break;
+			}
+			break;
+		default:
+			m_callback(evt);
+			break;
+	}
+}
+
+static int sat_send(uint32_t slot, uint8_t pad_mask, const uint8_t *data, uint16_t len, enum app_bt_tx_prio_t prio)
+{
+	uint8_t frame[APP_BT_TX_MSG_LEN_MAX];
+	struct proto_fed_cmd_hdr_t *hdr = (struct proto_fed_cmd_hdr_t *)frame;
+	k_spinlock_key_t key;
+	uint32_t con_index;
+	bool used;
+
+	if (sizeof(*hdr) + len > sizeof(frame)) {
+		return -EMSGSIZE;
+	}
+	key = k_spin_lock(&fed_lock);
+	used = sats[slot].used;
+	con_index = sats[slot].con_index;
+	if (used) {
+		sats[slot].sent++;
+	}
+	k_spin_unlock(&fed_lock, key);
+	if (!used) {
+		return -ENOTCONN;
+	}
+
+	hdr->hdr = PROTO_HDR(PROTO_MSG_FED_CMD);
+	hdr->pad_mask = pad_mask;
+	sys_put_le32(timesync_now_us(), hdr->t_tx_us);
+	memcpy(&frame[sizeof(*hdr)], data, len);
+	return app_bt_send_prio(con_index, frame, sizeof(*hdr) + len, prio);
+}
+
+int app_bt_fed_send(uint32_t pad, const uint8_t *data, uint16_t len, enum app_bt_tx_prio_t prio)
+{
+	uint32_t slot, local;
+
+	if (pad < APP_BT_FED_PADS_DIRECT) {
+		return app_bt_send_prio(pad, data, len, prio);
+	}
+	slot = (pad - APP_BT_FED_PADS_DIRECT) / APP_BT_FED_PADS_PR_SATELLITE;
+	local = (pad - APP_BT_FED_PADS_DIRECT) % APP_BT_FED_PADS_PR_SATELLITE;
+	if (slot >= SATELLITES_MAX) {
+		return -EINVAL;
+	}
+	return sat_send(slot, BIT(local), data, len, prio);
+}
+
+int app_bt_fed_send_multi(uint64_t pad_mask, const uint8_t *data, uint16_t len, enum app_bt_tx_prio_t prio)
+{
+	uint32_t direct_mask;
+	k_spinlock_key_t key;
+	int err = 0, ret;
+
+	key = k_spin_lock(&fed_lock);
+	direct_mask = pad_mask & ~sat_link_mask & BIT_MASK(APP_BT_FED_PADS_DIRECT);
+	k_spin_unlock(&fed_lock, key);
+
+	if (direct_mask) {
+		err = app_bt_send_multi(direct_mask, data, len, prio, NULL);
+	}
+	// One relayed frame per satellite, it sends it on to its pads
+	for (int i = 0; i < SATELLITES_MAX; i++) {
+		uint8_t local_mask = (pad_mask >> (APP_BT_FED_PADS_DIRECT + i * APP_BT_FED_PADS_PR_SATELLITE)) &
+				     BIT_MASK(APP_BT_FED_PADS_PR_SATELLITE);
+		if (local_mask) {
+			ret = sat_send(i, local_mask, data, len, prio);
+			if (ret < 0 && err == 0) {
+				err = ret;
+			}
+		}
+	}
+	return err;
+}
+
+int app_bt_fed_sat_stats_get(uint32_t slot, struct app_bt_fed_sat_stats_t *stats)
+{
+	k_spinlock_key_t key;
+	int err = 0;
+
+	if (slot >= SATELLITES_MAX) {
+		return -EINVAL;
+	}
+	key = k_spin_lock(&fed_lock);
+	if (sats[slot].used) {
+		stats->con_index = sats[slot].con_index;
+		stats->num_pads = sats[slot].status.num_pads;
+		stats->sent = sats[slot].sent;
+		stats->relayed = sats[slot].status.relayed;
+		stats->rx = sats[slot].rx;
+		stats->hop_avg_us = sats[slot].status.hop_avg_us;
+		stats->hop_max_us = sats[slot].status.hop_max_us;
+	}
+	else {
+		err = -ENOENT;
+	}
+	k_spin_unlock(&fed_lock, key);
+	return err;
+}
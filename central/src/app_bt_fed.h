@@ -0,0 +1,60 @@
+#ifndef __APP_BT_FED_H
+#define __APP_BT_FED_H
+
+#include <zephyr/kernel.h>
+#include <string.h>
+#include <app_bt.h>
+#include <proto.h>
+
+/* Federation of centrals. The master runs the game, and connects to satellite centrals the same way
+ * it connects to pads. Each satellite owns up to 8 pads of its own, and relays the pad frames between
+ * them and the master over that link (see PROTO_MSG_FED_CMD, PROTO_MSG_FED_RX and
+ * PROTO_MSG_FED_STATUS in proto.h).
+ *
+ * The game sees a single pad index space: the pads connected to the master keep their con_index,
+ * 0 to 7, and the pads of satellite slot s take APP_BT_FED_PADS_DIRECT + s * 8 + the index on the
+ * satellite. A satellite takes the first free slot when its first status arrives.
+ *
+ * The satellite is synced to the master clock like a pad, and converts the exec_at_us of relayed
+ * LED commands to its own clock, so the commands still take effect at the same time on all pads.
+ * The relay adds the master to satellite hop to the command latency, which the satellite measures
+ * on every command and reports in its status. */
+
+#define APP_BT_FED_SATELLITE_NAME	"Whack-A-Mole Satellite"
+#define APP_BT_FED_PADS_DIRECT		8
+#define APP_BT_FED_PADS_PR_SATELLITE	8
+
+struct app_bt_fed_sat_stats_t {
+	// con_index of the satellite link on the master
+	uint32_t con_index;
+	uint32_t num_pads;
+	// Commands sent to the satellite, and relayed to its pads as reported by the satellite
+	uint32_t sent;
+	uint32_t relayed;
+	uint32_t rx;
+	uint32_t hop_avg_us;
+	uint32_t hop_max_us;
+};
+
+#if defined(CONFIG_APP_FED_MASTER)
+// Events translated to the global pad index space are passed on to the callback
+void app_bt_fed_init(app_bt_callback_t callback);
+
+// Events from app_bt. Satellite links are taken out of the connection count, and their pad frames unwrapped.
+void app_bt_fed_evt(struct app_bt_evt_t *evt);
+
+int app_bt_fed_send(uint32_t pad, const uint8_t *data, uint16_t len, enum app_bt_tx_prio_t prio);
+
+int app_bt_fed_send_multi(uint64_t pad_mask, const uint8_t *data, uint16_t len, enum app_bt_tx_prio_t prio);
+
+// Statistics of the satellite in a slot, -ENOENT if the slot is free
+int app_bt_fed_sat_stats_get(uint32_t slot, struct app_bt_fed_sat_stats_t *stats);
+#else
+static inline int app_bt_fed_sat_stats_get(uint32_t slot, struct app_bt_fed_sat_stats_t *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	return -ENOENT;
+}
+#endif
+
+#endif
@@ -0,0 +1,435 @@
+#include <app_bt_health.h>
+#include <app_bt_ctrl.h>
+#include <zephyr/bluetooth/hci.h>
+#include <zephyr/sys/byteorder.h>
+#if defined(CONFIG_BT_CTLR_TX_PWR_DYNAMIC_CONTROL)
+#include <zephyr/bluetooth/hci_vs.h>
+#endif
+#if defined(CONFIG_APP_BT_HEALTH_SHELL)
+#include <zephyr/shell/shell.h>
+#endif
+
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(app_bt_health, LOG_LEVEL_INF);
+
+#define PERIOD_MS		CONFIG_APP_BT_HEALTH_PERIOD_MS
+#define RECOVER_PERIODS		CONFIG_APP_BT_HEALTH_RECOVER_PERIODS
+#define RSSI_WEAK		CONFIG_APP_BT_HEALTH_RSSI_WEAK
+#define MISS_WEAK		CONFIG_APP_BT_HEALTH_MISS_PERMILLE
+#define RETX_WEAK		CONFIG_APP_BT_HEALTH_RETX_PERMILLE
+// A link is bad rather than weak this far past the limits
+#define RSSI_BAD		(RSSI_WEAK - 10)
+#define MISS_BAD		(MISS_WEAK * 2)
+#define RETX_BAD		(RETX_WEAK * 2)
+#define MITIGATION_MAX		APP_BT_HEALTH_MITIGATION_NO_LATENCY
+
+static const char *state_str[] = {"good", "weak", "bad"};
+static const char *mitigation_str[] = {"none", "tx power", "1M phy", "no latency"};
+
+static struct health_link_t {
+	bool used;
+	struct bt_conn *conn;
+	// Counted over the current period
+	uint32_t events, missed;
+	uint32_t tx_packets, tx_acked;
+	uint32_t rx_packets, rx_crc_errors;
+	uint32_t latency_count, latency_max_us;
+	uint64_t latency_sum_us;
+	// Moving average of the RSSI readings, in 1/16 dBm
+	int32_t rssi_avg_x16;
+	bool rssi_valid;
+	uint8_t phy;
+	// Only changed by the evaluation work, which works on a copy and stores it back under the lock
+	enum app_bt_health_mitigation_t mitigation;
+	bool phy_restore;
+	uint8_t good_periods;
+	// Result of the last period
+	struct proto_link_health_t report;
+} links[CONFIG_BT_MAX_CONN];
+
+static struct k_spinlock health_lock;
+
+static app_bt_health_param_refresh_t m_refresh;
+// The evaluation waits for HCI command responses, so it does not run on the system work queue
+static struct k_work_q *m_wq;
+static atomic_t report_subscribed;
+
+static void health_work_handler(struct k_work *work);
+K_WORK_DELAYABLE_DEFINE(m_work_health, health_work_handler);
+
+static void report_work_handler(struct k_work *work);
+K_WORK_DEFINE(m_work_report, report_work_handler);
+
+static void report_send(const struct proto_link_health_t *report)
+{
+	uint8_t frame[PROTO_FRAME_MAX];
+	int len;
+
+	len = proto_encode(PROTO_MSG_LINK_HEALTH, report, frame, sizeof(frame));
+	if (len > 0) {
+		app_bt_ctrl_send_str(frame, len);
+	}
+}
+
+static void report_work_handler(struct k_work *work)
+{
+	struct proto_link_health_t report;
+
+	for (int i = 0; i < CONFIG_BT_MAX_CONN; i++) {
+		if (app_bt_health_get(i, &report) == 0) {
+			report_send(&report);
+		}
+	}
+}
+
+static int tx_power_set(struct bt_conn *conn, int8_t dbm, int8_t *selected)
+{
+#if defined(CONFIG_BT_CTLR_TX_PWR_DYNAMIC_CONTROL)
+	struct bt_hci_cp_vs_write_tx_power_level *cp;
+	struct bt_hci_rp_vs_write_tx_power_level *rp;
+	struct net_buf *buf, *rsp = NULL;
+	uint16_t handle;
+	int err;
+
+	err = bt_hci_get_conn_handle(conn, &handle);
+	if (err) {
+		return err;
+	}
+	buf = bt_hci_cmd_create(BT_HCI_OP_VS_WRITE_TX_POWER_LEVEL, sizeof(*cp));
+	if (!buf) {
+		return -ENOBUFS;
+	}
+	cp = net_buf_add(buf, sizeof(*cp));
+	cp->handle = sys_cpu_to_le16(handle);
+	cp->handle_type = BT_HCI_VS_LL_HANDLE_TYPE_CONN;
+	cp->tx_power_level = dbm;
+	err = bt_hci_cmd_send_sync(BT_HCI_OP_VS_WRITE_TX_POWER_LEVEL, buf, &rsp);
+	if (err) {
+		return err;
+	}
+	rp = (void *)rsp->data;
+	*selected = rp->selected_tx_power;
+	net_buf_unref(rsp);
+	return 0;
+#else
+	return -ENOTSUP;
+#endif
+}
+
+// Mitigation state of a link, copied out by the evaluation work and written back if the link is still the same
+struct mitigation_state_t {
+	enum app_bt_health_mitigation_t mitigation;
+	bool phy_restore;
+	uint8_t good_periods;
+	int8_t tx_power;
+};
+
+// Runs from the health work queue, with the step already counted in state->mitigation when enabling. conn is
+// a reference held by the caller, the link can go down meanwhile.
+static void mitigation_apply(uint32_t index, struct bt_conn *conn, uint8_t phy, struct mitigation_state_t *state,
+			     enum app_bt_health_mitigation_t step, bool enable)
+{
+	int8_t tx_power = 0;
+	int err = 0;
+
+	switch (step) {
+		case APP_BT_HEALTH_MITIGATION_TX_POWER:
+			err = tx_power_set(conn, enable ? CONFIG_APP_BT_HEALTH_TX_POWER_BOOST : 0, &tx_power);
+			if (err == 0) {
+				state->tx_power = enable ? tx_power : 0;
+			}
+			break;
+		case APP_BT_HEALTH_MITIGATION_PHY_1M:
+#if defined(CONFIG_BT_USER_PHY_UPDATE)
+			// The 1M PHY has a better sensitivity, a link already on it has nothing to fall back to
+			if (enable && phy == BT_GAP_LE_PHY_2M) {
+				err = bt_conn_le_phy_update(conn, BT_CONN_LE_PHY_PARAM_1M);
+				state->phy_restore = (err == 0);
+			}
+			else if (!enable && state->phy_restore) {
+				err = bt_conn_le_phy_update(conn, BT_CONN_LE_PHY_PARAM_2M);
+				state->phy_restore = false;
+			}
+#endif
+			break;
+		case APP_BT_HEALTH_MITIGATION_NO_LATENCY:
+			m_refresh(index);
+			break;
+		default:
+			break;
+	}
+	if (err) {
+		LOG_WRN("Link %i: %s mitigation %s failed (err %d)", index, mitigation_str[step],
+			enable ? "enable" : "disable", err);
+	}
+}
+
+// Store the mitigation state, and the report if there is one, unless the link went down or was replaced
+// since the state was copied out
+static void mitigation_state_store(struct health_link_t *link, struct bt_conn *conn,
+				   const struct mitigation_state_t *state, const struct proto_link_health_t *report)
+{
+	k_spinlock_key_t key = k_spin_lock(&health_lock);
+	if (link->used && link->conn == conn) {
+		link->mitigation = state->mitigation;
+		link->phy_restore = state->phy_restore;
+		link->good_periods = state->good_periods;
+		if (report) {
+			link->report = *report;
+		}
+		link->report.tx_power = state->tx_power;
+	}
+	k_spin_unlock(&health_lock, key);
+}
+
+static enum proto_link_state_t link_classify(const struct proto_link_health_t *r, bool rssi_valid)
+{
+	if (r->miss_permille > MISS_BAD || r->retx_permille > RETX_BAD || (rssi_valid && r->rssi < RSSI_BAD)) {
+		return PROTO_LINK_BAD;
+	}
+	if (r->miss_permille > MISS_WEAK || r->retx_permille > RETX_WEAK || r->crc_permille > RETX_WEAK ||
+	    (rssi_valid && r->rssi < RSSI_WEAK)) {
+		return PROTO_LINK_WEAK;
+	}
+	return PROTO_LINK_GOOD;
+}
+
+static void link_evaluate(uint32_t index, struct health_link_t *link)
+{
+	struct proto_link_health_t report;
+	struct mitigation_state_t state;
+	enum proto_link_state_t state_prev;
+	struct bt_conn *conn;
+	bool rssi_valid;
+	uint8_t phy;
+
+	k_spinlock_key_t key = k_spin_lock(&health_lock);
+	if (!link->used) {
+		k_spin_unlock(&health_lock, key);
+		return;
+	}
+	// Keeps the connection valid for the mitigations, even if the link is removed meanwhile
+	conn = bt_conn_ref(link->conn);
+	report = link->report;
+	state_prev = report.state;
+	report.rssi = link->rssi_valid ? (int8_t)(link->rssi_avg_x16 / 16) : 0;
+	report.phy = link->phy;
+	report.miss_permille = (link->events + link->missed) ?
+			       link->missed * 1000 / (link->events + link->missed) : 0;
+	report.retx_permille = link->tx_packets ? (link->tx_packets - link->tx_acked) * 1000 / link->tx_packets : 0;
+	report.crc_permille = link->rx_packets ? link->rx_crc_errors * 1000 / link->rx_packets : 0;
+	report.tx_latency_avg_us = link->latency_count ? (uint32_t)(link->latency_sum_us / link->latency_count) : 0;
+	report.tx_latency_max_us = link->latency_max_us;
+	rssi_valid = link->rssi_valid;
+	phy = link->phy;
+	state.mitigation = link->mitigation;
+	state.phy_restore = link->phy_restore;
+	state.good_periods = link->good_periods;
+	state.tx_power = link->report.tx_power;
+	link->events = link->missed = 0;
+	link->tx_packets = link->tx_acked = 0;
+	link->rx_packets = link->rx_crc_errors = 0;
+	link->latency_count = link->latency_max_us = 0;
+	link->latency_sum_us = 0;
+	k_spin_unlock(&health_lock, key);
+
+	report.state = link_classify(&report, rssi_valid);
+
+	// One step per period, so every step gets a chance to work before the next one. The step is stored
+	// before it is applied, so app_bt_health_no_latency() sees it when the parameters are refreshed.
+	if (report.state != PROTO_LINK_GOOD) {
+		state.good_periods = 0;
+		if (state.mitigation < MITIGATION_MAX) {
+			state.mitigation++;
+			LOG_INF("Link %i %s, mitigation: %s", index, state_str[report.state], mitigation_str[state.mitigation]);
+			mitigation_state_store(link, conn, &state, NULL);
+			mitigation_apply(index, conn, phy, &state, state.mitigation, true);
+		}
+	}
+	else if (state.mitigation > APP_BT_HEALTH_MITIGATION_NONE && ++state.good_periods >= RECOVER_PERIODS) {
+		enum app_bt_health_mitigation_t step = state.mitigation;
+		state.good_periods = 0;
+		state.mitigation--;
+		LOG_INF("Link %i recovered, mitigation %s removed", index, mitigation_str[step]);
+		mitigation_state_store(link, conn, &state, NULL);
+		mitigation_apply(index, conn, phy, &state, step, false);
+	}
+	report.mitigation = state.mitigation;
+	report.tx_power = state.tx_power;
+	mitigation_state_store(link, conn, &state, &report);
+	bt_conn_unref(conn);
+
+	if (report.state != state_prev) {
+		LOG_INF("Link %i: %s, rssi %i dBm, missed %u, retx %u, crc %u per mille, tx latency avg %u us", index,
+			state_str[report.state], report.rssi, report.miss_permille, report.retx_permille,
+			report.crc_permille, report.tx_latency_avg_us);
+		if (atomic_get(&report_subscribed)) {
+			report_send(&report);
+		}
+	}
+}
+
+static void health_work_handler(struct k_work *work)
+{
+	for (int i = 0; i < CONFIG_BT_MAX_CONN; i++) {
+		link_evaluate(i, &links[i]);
+	}
+	k_work_reschedule_for_queue(m_wq, &m_work_health, K_MSEC(PERIOD_MS));
+}
+
+void app_bt_health_init(app_bt_health_param_refresh_t refresh, struct k_work_q *work_q)
+{
+	m_refresh = refresh;
+	m_wq = work_q;
+	k_work_reschedule_for_queue(m_wq, &m_work_health, K_MSEC(PERIOD_MS));
+}
+
+void app_bt_health_link_add(uint32_t con_index, struct bt_conn *conn)
+{
+	struct health_link_t *link = &links[con_index];
+	uint8_t phy = BT_GAP_LE_PHY_1M;
+
+#if defined(CONFIG_BT_USER_PHY_UPDATE)
+	struct bt_conn_info info;
+	if (bt_conn_get_info(conn, &info) == 0 && info.le.phy) {
+		phy = info.le.phy->tx_phy;
+	}
+#endif
+	k_spinlock_key_t key = k_spin_lock(&health_lock);
+	memset(link, 0, sizeof(*link));
+	link->used = true;
+	// Held until the link is removed, the mitigations can be applied while it goes down
+	link->conn = bt_conn_ref(conn);
+	link->phy = phy;
+	link->report.pad = con_index;
+	k_spin_unlock(&health_lock, key);
+}
+
+void app_bt_health_link_remove(uint32_t con_index)
+{
+	struct bt_conn *conn = NULL;
+
+	k_spinlock_key_t key = k_spin_lock(&health_lock);
+	if (links[con_index].used) {
+		links[con_index].used = false;
+		conn = links[con_index].conn;
+		links[con_index].conn = NULL;
+	}
+	k_spin_unlock(&health_lock, key);
+	if (conn) {
+		bt_conn_unref(conn);
+	}
+}
+
+void app_bt_health_rssi(uint32_t con_index, int8_t rssi)
+{
+	struct health_link_t *link = &links[con_index];
+
+	if (rssi == BT_HCI_LE_RSSI_NOT_AVAILABLE) {
+		return;
+	}
+	k_spinlock_key_t key = k_spin_lock(&health_lock);
+	if (!link->rssi_valid) {
+		link->rssi_avg_x16 = rssi * 16;
+		link->rssi_valid = true;
+	}
+	else {
+		link->rssi_avg_x16 += (rssi * 16 - link->rssi_avg_x16) / 4;
+	}
+	k_spin_unlock(&health_lock, key);
+}
+
+void app_bt_health_tx_latency(uint32_t con_index, uint32_t latency_us)
+{
+	struct health_link_t *link = &links[con_index];
+
+	k_spinlock_key_t key = k_spin_lock(&health_lock);
+	link->latency_count++;
+	link->latency_sum_us += latency_us;
+	link->latency_max_us = MAX(link->latency_max_us, latency_us);
+	k_spin_unlock(&health_lock, key);
+}
+
+void app_bt_health_conn_event(uint32_t con_index, uint16_t missed, uint16_t tx_packets, uint16_t tx_acked,
+			      uint16_t rx_packets, uint16_t rx_crc_errors)
+{
+	struct health_link_t *link;
+
+	if (con_index >= CONFIG_BT_MAX_CONN) {
+		return;
+	}
+	link = &links[con_index];
+	k_spinlock_key_t key = k_spin_lock(&health_lock);
+	link->events++;
+	link->missed += missed;
+	// A pad using its peripheral latency does not listen, which is not a retransmission
+	if (rx_packets > 0) {
+		link->tx_packets += tx_packets;
+		link->tx_acked += MIN(tx_acked, tx_packets);
+	}
+	link->rx_packets += rx_packets;
+	link->rx_crc_errors += rx_crc_errors;
+	k_spin_unlock(&health_lock, key);
+}
+
+void app_bt_health_phy(uint32_t con_index, uint8_t tx_phy)
+{
+	k_spinlock_key_t key = k_spin_lock(&health_lock);
+	links[con_index].phy = tx_phy;
+	k_spin_unlock(&health_lock, key);
+}
+
+bool app_bt_health_no_latency(uint32_t con_index)
+{
+	return links[con_index].used && links[con_index].mitigation >= APP_BT_HEALTH_MITIGATION_NO_LATENCY;
+}
+
+void app_bt_health_report_request(bool subscribe)
+{
+	atomic_set(&report_subscribed, subscribe);
+	k_work_submit_to_queue(m_wq, &m_work_report);
+}
+
+int app_bt_health_get(uint32_t con_index, struct proto_link_health_t *health)
+{
+	int err = 0;
+
+	if (con_index >= CONFIG_BT_MAX_CONN) {
+		return -EINVAL;
+	}
+	k_spinlock_key_t key = k_spin_lock(&health_lock);
+	if (links[con_index].used) {
+		*health = links[con_index].report;
+	}
+	else {
+		err = -ENOTCONN;
+	}
+	k_spin_unlock(&health_lock, key);
+	return err;
+}
+
+#if defined(CONFIG_APP_BT_HEALTH_SHELL)
+static int cmd_linkhealth(const struct shell *sh, size_t argc, char **argv)
+{
+	struct proto_link_health_t h;
+	int num = 0;
+
+	for (int i = 0; i < CONFIG_BT_MAX_CONN; i++) {
+		if (app_bt_health_get(i, &h) != 0) {
+			continue;
+		}
+		shell_print(sh, "Link %i: %s, rssi %i dBm, phy %s, tx power %i dBm, mitigation %s", i,
+			    state_str[h.state], h.rssi, h.phy == BT_GAP_LE_PHY_2M ? "2M" : "1M", h.tx_power,
+			    mitigation_str[h.mitigation]);
+		shell_print(sh, "        missed %u, retx %u, crc %u per mille, tx latency avg %u us, max %u us",
+			    h.miss_permille, h.retx_permille, h.crc_permille, h.tx_latency_avg_us, h.tx_latency_max_us);
+		num++;
+	}
+	if (num == 0) {
+		shell_print(sh, "No pad links");
+	}
+	return 0;
+}
+
+SHELL_CMD_REGISTER(linkhealth, NULL, "Health of the pad links", cmd_linkhealth);
+#endif
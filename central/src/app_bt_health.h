@@ -0,0 +1,81 @@
+#ifndef __APP_BT_HEALTH_H
+#define __APP_BT_HEALTH_H
+
+#include <zephyr/kernel.h>
+#include <zephyr/bluetooth/conn.h>
+#include <string.h>
+#include <proto.h>
+
+/* Health of the pad links. The RSSI, the connection events missed, the retransmissions and CRC
+ * errors from the QoS connection event reports of the controller, and the TX queue latency are
+ * evaluated every CONFIG_APP_BT_HEALTH_PERIOD_MS. A link that is not good takes one more mitigation
+ * step per period, and gives one back after CONFIG_APP_BT_HEALTH_RECOVER_PERIODS good periods:
+ *   1. Raise the TX power of the link
+ *   2. Fall back from the 2M to the 1M PHY
+ *   3. Drop the peripheral latency, so the pad listens to every connection event
+ * The interval is shared by all the links to keep the radio schedule, so it is not changed per link. */
+
+enum app_bt_health_mitigation_t {
+	APP_BT_HEALTH_MITIGATION_NONE,
+	APP_BT_HEALTH_MITIGATION_TX_POWER,
+	APP_BT_HEALTH_MITIGATION_PHY_1M,
+	APP_BT_HEALTH_MITIGATION_NO_LATENCY,
+};
+
+// Called from the health work queue when the connection parameters of a link have to be applied again
+typedef void (*app_bt_health_param_refresh_t)(uint32_t con_index);
+
+#if defined(CONFIG_APP_BT_HEALTH)
+// The evaluation and the reports run on work_q, it must not be the system work queue
+void app_bt_health_init(app_bt_health_param_refresh_t refresh, struct k_work_q *work_q);
+
+void app_bt_health_link_add(uint32_t con_index, struct bt_conn *conn);
+
+void app_bt_health_link_remove(uint32_t con_index);
+
+void app_bt_health_rssi(uint32_t con_index, int8_t rssi);
+
+void app_bt_health_tx_latency(uint32_t con_index, uint32_t latency_us);
+
+// One QoS connection event report. missed is the number of events skipped since the previous report.
+void app_bt_health_conn_event(uint32_t con_index, uint16_t missed, uint16_t tx_packets, uint16_t tx_acked,
+			      uint16_t rx_packets, uint16_t rx_crc_errors);
+
+void app_bt_health_phy(uint32_t con_index, uint8_t tx_phy);
+
+// True if the link must run without peripheral latency
+bool app_bt_health_no_latency(uint32_t con_index);
+
+// Send the health of all the links to the control app, and keep sending state changes if subscribe is set
+void app_bt_health_report_request(bool subscribe);
+
+// Health of a link over the last period, -ENOTCONN if the link is not up
+int app_bt_health_get(uint32_t con_index, struct proto_link_health_t *health);
+#else
+static inline void app_bt_health_init(app_bt_health_param_refresh_t refresh, struct k_work_q *work_q) {}
+
+static inline void app_bt_health_link_add(uint32_t con_index, struct bt_conn *conn) {}
+
+static inline void app_bt_health_link_remove(uint32_t con_index) {}
+
+static inline void app_bt_health_rssi(uint32_t con_index, int8_t rssi) {}
+
+static inline void app_bt_health_tx_latency(uint32_t con_index, uint32_t latency_us) {}
+
+static inline void app_bt_health_conn_event(uint32_t con_index, uint16_t missed, uint16_t tx_packets,
+					    uint16_t tx_acked, uint16_t rx_packets, uint16_t rx_crc_errors) {}
+
+static inline void app_bt_health_phy(uint32_t con_index, uint8_t tx_phy) {}
+
+static inline bool app_bt_health_no_latency(uint32_t con_index) { return false; }
+
+static inline void app_bt_health_report_request(bool subscribe) {}
+
+static inline int app_bt_health_get(uint32_t con_index, struct proto_link_health_t *health)
+{
+	memset(health, 0, sizeof(*health));
+	return -ENOTCONN;
+}
+#endif
+
+#endif
@@ -0,0 +1,435 @@
+#include <app_bt_pawr.h>
+#include <pawr_proto.h>
+
+#include <zephyr/bluetooth/bluetooth.h>
+#include <zephyr/bluetooth/conn.h>
+#include <zephyr/bluetooth/hci.h>
+#include <zephyr/logging/log.h>
+
+LOG_MODULE_REGISTER(app_bt_pawr, LOG_LEVEL_INF);
+
+#define PAWR_INTERVAL		CONFIG_APP_BT_PAWR_INTERVAL
+#define SUBEVENT_INTERVAL	(PAWR_INTERVAL / PAWR_NUM_SUBEVENTS)
+#define RSP_SLOT_DELAY		3 /* 3.75 ms */
+#define RSP_SLOT_SPACING	4 /* 0.5 ms */
+
+#define CMD_QUEUE_LEN		4
+#define MISSED_MAX		CONFIG_APP_BT_PAWR_MISSED_MAX
+#define MCAST_REPEATS		3
+#define ASSIGN_REPEATS		4
+/* The subevent data has to be on air before the first response slot. On the 1M PHY a byte takes 8 us,
+ * and the PDU header, the CRC and the turnaround take up to about 300 us more, so a full 251 byte
+ * subevent takes about 2.3 ms. */
+#define SUBEVENT_AIR_US_PR_BYTE	8
+#define SUBEVENT_OVERHEAD_US	300
+#define SUBEVENT_DATA_LEN_MAX	MIN(251, (RSP_SLOT_DELAY * 1250 - SUBEVENT_OVERHEAD_US) / SUBEVENT_AIR_US_PR_BYTE)
+
+static const struct bt_data ad[] = {
+	BT_DATA(BT_DATA_NAME_COMPLETE, PAWR_ADV_NAME, sizeof(PAWR_ADV_NAME) - 1),
+};
+
+static app_bt_callback_t m_callback;
+
+static struct bt_le_ext_adv *pawr_adv;
+
+static struct pawr_pad_t {
+	bool used;
+	bt_addr_le_t addr;
+	uint8_t missed;
+	uint8_t seq_counter;
+	uint8_t cmd_seq;
+	uint8_t cmd_head, cmd_count;
+	struct {
+		uint8_t len;
+		uint8_t data[PAWR_REC_DATA_MAX];
+	} cmd[CMD_QUEUE_LEN];
+	uint8_t rsp_ack;
+} pads[PAWR_PAD_MAX];
+static uint32_t pad_count;
+
+static struct {
+	uint8_t seq;
+	uint8_t len;
+	uint8_t data[PAWR_REC_DATA_MAX];
+	uint8_t repeats_left[PAWR_NUM_SUBEVENTS];
+} mcast;
+
+static struct {
+	bt_addr_le_t addr;
+	uint8_t index;
+	uint8_t repeats_left;
+} assign[2];
+
+static struct k_spinlock pawr_lock;
+
+BUILD_ASSERT(PAWR_PAD_MAX <= 64, "Every pad index must fit the 64 bit pad masks");
+// The slot delay is in 1.25 ms units and the spacing in 0.125 ms units
+BUILD_ASSERT(RSP_SLOT_DELAY * 10 + PAWR_NUM_RSP_SLOTS * RSP_SLOT_SPACING <= SUBEVENT_INTERVAL * 10,
+	     "The response slots must end within the subevent interval");
+
+static uint8_t subevent_data[PAWR_NUM_SUBEVENTS][SUBEVENT_DATA_LEN_MAX];
+static struct net_buf_simple subevent_buf[PAWR_NUM_SUBEVENTS];
+
+static void fwd_event_con_num_change(uint32_t con_num)
+{
+	static struct app_bt_evt_t evt = {.type = APP_BT_EVT_CON_NUM_CHANGE};
+	evt.num_connected = con_num;
+	evt.ready_mask = 0;
+	for (int i = 0; i < PAWR_PAD_MAX; i++) {
+		if (pads[i].used) {
+			evt.ready_mask |= BIT64(i);
+		}
+	}
+	m_callback(&evt);
+}
+
+static void fwd_event_rx_data(uint32_t con_index, const uint8_t *data, uint16_t len, int8_t rssi)
+{
+	static struct app_bt_evt_t rx_evt = {.type = APP_BT_EVT_RX_DATA};
+	rx_evt.con_index = con_index;
+	rx_evt.rssi = rssi;
+	rx_evt.data = data;
+	rx_evt.data_len = len;
+	m_callback(&rx_evt);
+}
+
+static void fwd_event_ctrl_link_con_discon(struct bt_conn *conn, bool connected)
+{
+	static struct app_bt_evt_t ctrl_con_discon_evt;
+	ctrl_con_discon_evt.type = (connected ? APP_BT_EVT_CTRL_CONNECTED : APP_BT_EVT_CTRL_DISCONNECTED);
+	ctrl_con_discon_evt.ctrl_conn = conn;
+	m_callback(&ctrl_con_discon_evt);
+}
+
+// Returns false if the record does not fit, it has to be sent again in a later interval
+static bool add_record(struct net_buf_simple *buf, uint8_t index, uint8_t cmd_seq, uint8_t rsp_ack,
+		       const uint8_t *data, uint8_t len)
+{
+	if (net_buf_simple_tailroom(buf) < PAWR_REC_HDR_LEN + len) {
+		LOG_WRN("Subevent data full, record for %i deferred", index);
+		return false;
+	}
+	net_buf_simple_add_u8(buf, index);
+	net_buf_simple_add_u8(buf, cmd_seq);
+	net_buf_simple_add_u8(buf, rsp_ack);
+	net_buf_simple_add_u8(buf, len);
+	net_buf_simple_add_mem(buf, data, len);
+	return true;
+}
+
+static void fill_subevent(uint8_t subevent, struct net_buf_simple *buf)
+{
+	k_spinlock_key_t key = k_spin_lock(&pawr_lock);
+
+	if (mcast.repeats_left[subevent] > 0 &&
+	    add_record(buf, PAWR_INDEX_ALL, mcast.seq, 0, mcast.data, mcast.len)) {
+		mcast.repeats_left[subevent]--;
+	}
+
+	if (subevent == PAWR_JOIN_SUBEVENT) {
+		for (int i = 0; i < ARRAY_SIZE(assign); i++) {
+			if (assign[i].repeats_left > 0) {
+				uint8_t rec[PAWR_ASSIGN_LEN];
+				rec[0] = assign[i].addr.type;
+				memcpy(&rec[1], assign[i].addr.a.val, 6);
+				rec[7] = assign[i].index;
+				if (add_record(buf, PAWR_INDEX_ASSIGN, 0, 0, rec, sizeof(rec))) {
+					assign[i].repeats_left--;
+				}
+			}
+		}
+	}
+
+	// Every pad gets a record each interval, carrying its next command and the ack of its last response
+	for (int i = subevent; i < PAWR_PAD_MAX; i += PAWR_NUM_SUBEVENTS) {
+		struct pawr_pad_t *pad = &pads[i];
+		if (!pad->used) {
+			continue;
+		}
+		if (pad->cmd_count > 0) {
+			if (pad->cmd_seq == 0) {
+				pad->seq_counter = PAWR_SEQ_NEXT(pad->seq_counter);
+				pad->cmd_seq = pad->seq_counter;
+			}
+			add_record(buf, i, pad->cmd_seq, pad->rsp_ack,
+				   pad->cmd[pad->cmd_head].data, pad->cmd[pad->cmd_head].len);
+		}
+		else {
+			add_record(buf, i, 0, pad->rsp_ack, NULL, 0);
+		}
+	}
+
+	k_spin_unlock(&pawr_lock, key);
+}
+
+static void request_cb(struct bt_le_ext_adv *adv, const struct bt_le_per_adv_data_request *request)
+{
+	struct bt_le_per_adv_subevent_data_params params[PAWR_NUM_SUBEVENTS];
+	uint8_t to_send = MIN(request->count, ARRAY_SIZE(params));
+	int err;
+
+	for (int i = 0; i < to_send; i++) {
+		uint8_t subevent = (request->start + i) % PAWR_NUM_SUBEVENTS;
+		struct net_buf_simple *buf = &subevent_buf[i];
+
+		net_buf_simple_init_with_data(buf, subevent_data[i], sizeof(subevent_data[i]));
+		net_buf_simple_reset(buf);
+		fill_subevent(subevent, buf);
+
+		params[i].subevent = subevent;
+		params[i].response_slot_start = 0;
+		params[i].response_slot_count = PAWR_NUM_RSP_SLOTS;
+		params[i].data = buf;
+	}
+
+	err = bt_le_per_adv_set_subevent_data(adv, to_send, params);
+	if (err) {
+		LOG_ERR("Failed to set subevent data (err %d)", err);
+	}
+}
+
+static void handle_join(const uint8_t *data)
+{
+	bt_addr_le_t addr;
+	int index = -1;
+	bool new_pad = false;
+
+	addr.type = data[0];
+	memcpy(addr.a.val, &data[1], 6);
+
+	k_spinlock_key_t key = k_spin_lock(&pawr_lock);
+	for (int i = 0; i < PAWR_PAD_MAX; i++) {
+		if (pads[i].used && bt_addr_le_cmp(&pads[i].addr, &addr) == 0) {
+			index = i;
+			break;
+		}
+	}
+	if (index < 0) {
+		for (int i = 0; i < PAWR_PAD_MAX; i++) {
+			if (!pads[i].used) {
+				memset(&pads[i], 0, sizeof(pads[i]));
+				pads[i].used = true;
+				bt_addr_le_copy(&pads[i].addr, &addr);
+				pad_count++;
+				index = i;
+				new_pad = true;
+				break;
+			}
+		}
+	}
+	if (index >= 0) {
+		// Reuse the announcement for the same pad if any, otherwise the one closest to expiring
+		int slot = (bt_addr_le_cmp(&assign[0].addr, &addr) == 0 ||
+			    assign[0].repeats_left <= assign[1].repeats_left) ? 0 : 1;
+		bt_addr_le_copy(&assign[slot].addr, &addr);
+		assign[slot].index = index;
+		assign[slot].repeats_left = ASSIGN_REPEATS;
+	}
+	k_spin_unlock(&pawr_lock, key);
+
+	if (index < 0) {
+		LOG_WRN("No free pad index");
+		return;
+	}
+	if (new_pad) {
+		LOG_INF("Pad joined with index %i (count %i)", index, pad_count);
+		fwd_event_con_num_change(pad_count);
+	}
+}
+
+static void response_cb(struct bt_le_ext_adv *adv, struct bt_le_per_adv_response_info *info,
+			struct net_buf_simple *buf)
+{
+	int index = info->response_slot * PAWR_NUM_SUBEVENTS + info->subevent;
+	struct pawr_pad_t *pad;
+	bool dropped = false;
+	bool new_rsp = false;
+
+	if (info->subevent == PAWR_JOIN_SUBEVENT && info->response_slot == PAWR_JOIN_SLOT) {
+		if (buf && buf->len >= PAWR_JOIN_LEN) {
+			handle_join(buf->data);
+		}
+		return;
+	}
+	if (index >= PAWR_PAD_MAX) {
+		return;
+	}
+	pad = &pads[index];
+
+	k_spinlock_key_t key = k_spin_lock(&pawr_lock);
+	if (!pad->used) {
+		k_spin_unlock(&pawr_lock, key);
+		return;
+	}
+	if (!buf) {
+		if (++pad->missed > MISSED_MAX) {
+			pad->used = false;
+			pad_count--;
+			dropped = true;
+		}
+	}
+	else if (buf->len >= PAWR_RSP_HDR_LEN) {
+		pad->missed = 0;
+		if (pad->cmd_count > 0 && pad->cmd_seq != 0 && buf->data[0] == pad->cmd_seq) {
+			pad->cmd_head = (pad->cmd_head + 1) % CMD_QUEUE_LEN;
+			pad->cmd_count--;
+			pad->cmd_seq = 0;
+		}
+		if (buf->len > PAWR_RSP_HDR_LEN && buf->data[1] != pad->rsp_ack) {
+			pad->rsp_ack = buf->data[1];
+			new_rsp = true;
+		}
+	}
+	k_spin_unlock(&pawr_lock, key);
+
+	if (dropped) {
+		LOG_INF("Pad %i lost (count %i)", index, pad_count);
+		fwd_event_con_num_change(pad_count);
+	}
+	if (new_rsp) {
+		fwd_event_rx_data(index, &buf->data[PAWR_RSP_HDR_LEN], buf->len - PAWR_RSP_HDR_LEN, info->rssi);
+	}
+}
+
+static const struct bt_le_ext_adv_cb adv_cb = {
+	.pawr_data_request = request_cb,
+	.pawr_response = response_cb,
+};
+
+// The pads are not connected in this mode, but the controller app still is
+static void connected(struct bt_conn *conn, uint8_t reason)
+{
+	if (!reason) {
+		fwd_event_ctrl_link_con_discon(conn, true);
+	}
+}
+
+static void disconnected(struct bt_conn *conn, uint8_t reason)
+{
+	fwd_event_ctrl_link_con_discon(conn, false);
+}
+
+static struct bt_conn_cb conn_callbacks = {
+	.connected = connected,
+	.disconnected = disconnected,
+};
+
+int app_bt_pawr_init(app_bt_callback_t callback)
+{
+	const struct bt_le_per_adv_param per_adv_params = {
+		.interval_min = PAWR_INTERVAL,
+		.interval_max = PAWR_INTERVAL,
+		.options = 0,
+		.num_subevents = PAWR_NUM_SUBEVENTS,
+		.subevent_interval = SUBEVENT_INTERVAL,
+		.response_slot_delay = RSP_SLOT_DELAY,
+		.response_slot_spacing = RSP_SLOT_SPACING,
+		.num_response_slots = PAWR_NUM_RSP_SLOTS,
+	};
+	int err;
+
+	m_callback = callback;
+
+	err = bt_enable(NULL);
+	if (err) {
+		LOG_ERR("Bluetooth init failed (err %d)", err);
+		return err;
+	}
+
+	bt_conn_cb_register(&conn_callbacks);
+
+	err = bt_le_ext_adv_create(BT_LE_EXT_ADV_NCONN, &adv_cb, &pawr_adv);
+	if (err) {
+		LOG_ERR("Failed to create advertising set (err %d)", err);
+		return err;
+	}
+
+	err = bt_le_ext_adv_set_data(pawr_adv, ad, ARRAY_SIZE(ad), NULL, 0);
+	if (err) {
+		LOG_ERR("Failed to set advertising data (err %d)", err);
+		return err;
+	}
+
+	err = bt_le_per_adv_set_param(pawr_adv, &per_adv_params);
+	if (err) {
+		LOG_ERR("Failed to set PAwR parameters (err %d)", err);
+		return err;
+	}
+
+	err = bt_le_per_adv_start(pawr_adv);
+	if (err) {
+		LOG_ERR("Failed to start PAwR (err %d)", err);
+		return err;
+	}
+
+	err = bt_le_ext_adv_start(pawr_adv, BT_LE_EXT_ADV_START_DEFAULT);
+	if (err) {
+		LOG_ERR("Failed to start extended advertising (err %d)", err);
+		return err;
+	}
+
+	LOG_INF("PAwR started, %i subevents x %i slots", PAWR_NUM_SUBEVENTS, PAWR_NUM_RSP_SLOTS);
+	return 0;
+}
+
+int app_bt_pawr_send_str(uint32_t pad_index, const uint8_t *string, uint16_t len)
+{
+	struct pawr_pad_t *pad;
+	int ret = 0;
+
+	if (pad_index >= PAWR_PAD_MAX || len > PAWR_REC_DATA_MAX) {
+		return -EINVAL;
+	}
+	pad = &pads[pad_index];
+
+	k_spinlock_key_t key = k_spin_lock(&pawr_lock);
+	if (!pad->used) {
+		ret = -ENOTCONN;
+	}
+	else if (pad->cmd_count >= CMD_QUEUE_LEN) {
+		ret = -ENOMEM;
+	}
+	else {
+		int i = (pad->cmd_head + pad->cmd_count) % CMD_QUEUE_LEN;
+		memcpy(pad->cmd[i].data, string, len);
+		pad->cmd[i].len = len;
+		pad->cmd_count++;
+	}
+	k_spin_unlock(&pawr_lock, key);
+	return ret;
+}
+
+int app_bt_pawr_send_multi(uint64_t pad_mask, const uint8_t *string, uint16_t len)
+{
+	uint64_t used_mask = 0;
+	bool all;
+
+	if (len > PAWR_REC_DATA_MAX) {
+		return -EINVAL;
+	}
+
+	for (int i = 0; i < PAWR_PAD_MAX; i++) {
+		if (pads[i].used) {
+			used_mask |= BIT64(i);
+		}
+	}
+	all = (pad_mask == UINT64_MAX) || ((pad_mask & used_mask) == used_mask);
+
+	if (!all) {
+		for (int i = 0; i < PAWR_PAD_MAX; i++) {
+			if (pad_mask & used_mask & BIT64(i)) {
+				app_bt_pawr_send_str(i, string, len);
+			}
+		}
+		return 0;
+	}
+
+	// One record in every subevent reaches all the pads, repeated since there are no acks
+	k_spinlock_key_t key = k_spin_lock(&pawr_lock);
+	mcast.seq = PAWR_SEQ_NEXT(mcast.seq);
+	memcpy(mcast.data, string, len);
+	mcast.len = len;
+	memset(mcast.repeats_left, MCAST_REPEATS, sizeof(mcast.repeats_left));
+	k_spin_unlock(&pawr_lock, key);
+	return 0;
+}
@@ -0,0 +1,16 @@
+#ifndef __APP_BT_PAWR_H
+#define __APP_BT_PAWR_H
+
+#include <app_bt.h>
+
+/* Connectionless transport to the pads, using Periodic Advertising with Responses.
+ * Raises the same events as app_bt, with the con_index field holding the pad index. */
+
+int app_bt_pawr_init(app_bt_callback_t callback);
+
+int app_bt_pawr_send_str(uint32_t pad_index, const uint8_t *string, uint16_t len);
+
+// A mask with all bits set addresses every pad
+int app_bt_pawr_send_multi(uint64_t pad_mask, const uint8_t *string, uint16_t len);
+
+#endif
@@ -0,0 +1,265 @@
+#include <app_bt_scan.h>
+#include <app_bt_sched.h>
+#include <app_bt_cache.h>
+#include <zephyr/bluetooth/hci.h>
+#include <string.h>
+
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(app_bt_scan, LOG_LEVEL_INF);
+
+#define MS_TO_SCAN_UNITS(ms)	((ms) * 1000 / 625)
+#define BACKOFF_INTERVAL	MS_TO_SCAN_UNITS(CONFIG_APP_BT_SCAN_BACKOFF_INTERVAL_MS)
+#define BACKOFF_WINDOW		MS_TO_SCAN_UNITS(CONFIG_APP_BT_SCAN_BACKOFF_WINDOW_MS)
+
+#if CONFIG_APP_BT_SCAN_EXPECTED_PADS > 0
+#define EXPECTED_PADS MIN(CONFIG_APP_BT_SCAN_EXPECTED_PADS, CONFIG_BT_MAX_CONN)
+#else
+#define EXPECTED_PADS CONFIG_BT_MAX_CONN
+#endif
+
+static const char *scan_mode_str[] = {"off", "fast", "backoff"};
+
+// Pads, and in a federation master the satellite centrals
+#define NAMES_MAX 2
+
+static struct {
+	const char *name;
+	uint8_t len;
+} m_names[NAMES_MAX];
+static uint8_t m_num_names;
+static app_bt_scan_match_cb_t m_match_cb;
+
+/* All calls come from the Bluetooth and system work queue threads, which are cooperative */
+static enum app_bt_scan_mode_t m_mode = APP_BT_SCAN_MODE_OFF;
+static uint16_t m_interval, m_window;
+static bool m_accept_list;
+static uint32_t m_num_links;
+static bool m_connecting;
+static bool m_game_running;
+static uint32_t m_game_links;
+
+/* Radio time during the game, estimated from the time spent in each mode and its duty cycle */
+static uint32_t t_mode_start;
+static uint64_t radio_time_us;
+static atomic_t radio_time_ms;
+static uint32_t t_game_start;
+
+/* Reports delivered by the controller, and the ones that were pads */
+static struct app_bt_scan_stats_t scan_stats;
+
+static bool name_matches(const uint8_t *name, uint8_t len)
+{
+	for (int i = 0; i < m_num_names; i++) {
+		if (len == m_names[i].len && memcmp(name, m_names[i].name, len) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Walk the AD structures in place, and only compare the complete name
+static bool adv_name_matches(const struct net_buf_simple *ad)
+{
+	const uint8_t *p = ad->data;
+	uint16_t left = ad->len;
+
+	while (left > 1) {
+		uint8_t len = p[0];
+		if (len == 0 || len >= left) {
+			break;
+		}
+		if (p[1] == BT_DATA_NAME_COMPLETE) {
+			return name_matches(&p[2], len - 1);
+		}
+		p += len + 1;
+		left -= len + 1;
+	}
+	return false;
+}
+
+static void scan_cb(const bt_addr_le_t *addr, int8_t rssi, uint8_t type, struct net_buf_simple *ad)
+{
+	scan_stats.processed++;
+
+	/* We're only interested in connectable events */
+	if (type != BT_GAP_ADV_TYPE_ADV_IND &&
+	    type != BT_GAP_ADV_TYPE_ADV_DIRECT_IND &&
+	    type != BT_GAP_ADV_TYPE_EXT_ADV) {
+		return;
+	}
+	if (!adv_name_matches(ad)) {
+		return;
+	}
+
+	scan_stats.matched++;
+	m_match_cb(addr);
+}
+
+#if defined(CONFIG_APP_BT_SCAN_ACCEPT_LIST)
+// Load the pads known from the GATT cache into the controller. Returns false if there are none.
+static bool accept_list_load(void)
+{
+	bt_addr_le_t addrs[CONFIG_APP_BT_GATT_CACHE_SIZE];
+	uint32_t num = app_bt_cache_addr_get(addrs, ARRAY_SIZE(addrs));
+	uint32_t added = 0;
+
+	bt_le_filter_accept_list_clear();
+	for (int i = 0; i < num; i++) {
+		if (bt_le_filter_accept_list_add(&addrs[i]) == 0) {
+			added++;
+		}
+	}
+	return added > 0;
+}
+#endif
+
+static void radio_time_account(void)
+{
+	uint32_t now = k_uptime_get_32();
+
+	if (m_mode != APP_BT_SCAN_MODE_OFF && m_game_running) {
+		radio_time_us += (uint64_t)(now - t_mode_start) * 1000 * m_window / m_interval;
+		atomic_set(&radio_time_ms, (atomic_val_t)(radio_time_us / 1000));
+	}
+	t_mode_start = now;
+}
+
+static enum app_bt_scan_mode_t scan_mode_select(void)
+{
+	if (m_connecting || m_num_links >= EXPECTED_PADS) {
+		return APP_BT_SCAN_MODE_OFF;
+	}
+	// A pad lost during the game is looked for at full speed
+	if (m_game_running && m_num_links >= m_game_links) {
+		return APP_BT_SCAN_MODE_BACKOFF;
+	}
+	return APP_BT_SCAN_MODE_FAST;
+}
+
+static void scan_apply(void)
+{
+	enum app_bt_scan_mode_t mode = scan_mode_select();
+	uint16_t interval = 0, window = 0;
+	// During a game only the pads already known are of interest
+	bool accept_list = IS_ENABLED(CONFIG_APP_BT_SCAN_ACCEPT_LIST) && m_game_running &&
+			   mode != APP_BT_SCAN_MODE_OFF;
+	int err;
+
+	if (mode == APP_BT_SCAN_MODE_FAST) {
+		struct app_bt_sched_plan_t setup, plan;
+		app_bt_sched_plan(CONFIG_BT_MAX_CONN, 0, &setup);
+		app_bt_sched_plan(m_num_links, setup.interval, &plan);
+		interval = plan.scan_interval;
+		window = plan.scan_window;
+	}
+	else if (mode == APP_BT_SCAN_MODE_BACKOFF) {
+		interval = BACKOFF_INTERVAL;
+		window = BACKOFF_WINDOW;
+	}
+
+	if (mode == m_mode && interval == m_interval && window == m_window && accept_list == m_accept_list) {
+		return;
+	}
+
+	radio_time_account();
+	if (m_mode != APP_BT_SCAN_MODE_OFF) {
+		bt_le_scan_stop();
+		LOG_INF("Scan reports: %u processed, %u matched", scan_stats.processed, scan_stats.matched);
+	}
+	m_mode = APP_BT_SCAN_MODE_OFF;
+	m_interval = m_window = 0;
+	m_accept_list = false;
+
+	if (mode != APP_BT_SCAN_MODE_OFF) {
+#if defined(CONFIG_APP_BT_SCAN_ACCEPT_LIST)
+		// The list can only be changed while the scanner is stopped
+		if (accept_list) {
+			accept_list = accept_list_load();
+		}
+#endif
+		/* The controller reports every advertiser once per scan start, which is enough since the
+		 * scanner is restarted after every connection attempt */
+		struct bt_le_scan_param scan_param = {
+			.type       = BT_HCI_LE_SCAN_PASSIVE,
+			.options    = BT_LE_SCAN_OPT_FILTER_DUPLICATE |
+				      (accept_list ? BT_LE_SCAN_OPT_FILTER_ACCEPT_LIST : 0),
+			.interval   = interval,
+			.window     = window,
+		};
+		err = bt_le_scan_start(&scan_param, scan_cb);
+		if (err) {
+			LOG_ERR("Scanning failed to start (err %d)", err);
+			return;
+		}
+		m_mode = mode;
+		m_interval = interval;
+		m_window = window;
+		m_accept_list = accept_list;
+	}
+
+	LOG_INF("Scan %s%s (interval %u, window %u, %u links)", scan_mode_str[m_mode],
+		m_accept_list ? ", known pads only" : "", interval, window, m_num_links);
+}
+
+void app_bt_scan_init(const char *name, app_bt_scan_match_cb_t cb)
+{
+	m_num_names = 0;
+	app_bt_scan_name_add(name);
+	m_match_cb = cb;
+}
+
+int app_bt_scan_name_add(const char *name)
+{
+	if (m_num_names >= NAMES_MAX) {
+		return -ENOMEM;
+	}
+	m_names[m_num_names].name = name;
+	m_names[m_num_names].len = strlen(name);
+	m_num_names++;
+	return 0;
+}
+
+void app_bt_scan_update(uint32_t num_links, bool connecting)
+{
+	m_num_links = num_links;
+	m_connecting = connecting;
+	scan_apply();
+}
+
+void app_bt_scan_stop(void)
+{
+	m_connecting = true;
+	scan_apply();
+}
+
+void app_bt_scan_game_set(bool running)
+{
+	if (running == m_game_running) {
+		return;
+	}
+
+	radio_time_account();
+	if (running) {
+		radio_time_us = 0;
+		atomic_set(&radio_time_ms, 0);
+		t_game_start = k_uptime_get_32();
+		m_game_links = m_num_links;
+	}
+	else {
+		LOG_INF("Scanning used %u ms of radio time during the game (%u s)",
+			(uint32_t)(radio_time_us / 1000), (k_uptime_get_32() - t_game_start) / 1000);
+	}
+	m_game_running = running;
+	scan_apply();
+}
+
+uint32_t app_bt_scan_radio_time_ms(void)
+{
+	// Updated whenever the scan mode changes, and at the end of the game
+	return (uint32_t)atomic_get(&radio_time_ms);
+}
+
+void app_bt_scan_stats_get(struct app_bt_scan_stats_t *stats)
+{
+	*stats = scan_stats;
+}
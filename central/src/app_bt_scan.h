@@ -0,0 +1,42 @@
+#ifndef __APP_BT_SCAN_H
+#define __APP_BT_SCAN_H
+
+#include <zephyr/kernel.h>
+#include <zephyr/bluetooth/bluetooth.h>
+
+/* Scan governor. Scans in all the time the links leave free while pads are missing, backs off to a
+ * low duty cycle while a game is running, and stops once the expected number of pads is connected.
+ * A pad that drops out during a game is scanned for at full speed again.
+ * Reports are filtered by the controller where possible: duplicates are always filtered, and during a
+ * game only the pads in the GATT cache pass the filter accept list. */
+enum app_bt_scan_mode_t {APP_BT_SCAN_MODE_OFF, APP_BT_SCAN_MODE_FAST, APP_BT_SCAN_MODE_BACKOFF};
+
+struct app_bt_scan_stats_t {
+	uint32_t processed;
+	uint32_t matched;
+};
+
+// Called for connectable advertisers with the given complete name
+typedef void (*app_bt_scan_match_cb_t)(const bt_addr_le_t *addr);
+
+void app_bt_scan_init(const char *name, app_bt_scan_match_cb_t cb);
+
+// Also connect to advertisers with this complete name. The string must stay valid.
+int app_bt_scan_name_add(const char *name);
+
+// Re-evaluate the scan mode, ie. when a link connects or disconnects. The scanner is off while connecting.
+void app_bt_scan_update(uint32_t num_links, bool connecting);
+
+// Stop scanning right away, ie. before starting the initiator
+void app_bt_scan_stop(void);
+
+// Start or end a game. The radio time used by scanning is counted from the start of the game.
+void app_bt_scan_game_set(bool running);
+
+// Radio time spent scanning during the current or last game, in ms. Updated on every scan mode change.
+uint32_t app_bt_scan_radio_time_ms(void);
+
+// Advertising reports seen by the host since boot, and how many of them were pads
+void app_bt_scan_stats_get(struct app_bt_scan_stats_t *stats);
+
+#endif
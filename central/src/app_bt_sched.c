@@ -0,0 +1,237 @@
+#include <app_bt_sched.h>
+#include <app_bt_health.h>
+#include <zephyr/bluetooth/hci.h>
+
+#if defined(CONFIG_BT_LL_SOFTDEVICE)
+#include <sdc_hci_vs.h>
+#endif
+
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(app_bt_sched, LOG_LEVEL_INF);
+
+#define EVENT_LEN_US		CONFIG_APP_BT_SCHED_EVENT_LEN_US
+#define SCAN_RESERVE_US		CONFIG_APP_BT_SCHED_SCAN_RESERVE_US
+#define SCAN_WINDOW_MIN		4 /* 2.5 ms */
+#define SLOT_NUM		(CONFIG_BT_MAX_CONN + 1)
+
+void app_bt_sched_plan(uint32_t num_links, uint16_t min_interval, struct app_bt_sched_plan_t *plan)
+{
+	uint32_t interval_us;
+
+	// The control link takes a slot whether or not the app is connected, so it can join at any time
+	plan->event_len_us = EVENT_LEN_US;
+	plan->busy_us = (num_links + 1) * EVENT_LEN_US;
+	interval_us = MAX((uint32_t)min_interval * 1250, plan->busy_us + SCAN_RESERVE_US);
+	plan->interval = DIV_ROUND_UP(interval_us, 1250);
+
+	// Scan in the gap after the link events, once per interval
+	plan->scan_interval = plan->interval * 2;
+	plan->scan_window = MAX((plan->interval * 1250 - plan->busy_us) / 625, SCAN_WINDOW_MIN);
+	plan->scan_window = MIN(plan->scan_window, plan->scan_interval);
+}
+
+#if defined(CONFIG_APP_BT_QOS_REPORTS)
+/* Conflict diagnostics, based on the QoS connection event reports of the controller.
+ * A link misses events when the controller gives its time to another link or the scanner,
+ * and two links conflict when their events start closer than one event length.
+ * The controller has a single vendor event callback, so the reports are also passed on to the
+ * link health monitor from here. */
+static struct sched_link_t {
+	bool used;
+	bool has_report;
+	uint16_t handle;
+	uint16_t interval;
+	uint16_t last_counter;
+	uint32_t last_anchor_us;
+	uint32_t events;
+	uint32_t missed;
+	uint32_t conflicts;
+} sched_link[SLOT_NUM];
+
+static struct k_spinlock sched_lock;
+
+static bool on_vs_evt(struct net_buf_simple *buf)
+{
+	const sdc_hci_subevent_vs_qos_conn_event_report_t *evt;
+	struct sched_link_t *link = NULL;
+	uint16_t skipped = 0;
+	uint32_t slot = 0;
+	uint8_t code;
+
+	code = net_buf_simple_pull_u8(buf);
+	if (code != SDC_HCI_SUBEVENT_VS_QOS_CONN_EVENT_REPORT) {
+		return false;
+	}
+	evt = (const void *)buf->data;
+
+	k_spinlock_key_t key = k_spin_lock(&sched_lock);
+	for (int i = 0; i < SLOT_NUM; i++) {
+		if (sched_link[i].used && sched_link[i].handle == evt->conn_handle) {
+			link = &sched_link[i];
+			slot = i;
+			break;
+		}
+	}
+	if (link) {
+		if (link->has_report) {
+			skipped = (uint16_t)(evt->event_counter - link->last_counter) - 1;
+			link->missed += skipped;
+		}
+		for (int i = 0; i < SLOT_NUM; i++) {
+			struct sched_link_t *other = &sched_link[i];
+			if (other == link || !other->used || !other->has_report) {
+				continue;
+			}
+			uint32_t diff = evt->anchor_point_us - other->last_anchor_us;
+			if (diff < EVENT_LEN_US) {
+				link->conflicts++;
+			}
+		}
+		link->events++;
+		link->has_report = true;
+		link->last_counter = evt->event_counter;
+		link->last_anchor_us = evt->anchor_point_us;
+	}
+	k_spin_unlock(&sched_lock, key);
+
+	if (link) {
+		app_bt_health_conn_event(slot, skipped, evt->tx_packet_count, evt->tx_ack_count,
+					 evt->rx_packet_count, evt->rx_crc_error_count);
+	}
+	return true;
+}
+
+static int qos_report_enable(bool enable)
+{
+	sdc_hci_cmd_vs_qos_conn_event_report_enable_t *cmd;
+	struct net_buf *buf;
+
+	buf = bt_hci_cmd_create(SDC_HCI_OPCODE_CMD_VS_QOS_CONN_EVENT_REPORT_ENABLE, sizeof(*cmd));
+	if (!buf) {
+		return -ENOBUFS;
+	}
+	cmd = net_buf_add(buf, sizeof(*cmd));
+	cmd->enable = enable;
+
+	return bt_hci_cmd_send_sync(SDC_HCI_OPCODE_CMD_VS_QOS_CONN_EVENT_REPORT_ENABLE, buf, NULL);
+}
+
+#if defined(CONFIG_APP_BT_SCHED_DIAG)
+static void sched_diag_work_handler(struct k_work *work);
+K_WORK_DELAYABLE_DEFINE(m_work_sched_diag, sched_diag_work_handler);
+
+static void sched_diag_work_handler(struct k_work *work)
+{
+	struct sched_link_t snapshot[SLOT_NUM];
+	uint32_t ref_anchor_us = 0;
+	bool ref_found = false;
+
+	k_spinlock_key_t key = k_spin_lock(&sched_lock);
+	memcpy(snapshot, sched_link, sizeof(snapshot));
+	for (int i = 0; i < SLOT_NUM; i++) {
+		sched_link[i].events = sched_link[i].missed = sched_link[i].conflicts = 0;
+	}
+	k_spin_unlock(&sched_lock, key);
+
+	for (int i = 0; i < SLOT_NUM; i++) {
+		struct sched_link_t *link = &snapshot[i];
+		if (!link->used || !link->has_report) {
+			continue;
+		}
+		if (!ref_found) {
+			ref_anchor_us = link->last_anchor_us;
+			ref_found = true;
+		}
+		// Anchor relative to the first link, folded into one interval
+		uint32_t offset_us = (link->last_anchor_us - ref_anchor_us) % (link->interval * 1250);
+		if (i == APP_BT_SCHED_SLOT_CTRL) {
+			LOG_INF("Ctrl: offset %u us, events %u, missed %u, conflicts %u", offset_us,
+				link->events, link->missed, link->conflicts);
+		}
+		else {
+			LOG_INF("Link %i: offset %u us, events %u, missed %u, conflicts %u", i, offset_us,
+				link->events, link->missed, link->conflicts);
+		}
+	}
+
+	k_work_reschedule(&m_work_sched_diag, K_MSEC(CONFIG_APP_BT_SCHED_DIAG_PERIOD_MS));
+}
+#endif
+
+void app_bt_sched_link_add(uint32_t slot, struct bt_conn *conn)
+{
+	struct bt_conn_info info;
+	uint16_t handle;
+
+	if (slot >= SLOT_NUM || bt_hci_get_conn_handle(conn, &handle) || bt_conn_get_info(conn, &info)) {
+		return;
+	}
+
+	k_spinlock_key_t key = k_spin_lock(&sched_lock);
+	memset(&sched_link[slot], 0, sizeof(sched_link[slot]));
+	sched_link[slot].used = true;
+	sched_link[slot].handle = handle;
+	sched_link[slot].interval = info.le.interval;
+	k_spin_unlock(&sched_lock, key);
+}
+
+void app_bt_sched_link_remove(uint32_t slot)
+{
+	if (slot >= SLOT_NUM) {
+		return;
+	}
+
+	k_spinlock_key_t key = k_spin_lock(&sched_lock);
+	sched_link[slot].used = false;
+	k_spin_unlock(&sched_lock, key);
+}
+#else
+void app_bt_sched_link_add(uint32_t slot, struct bt_conn *conn) {}
+
+void app_bt_sched_link_remove(uint32_t slot) {}
+#endif
+
+int app_bt_sched_init(void)
+{
+	int err = 0;
+
+#if defined(CONFIG_BT_LL_SOFTDEVICE)
+	sdc_hci_cmd_vs_event_length_set_t *cmd;
+	struct net_buf *buf;
+
+	// The event length only applies to links created after the command
+	buf = bt_hci_cmd_create(SDC_HCI_OPCODE_CMD_VS_EVENT_LENGTH_SET, sizeof(*cmd));
+	if (!buf) {
+		return -ENOBUFS;
+	}
+	cmd = net_buf_add(buf, sizeof(*cmd));
+	cmd->event_length_us = EVENT_LEN_US;
+	err = bt_hci_cmd_send_sync(SDC_HCI_OPCODE_CMD_VS_EVENT_LENGTH_SET, buf, NULL);
+	if (err) {
+		LOG_ERR("Event length set failed (err %d)", err);
+		return err;
+	}
+#endif
+
+#if defined(CONFIG_APP_BT_QOS_REPORTS)
+	err = bt_hci_register_vnd_evt_cb(on_vs_evt);
+	if (err) {
+		LOG_ERR("VS event callback registration failed (err %d)", err);
+		return err;
+	}
+	err = qos_report_enable(true);
+	if (err) {
+		LOG_ERR("QoS conn event reports could not be enabled (err %d)", err);
+		return err;
+	}
+#endif
+#if defined(CONFIG_APP_BT_SCHED_DIAG)
+	k_work_reschedule(&m_work_sched_diag, K_MSEC(CONFIG_APP_BT_SCHED_DIAG_PERIOD_MS));
+#endif
+
+	struct app_bt_sched_plan_t plan;
+	app_bt_sched_plan(CONFIG_BT_MAX_CONN, 0, &plan);
+	LOG_INF("Event length %u us, %i links plus control fit an interval of %u (%u us)", EVENT_LEN_US,
+		CONFIG_BT_MAX_CONN, plan.interval, plan.interval * 1250);
+	return err;
+}
@@ -0,0 +1,32 @@
+#ifndef __APP_BT_SCHED_H
+#define __APP_BT_SCHED_H
+
+#include <zephyr/kernel.h>
+#include <zephyr/bluetooth/conn.h>
+
+/* Radio schedule for the pad links, the control link and the scanner.
+ * Every link gets a fixed event length, and all links share the interval, so the controller can
+ * place their events back to back. Whatever is left of the interval is given to the scanner. */
+struct app_bt_sched_plan_t {
+	uint16_t interval;        // 1.25 ms units
+	uint32_t event_len_us;
+	uint32_t busy_us;         // Time used by the link events in every interval
+	uint16_t scan_interval;   // 0.625 ms units
+	uint16_t scan_window;     // 0.625 ms units
+};
+
+// Apply the event length to the controller. Must be called after bt_enable, before any link is created.
+int app_bt_sched_init(void);
+
+// Plan for num_links pad links plus the control link, with an interval of at least min_interval
+void app_bt_sched_plan(uint32_t num_links, uint16_t min_interval, struct app_bt_sched_plan_t *plan);
+
+// Follow a link in the diagnostics. Slot CONFIG_BT_MAX_CONN is the control link.
+// Call again when the connection parameters of the link change, which restarts its counters.
+void app_bt_sched_link_add(uint32_t slot, struct bt_conn *conn);
+
+void app_bt_sched_link_remove(uint32_t slot);
+
+#define APP_BT_SCHED_SLOT_CTRL CONFIG_BT_MAX_CONN
+
+#endif
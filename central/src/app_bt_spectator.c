@@ -0,0 +1,99 @@
+#include <app_bt_spectator.h>
+
+#include <zephyr/bluetooth/bluetooth.h>
+#include <zephyr/logging/log.h>
+
+LOG_MODULE_REGISTER(app_bt_spectator, LOG_LEVEL_INF);
+
+#define PER_ADV_INTERVAL	CONFIG_APP_BT_SPECTATOR_INTERVAL
+#define COMPANY_ID_LEN		2
+
+static const struct bt_data ad[] = {
+	BT_DATA(BT_DATA_NAME_COMPLETE, APP_BT_SPECTATOR_NAME, sizeof(APP_BT_SPECTATOR_NAME) - 1),
+};
+
+static struct bt_le_ext_adv *spectator_adv;
+
+static struct proto_snapshot_t m_snapshot;
+static struct k_spinlock snapshot_lock;
+
+static void spectator_update_work_handler(struct k_work *work);
+K_WORK_DEFINE(m_work_spectator_update, spectator_update_work_handler);
+
+static void spectator_update_work_handler(struct k_work *work)
+{
+	uint8_t payload[COMPANY_ID_LEN + PROTO_FRAME_MAX] = {APP_BT_SPECTATOR_COMPANY_ID & 0xFF,
+							     APP_BT_SPECTATOR_COMPANY_ID >> 8};
+	struct proto_snapshot_t snapshot;
+
+	// Only the latest state matters, updates made meanwhile are merged into this one
+	k_spinlock_key_t key = k_spin_lock(&snapshot_lock);
+	snapshot = m_snapshot;
+	k_spin_unlock(&snapshot_lock, key);
+
+	int len = proto_encode(PROTO_MSG_SNAPSHOT, &snapshot, &payload[COMPANY_ID_LEN], PROTO_FRAME_MAX);
+	if (len < 0) {
+		LOG_ERR("Snapshot encode failed (err %i)", len);
+		return;
+	}
+	struct bt_data per_ad = BT_DATA(BT_DATA_MANUFACTURER_DATA, payload, COMPANY_ID_LEN + len);
+	int err = bt_le_per_adv_set_data(spectator_adv, &per_ad, 1);
+	if (err) {
+		LOG_WRN("Periodic advertising data update failed (err %i)", err);
+	}
+}
+
+int app_bt_spectator_init(void)
+{
+	const struct bt_le_per_adv_param per_adv_params = {
+		.interval_min = PER_ADV_INTERVAL,
+		.interval_max = PER_ADV_INTERVAL,
+		.options = 0,
+	};
+	int err;
+
+	err = bt_le_ext_adv_create(BT_LE_EXT_ADV_NCONN, NULL, &spectator_adv);
+	if (err) {
+		LOG_ERR("Failed to create advertising set (err %d)", err);
+		return err;
+	}
+
+	err = bt_le_ext_adv_set_data(spectator_adv, ad, ARRAY_SIZE(ad), NULL, 0);
+	if (err) {
+		LOG_ERR("Failed to set advertising data (err %d)", err);
+		return err;
+	}
+
+	err = bt_le_per_adv_set_param(spectator_adv, &per_adv_params);
+	if (err) {
+		LOG_ERR("Failed to set periodic advertising parameters (err %d)", err);
+		return err;
+	}
+
+	// Start with an idle game, so the periodic train has data before the first update
+	spectator_update_work_handler(NULL);
+
+	err = bt_le_per_adv_start(spectator_adv);
+	if (err) {
+		LOG_ERR("Failed to start periodic advertising (err %d)", err);
+		return err;
+	}
+
+	err = bt_le_ext_adv_start(spectator_adv, BT_LE_EXT_ADV_START_DEFAULT);
+	if (err) {
+		LOG_ERR("Failed to start extended advertising (err %d)", err);
+		return err;
+	}
+
+	LOG_INF("Spectator broadcast started, interval %u us", PER_ADV_INTERVAL * 1250);
+	return 0;
+}
+
+void app_bt_spectator_update(const struct proto_snapshot_t *snapshot)
+{
+	k_spinlock_key_t key = k_spin_lock(&snapshot_lock);
+	m_snapshot = *snapshot;
+	k_spin_unlock(&snapshot_lock, key);
+
+	k_work_submit(&m_work_spectator_update);
+}
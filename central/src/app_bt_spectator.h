@@ -0,0 +1,26 @@
+#ifndef __APP_BT_SPECTATOR_H
+#define __APP_BT_SPECTATOR_H
+
+#include <zephyr/kernel.h>
+#include <proto.h>
+
+/* Live game state for any number of passive spectators, published in periodic advertising.
+ * The periodic train is found through a non-connectable extended advertiser named
+ * APP_BT_SPECTATOR_NAME. Its data is a manufacturer specific AD with the Nordic company ID,
+ * followed by a PROTO_MSG_SNAPSHOT frame. */
+
+#define APP_BT_SPECTATOR_NAME		"Whack-Score"
+#define APP_BT_SPECTATOR_COMPANY_ID	0x0059
+
+#if defined(CONFIG_APP_BT_SPECTATOR)
+int app_bt_spectator_init(void);
+
+// Publish a new game state. The advertising data is updated from the system work queue, in time for the next periodic event.
+void app_bt_spectator_update(const struct proto_snapshot_t *snapshot);
+#else
+static inline int app_bt_spectator_init(void) { return 0; }
+
+static inline void app_bt_spectator_update(const struct proto_snapshot_t *snapshot) {}
+#endif
+
+#endif
@@ -0,0 +1,193 @@
+#include <app_bt_timesync.h>
+#include <stdlib.h>
+
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(app_bt_timesync, LOG_LEVEL_INF);
+
+#define SAMPLES_PR_SYNC	CONFIG_APP_BT_TIMESYNC_SAMPLES
+#define RSP_TIMEOUT_MS	1000
+
+static struct ts_link_t {
+	bool active;
+	bool synced;
+	bool request_pending;
+	bool t_sent_valid, t_rx_valid;
+	uint8_t seq;
+	uint8_t num_samples;
+	uint32_t t_sent, t_rx;
+	uint32_t t_request;
+	uint32_t t_last_sync;
+	int32_t samples[SAMPLES_PR_SYNC];
+	int32_t offset_us;
+} ts_link[CONFIG_BT_MAX_CONN];
+
+static struct k_spinlock ts_lock;
+
+static app_bt_timesync_send_t m_send_func;
+
+static void timesync_work_handler(struct k_work *work);
+K_WORK_DELAYABLE_DEFINE(m_work_timesync, timesync_work_handler);
+
+static int compare_int32(const void *a, const void *b)
+{
+	int32_t da = *(const int32_t *)a, db = *(const int32_t *)b;
+	return (da > db) - (da < db);
+}
+
+static void send_request(uint32_t con_index)
+{
+	struct ts_link_t *link = &ts_link[con_index];
+	struct proto_timesync_req_t req;
+	uint8_t frame[PROTO_FRAME_MAX];
+	int len;
+
+	link->seq++;
+	link->request_pending = true;
+	link->t_sent_valid = link->t_rx_valid = false;
+	link->t_request = k_uptime_get_32();
+
+	req.seq = link->seq;
+	len = proto_encode(PROTO_MSG_TIMESYNC_REQ, &req, frame, sizeof(frame));
+	if (len < 0 || m_send_func(con_index, frame, len) < 0) {
+		link->request_pending = false;
+	}
+}
+
+static void send_offset(uint32_t con_index, int32_t offset_us)
+{
+	struct proto_timesync_offset_t msg = {.offset_us = offset_us};
+	uint8_t frame[PROTO_FRAME_MAX];
+	int len;
+
+	len = proto_encode(PROTO_MSG_TIMESYNC_OFFSET, &msg, frame, sizeof(frame));
+	if (len > 0) {
+		m_send_func(con_index, frame, len);
+	}
+}
+
+// Called with the lock held, once both the transmit and the receive stamp of a round are known
+static bool sample_complete(struct ts_link_t *link)
+{
+	link->request_pending = false;
+	link->samples[link->num_samples++] = (int32_t)(link->t_rx - link->t_sent);
+	if (link->num_samples < SAMPLES_PR_SYNC) {
+		return false;
+	}
+
+	qsort(link->samples, SAMPLES_PR_SYNC, sizeof(int32_t), compare_int32);
+	link->offset_us = link->samples[SAMPLES_PR_SYNC / 2];
+	link->synced = true;
+	link->num_samples = 0;
+	link->t_last_sync = k_uptime_get_32();
+	return true;
+}
+
+static void timesync_work_handler(struct k_work *work)
+{
+	uint32_t now = k_uptime_get_32();
+	bool any_active = false;
+
+	for (int i = 0; i < CONFIG_BT_MAX_CONN; i++) {
+		struct ts_link_t *link = &ts_link[i];
+		if (!link->active) {
+			continue;
+		}
+		any_active = true;
+		if (link->request_pending) {
+			// Lost request or response, start the round over
+			if ((now - link->t_request) > RSP_TIMEOUT_MS) {
+				send_request(i);
+			}
+		}
+		else if (link->num_samples > 0 || !link->synced ||
+			 (now - link->t_last_sync) >= CONFIG_APP_BT_TIMESYNC_PERIOD_MS) {
+			send_request(i);
+		}
+	}
+	if (any_active) {
+		k_work_reschedule(&m_work_timesync, K_MSEC(RSP_TIMEOUT_MS / 4));
+	}
+}
+
+void app_bt_timesync_init(app_bt_timesync_send_t send_func)
+{
+	m_send_func = send_func;
+}
+
+void app_bt_timesync_start(uint32_t con_index)
+{
+	k_spinlock_key_t key = k_spin_lock(&ts_lock);
+	memset(&ts_link[con_index], 0, sizeof(ts_link[con_index]));
+	ts_link[con_index].active = true;
+	k_spin_unlock(&ts_lock, key);
+
+	k_work_reschedule(&m_work_timesync, K_NO_WAIT);
+}
+
+void app_bt_timesync_stop(uint32_t con_index)
+{
+	k_spinlock_key_t key = k_spin_lock(&ts_lock);
+	ts_link[con_index].active = false;
+	ts_link[con_index].synced = false;
+	k_spin_unlock(&ts_lock, key);
+}
+
+void app_bt_timesync_sent(uint32_t con_index, uint32_t t_us)
+{
+	struct ts_link_t *link = &ts_link[con_index];
+	bool round_done = false, sync_done = false;
+
+	k_spinlock_key_t key = k_spin_lock(&ts_lock);
+	if (link->active && link->request_pending && !link->t_sent_valid) {
+		link->t_sent = t_us;
+		link->t_sent_valid = true;
+		if (link->t_rx_valid) {
+			round_done = true;
+			sync_done = sample_complete(link);
+		}
+	}
+	k_spin_unlock(&ts_lock, key);
+
+	if (sync_done) {
+		LOG_DBG("Link %i synced, offset %i us", con_index, link->offset_us);
+		send_offset(con_index, link->offset_us);
+	}
+	else if (round_done) {
+		k_work_reschedule(&m_work_timesync, K_NO_WAIT);
+	}
+}
+
+void app_bt_timesync_rx(uint32_t con_index, const struct proto_timesync_rsp_t *rsp)
+{
+	struct ts_link_t *link = &ts_link[con_index];
+	bool round_done = false, sync_done = false;
+
+	k_spinlock_key_t key = k_spin_lock(&ts_lock);
+	if (link->active && link->request_pending && rsp->seq == link->seq) {
+		link->t_rx = rsp->t_rx_us;
+		link->t_rx_valid = true;
+		if (link->t_sent_valid) {
+			round_done = true;
+			sync_done = sample_complete(link);
+		}
+	}
+	k_spin_unlock(&ts_lock, key);
+
+	if (sync_done) {
+		LOG_DBG("Link %i synced, offset %i us", con_index, link->offset_us);
+		send_offset(con_index, link->offset_us);
+	}
+	else if (round_done) {
+		k_work_reschedule(&m_work_timesync, K_NO_WAIT);
+	}
+}
+
+bool app_bt_timesync_is_synced(uint32_t con_index)
+{
+	return con_index < CONFIG_BT_MAX_CONN && ts_link[con_index].synced;
+}
+
+int32_t app_bt_timesync_offset_us(uint32_t con_index)
+{
+	return ts_link[con_index].offset_us;
+}
@@ -0,0 +1,27 @@
+#ifndef __APP_BT_TIMESYNC_H
+#define __APP_BT_TIMESYNC_H
+
+#include <zephyr/kernel.h>
+#include <timesync.h>
+#include <proto.h>
+
+typedef int (*app_bt_timesync_send_t)(uint32_t con_index, const uint8_t *data, uint16_t len);
+
+void app_bt_timesync_init(app_bt_timesync_send_t send_func);
+
+// Start syncing a link once it is ready, and keep resyncing it periodically to follow the drift
+void app_bt_timesync_start(uint32_t con_index);
+
+void app_bt_timesync_stop(uint32_t con_index);
+
+// Called when the stack reports a sync request as transmitted
+void app_bt_timesync_sent(uint32_t con_index, uint32_t t_us);
+
+void app_bt_timesync_rx(uint32_t con_index, const struct proto_timesync_rsp_t *rsp);
+
+bool app_bt_timesync_is_synced(uint32_t con_index);
+
+// Offset of the pad clock relative to the central clock, in us
+int32_t app_bt_timesync_offset_us(uint32_t con_index);
+
+#endif
@@ -0,0 +1,146 @@
+#include <app_bt_tx.h>
+#include <string.h>
+
+#define QUEUE_LEN CONFIG_APP_BT_TX_QUEUE_LEN
+
+struct tx_ring_t {
+	struct app_bt_tx_msg_t msg[QUEUE_LEN];
+	uint8_t head;
+	uint8_t count;
+};
+
+static struct tx_link_t {
+	struct tx_ring_t ring[APP_BT_TX_PRIO_NUM];
+	struct app_bt_tx_stats_t stats;
+} tx_link[CONFIG_BT_MAX_CONN];
+
+static struct k_spinlock tx_lock;
+
+static app_bt_tx_discard_cb_t m_discard_cb;
+
+static void discard(uint32_t con_index, uint8_t batch)
+{
+	if (batch != APP_BT_TX_BATCH_NONE && m_discard_cb) {
+		m_discard_cb(con_index, batch);
+	}
+}
+
+void app_bt_tx_init(app_bt_tx_discard_cb_t discard_cb)
+{
+	m_discard_cb = discard_cb;
+}
+
+void app_bt_tx_reset(uint32_t con_index)
+{
+	struct app_bt_tx_msg_t msg;
+	while (app_bt_tx_get(con_index, &msg)) {
+		k_spinlock_key_t key = k_spin_lock(&tx_lock);
+		tx_link[con_index].stats.dropped++;
+		k_spin_unlock(&tx_lock, key);
+		discard(con_index, msg.batch);
+	}
+}
+
+int app_bt_tx_put(uint32_t con_index, const uint8_t *data, uint16_t len, enum app_bt_tx_prio_t prio,
+		  uint8_t batch, uint8_t flags)
+{
+	struct tx_link_t *link;
+	struct tx_ring_t *ring;
+	struct app_bt_tx_msg_t *msg;
+	uint8_t discarded_batch = APP_BT_TX_BATCH_NONE;
+	int ret = 0;
+
+	if (con_index >= CONFIG_BT_MAX_CONN || prio >= APP_BT_TX_PRIO_NUM || len > APP_BT_TX_MSG_LEN_MAX) {
+		return -EINVAL;
+	}
+	link = &tx_link[con_index];
+	ring = &link->ring[prio];
+
+	k_spinlock_key_t key = k_spin_lock(&tx_lock);
+	if (prio == APP_BT_TX_PRIO_EFFECT && ring->count > 0) {
+		// A stale effect is still waiting, overwrite the newest one rather than playing both
+		msg = &ring->msg[(ring->head + ring->count - 1) % QUEUE_LEN];
+		discarded_batch = msg->batch;
+		link->stats.collapsed++;
+	}
+	else if (ring->count < QUEUE_LEN) {
+		msg = &ring->msg[(ring->head + ring->count) % QUEUE_LEN];
+		ring->count++;
+		link->stats.queued++;
+	}
+	else {
+		link->stats.dropped++;
+		discarded_batch = batch;
+		ret = -ENOMEM;
+		msg = NULL;
+	}
+	if (msg) {
+		memcpy(msg->data, data, len);
+		msg->len = len;
+		msg->prio = prio;
+		msg->batch = batch;
+		msg->flags = flags;
+		msg->t_queued = k_cycle_get_32();
+	}
+	k_spin_unlock(&tx_lock, key);
+
+	discard(con_index, discarded_batch);
+	return ret;
+}
+
+bool app_bt_tx_get(uint32_t con_index, struct app_bt_tx_msg_t *msg)
+{
+	bool found = false;
+	k_spinlock_key_t key = k_spin_lock(&tx_lock);
+	for (int p = 0; p < APP_BT_TX_PRIO_NUM; p++) {
+		struct tx_ring_t *ring = &tx_link[con_index].ring[p];
+		if (ring->count > 0) {
+			*msg = ring->msg[ring->head];
+			ring->head = (ring->head + 1) % QUEUE_LEN;
+			ring->count--;
+			found = true;
+			break;
+		}
+	}
+	k_spin_unlock(&tx_lock, key);
+	return found;
+}
+
+void app_bt_tx_unget(uint32_t con_index, const struct app_bt_tx_msg_t *msg)
+{
+	bool discarded = true;
+	k_spinlock_key_t key = k_spin_lock(&tx_lock);
+	struct tx_ring_t *ring = &tx_link[con_index].ring[msg->prio];
+	if (msg->prio == APP_BT_TX_PRIO_EFFECT && ring->count > 0) {
+		// A newer effect was queued in the meantime
+		tx_link[con_index].stats.collapsed++;
+	}
+	else if (ring->count < QUEUE_LEN) {
+		ring->head = (ring->head + QUEUE_LEN - 1) % QUEUE_LEN;
+		ring->msg[ring->head] = *msg;
+		ring->count++;
+		discarded = false;
+	}
+	else {
+		tx_link[con_index].stats.dropped++;
+	}
+	k_spin_unlock(&tx_lock, key);
+
+	if (discarded) {
+		discard(con_index, msg->batch);
+	}
+}
+
+void app_bt_tx_sent(uint32_t con_index)
+{
+	k_spinlock_key_t key = k_spin_lock(&tx_lock);
+	tx_link[con_index].stats.sent++;
+	k_spin_unlock(&tx_lock, key);
+}
+
+void app_bt_tx_stats_get(uint32_t con_index, struct app_bt_tx_stats_t *stats)
+{
+	k_spinlock_key_t key = k_spin_lock(&tx_lock);
+	*stats = tx_link[con_index].stats;
+	k_spin_unlock(&tx_lock, key);
+}
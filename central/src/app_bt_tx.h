@@ -0,0 +1,55 @@
+#ifndef __APP_BT_TX_H
+#define __APP_BT_TX_H
+
+#include <zephyr/kernel.h>
+
+#define APP_BT_TX_MSG_LEN_MAX CONFIG_APP_BT_TX_MSG_LEN_MAX
+
+// Commands are always sent before effects. A queued effect is replaced by a newer one for the same link.
+enum app_bt_tx_prio_t {APP_BT_TX_PRIO_CMD, APP_BT_TX_PRIO_EFFECT, APP_BT_TX_PRIO_NUM};
+
+// Batch id 0 means the message is not part of a multicast batch
+#define APP_BT_TX_BATCH_NONE 0
+
+// Report the transmit time of the message to the time sync module
+#define APP_BT_TX_FLAG_TIMESTAMP BIT(0)
+
+struct app_bt_tx_msg_t {
+	uint16_t len;
+	uint8_t prio;
+	uint8_t batch;
+	uint8_t flags;
+	uint32_t t_queued;
+	uint8_t data[APP_BT_TX_MSG_LEN_MAX];
+};
+
+struct app_bt_tx_stats_t {
+	uint32_t queued;
+	uint32_t sent;
+	uint32_t dropped;
+	uint32_t collapsed;
+};
+
+// Called for messages that leave the queue without being sent, ie. collapsed, flushed or dropped
+typedef void (*app_bt_tx_discard_cb_t)(uint32_t con_index, uint8_t batch);
+
+void app_bt_tx_init(app_bt_tx_discard_cb_t discard_cb);
+
+// Flush the queue of a link, ie. when it connects or disconnects. Flushed messages are counted as dropped.
+void app_bt_tx_reset(uint32_t con_index);
+
+int app_bt_tx_put(uint32_t con_index, const uint8_t *data, uint16_t len, enum app_bt_tx_prio_t prio,
+		  uint8_t batch, uint8_t flags);
+
+// Remove the next message to send, highest priority first
+bool app_bt_tx_get(uint32_t con_index, struct app_bt_tx_msg_t *msg);
+
+// Put a message back in front of its queue, ie. if the stack was out of buffers
+void app_bt_tx_unget(uint32_t con_index, const struct app_bt_tx_msg_t *msg);
+
+// Count a message as sent once the stack reports it as transmitted
+void app_bt_tx_sent(uint32_t con_index);
+
+void app_bt_tx_stats_get(uint32_t con_index, struct app_bt_tx_stats_t *stats);
+
+#endif
@@ -0,0 +1,265 @@
+#include <console_ui.h>
+#include <stdio.h>
+
+#define RING_LEN		CONFIG_APP_CONSOLE_UI_RING_LEN
+#define RING_MASK		(RING_LEN - 1)
+#define RENDER_STACK_SIZE	1024
+#define RENDER_PRIORITY		K_LOWEST_APPLICATION_THREAD_PRIO
+#define LINE_MAX		128
+
+// One progress bar character per step, the bar is cut at this column
+#define PROGRESS_STEP_MS	50
+#define PROGRESS_COL		50
+
+BUILD_ASSERT((RING_LEN & RING_MASK) == 0, "Console UI ring length must be a power of two");
+
+enum ui_evt_type_t {UI_EVT_TEXT, UI_EVT_PLAYERS, UI_EVT_ROUND_START, UI_EVT_CHG_START, UI_EVT_CHG_RESULT, UI_EVT_GAME_FINISH, UI_EVT_HISCORE};
+
+struct ui_evt_t {
+	uint8_t type;
+	bool success;
+	uint32_t t_ms;
+	union {
+		const char *text;
+		uint32_t num_players;
+		struct {
+			uint32_t round;
+			uint32_t target_ms;
+		} round;
+		struct {
+			uint32_t time_ms;
+			int16_t score;
+			int16_t fouls;
+		} result;
+		struct {
+			uint32_t rank;
+			int score;
+		} hiscore;
+		struct {
+			uint32_t num_results;
+			int16_t score;
+			uint16_t min_ms, max_ms, avg_ms, p50_ms, p90_ms;
+		} finish;
+	};
+};
+
+/* Single producer, single consumer ring. The producer only writes ring_head and the consumer only
+ * writes ring_tail, so no lock is needed. The atomic stores order the slot contents against the index. */
+static struct ui_evt_t ring[RING_LEN];
+static atomic_t ring_head;
+static atomic_t ring_tail;
+
+K_SEM_DEFINE(m_sem_render, 0, 1);
+
+static struct console_ui_stats_t m_stats;
+
+// Owned by the render thread
+static struct {
+	bool active;
+	uint32_t t_start;
+	int goal_index;
+	// Index of the next character to print, starting at 1 like the goal line index
+	int next_index;
+} bar = {.next_index = PROGRESS_COL};
+
+static char line[LINE_MAX];
+
+static void ui_evt_put(struct ui_evt_t *evt)
+{
+	atomic_val_t head = atomic_get(&ring_head);
+
+	if ((head - atomic_get(&ring_tail)) >= RING_LEN) {
+		m_stats.dropped++;
+		return;
+	}
+	evt->t_ms = k_uptime_get_32();
+	ring[head & RING_MASK] = *evt;
+	atomic_set(&ring_head, head + 1);
+	k_sem_give(&m_sem_render);
+}
+
+void console_ui_text(const char *text)
+{
+	struct ui_evt_t evt = {.type = UI_EVT_TEXT, .text = text};
+	ui_evt_put(&evt);
+}
+
+void console_ui_players(uint32_t num_players)
+{
+	struct ui_evt_t evt = {.type = UI_EVT_PLAYERS, .num_players = num_players};
+	ui_evt_put(&evt);
+}
+
+void console_ui_round_start(uint32_t round, uint32_t target_ms)
+{
+	struct ui_evt_t evt = {.type = UI_EVT_ROUND_START, .round = {.round = round, .target_ms = target_ms}};
+	ui_evt_put(&evt);
+}
+
+void console_ui_challenge_start(void)
+{
+	struct ui_evt_t evt = {.type = UI_EVT_CHG_START};
+	ui_evt_put(&evt);
+}
+
+void console_ui_challenge_result(bool success, uint32_t time_ms, int score, int fouls)
+{
+	struct ui_evt_t evt = {.type = UI_EVT_CHG_RESULT, .success = success,
+			       .result = {.time_ms = time_ms, .score = score, .fouls = fouls}};
+	ui_evt_put(&evt);
+}
+
+void console_ui_game_finish(uint32_t num_results, int score, uint32_t min_ms, uint32_t max_ms, uint32_t avg_ms,
+			    uint32_t p50_ms, uint32_t p90_ms)
+{
+	struct ui_evt_t evt = {.type = UI_EVT_GAME_FINISH,
+			       .finish = {.num_results = num_results, .score = score, .min_ms = min_ms,
+					  .max_ms = max_ms, .avg_ms = avg_ms, .p50_ms = p50_ms, .p90_ms = p90_ms}};
+	ui_evt_put(&evt);
+}
+
+void console_ui_hiscore(uint32_t rank, int score)
+{
+	struct ui_evt_t evt = {.type = UI_EVT_HISCORE, .hiscore = {.rank = rank, .score = score}};
+	ui_evt_put(&evt);
+}
+
+void console_ui_stats_get(struct console_ui_stats_t *stats)
+{
+	*stats = m_stats;
+}
+
+static void line_print(int len)
+{
+	uint32_t t_start = k_cycle_get_32();
+
+	if (len <= 0) {
+		return;
+	}
+	printk("%.*s", MIN(len, LINE_MAX - 1), line);
+
+	uint32_t render_us = k_cyc_to_us_floor32(k_cycle_get_32() - t_start);
+	if (render_us > m_stats.render_max_us) {
+		m_stats.render_max_us = render_us;
+	}
+	m_stats.rendered++;
+}
+
+// Append a string to the line, clamping at the end of the buffer
+#define LINE_APPEND(len, ...) (len) += snprintf(&line[MIN(len, LINE_MAX)], LINE_MAX - MIN(len, LINE_MAX), __VA_ARGS__)
+
+// Print the progress characters that are due at time t
+static void bar_catch_up(uint32_t t)
+{
+	int len = 0;
+	int due_index = (t - bar.t_start) / PROGRESS_STEP_MS;
+
+	while (bar.next_index <= due_index && bar.next_index < PROGRESS_COL && len < LINE_MAX - 1) {
+		line[len++] = (bar.next_index == bar.goal_index) ? '|' : '-';
+		bar.next_index++;
+	}
+	line_print(len);
+}
+
+static void render(const struct ui_evt_t *evt)
+{
+	int len = 0;
+
+	switch (evt->type) {
+		case UI_EVT_TEXT:
+			LINE_APPEND(len, "%s", evt->text);
+			break;
+
+		case UI_EVT_PLAYERS:
+			LINE_APPEND(len, "\rControllers connected: %i   ", evt->num_players);
+			break;
+
+		case UI_EVT_ROUND_START:
+			bar.goal_index = (evt->round.target_ms / PROGRESS_STEP_MS) + 2;
+			LINE_APPEND(len, "\nRound %i starting... Respond quicker than %i ms!\n", evt->round.round + 1,
+				    evt->round.target_ms);
+			line_print(len);
+			len = 0;
+			LINE_APPEND(len, "%*s|\n", bar.goal_index - 1, "");
+			break;
+
+		case UI_EVT_CHG_START:
+			bar.active = true;
+			bar.t_start = evt->t_ms;
+			bar.next_index = 1;
+			break;
+
+		case UI_EVT_CHG_RESULT: {
+			int pad_lines;
+
+			if (bar.active) {
+				bar_catch_up(evt->t_ms);
+				bar.active = false;
+			}
+			pad_lines = PROGRESS_COL - bar.next_index;
+			// Results without a bar of their own, ie. with several moles up, get no padding
+			bar.next_index = PROGRESS_COL;
+			if (evt->success) {
+				// Fill up to the progress bar width, marking the goal line if it was not reached
+				int goal_line_tmp_index = pad_lines + bar.goal_index - PROGRESS_COL - 1;
+				LINE_APPEND(len, "+");
+				for (int i = 0; i < pad_lines && len < LINE_MAX - 1; i++) {
+					line[len++] = (i == goal_line_tmp_index) ? '|' : ' ';
+				}
+				LINE_APPEND(len, "+1 point. Score %i. Time %i ms\n", evt->result.score, evt->result.time_ms);
+			}
+			else {
+				LINE_APPEND(len, "X%*s", MAX(pad_lines, 0), "");
+				if (evt->result.fouls > 0) {
+					LINE_APPEND(len, "Fouls: %i. Score %i\n", evt->result.fouls, evt->result.score);
+				}
+				else {
+					LINE_APPEND(len, "-\n");
+				}
+			}
+			break;
+		}
+
+		case UI_EVT_GAME_FINISH:
+			LINE_APPEND(len, "Game complete!\n");
+			if (evt->finish.num_results > 0) {
+				LINE_APPEND(len, "\nResults: \n  Total score:  %i points\n", evt->finish.score);
+				line_print(len);
+				len = 0;
+				LINE_APPEND(len, "  Best result:  %i ms\n  Worst result: %i ms\n  Average:      %i ms\n",
+					    evt->finish.min_ms, evt->finish.max_ms, evt->finish.avg_ms);
+				line_print(len);
+				len = 0;
+				LINE_APPEND(len, "  Median:       %i ms\n  90th pct:     %i ms\n",
+					    evt->finish.p50_ms, evt->finish.p90_ms);
+			}
+			break;
+
+		case UI_EVT_HISCORE:
+			LINE_APPEND(len, "\nNew high score! %i points, number %i on the list\n", evt->hiscore.score,
+				    evt->hiscore.rank + 1);
+			break;
+	}
+	line_print(len);
+}
+
+static void render_thread(void *p1, void *p2, void *p3)
+{
+	while (1) {
+		// Wake up for every bar step while a challenge is running, else only on new events
+		k_sem_take(&m_sem_render, bar.active ? K_MSEC(PROGRESS_STEP_MS) : K_FOREVER);
+
+		atomic_val_t tail = atomic_get(&ring_tail);
+		while (tail != atomic_get(&ring_head)) {
+			struct ui_evt_t evt = ring[tail & RING_MASK];
+			atomic_set(&ring_tail, ++tail);
+			render(&evt);
+		}
+		if (bar.active) {
+			bar_catch_up(k_uptime_get_32());
+		}
+	}
+}
+
+K_THREAD_DEFINE(m_console_ui_thread, RENDER_STACK_SIZE, render_thread, NULL, NULL, NULL,
+		RENDER_PRIORITY, 0, 0);
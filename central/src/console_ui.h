@@ -0,0 +1,38 @@
+#ifndef __CONSOLE_UI_H
+#define __CONSOLE_UI_H
+
+#include <zephyr/kernel.h>
+
+/* Game console output. The game posts compact events, which are rendered to full lines by a low
+ * priority thread, so nothing is printed from interrupt or Bluetooth callback context, and slow
+ * UART output never holds up the game. All the functions must be called from the game thread,
+ * which is the only producer of the event ring. */
+
+struct console_ui_stats_t {
+	// Events lost to a full ring
+	uint32_t dropped;
+	uint32_t rendered;
+	// Longest time spent printing a single line
+	uint32_t render_max_us;
+};
+
+// Print a string as is. The string must be static, only the pointer is queued.
+void console_ui_text(const char *text);
+
+void console_ui_players(uint32_t num_players);
+
+void console_ui_round_start(uint32_t round, uint32_t target_ms);
+
+// Starts the progress bar, which is drawn by the renderer until the result is posted
+void console_ui_challenge_start(void);
+
+void console_ui_challenge_result(bool success, uint32_t time_ms, int score, int fouls);
+
+void console_ui_game_finish(uint32_t num_results, int score, uint32_t min_ms, uint32_t max_ms, uint32_t avg_ms,
+			    uint32_t p50_ms, uint32_t p90_ms);
+
+void console_ui_hiscore(uint32_t rank, int score);
+
+void console_ui_stats_get(struct console_ui_stats_t *stats);
+
+#endif
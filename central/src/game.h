@@ -3,19 +3,32 @@
 
 #include <zephyr/kernel.h>
 #include <app_bt.h>
+#include <proto.h>
 
 struct game_t;
 
+enum game_phase_t {GAME_PHASE_IDLE, GAME_PHASE_ACTIVE};
+
 typedef void (*game_func_bt_send_t)(uint32_t con_index, const uint8_t *data, uint16_t len);
-typedef void (*game_func_bt_ctrl_send_t)(const uint8_t *data, uint16_t len);
+typedef void (*game_func_bt_send_multi_t)(uint64_t con_mask, const uint8_t *data, uint16_t len);
+typedef void (*game_func_bt_ctrl_send_t)(uint8_t type, const void *msg);
+// Send the control updates held back for aggregation
+typedef void (*game_func_bt_ctrl_flush_t)(void);
 typedef void (*game_func_play_t)(struct game_t *game);
 typedef void (*game_func_bt_evt_t)(struct game_t *game, struct app_bt_evt_t *bt_evt);
+typedef void (*game_func_phase_t)(enum game_phase_t phase);
+// Instrumentation, called when a challenge is started with how late it is relative to its deadline
+typedef void (*game_func_sched_jitter_t)(uint32_t round, uint32_t challenge, uint32_t late_us);
 
 struct game_t {
     game_func_play_t play;
     game_func_bt_evt_t bt_rx;
     game_func_bt_send_t bt_send;
+    game_func_bt_send_multi_t bt_send_multi;
 	game_func_bt_ctrl_send_t bt_ctrl_send;
+	game_func_bt_ctrl_flush_t bt_ctrl_flush;
+	game_func_phase_t phase;
+	game_func_sched_jitter_t sched_jitter;
 };
 
 #endif
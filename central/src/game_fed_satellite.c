@@ -0,0 +1,208 @@
+#include <game_fed_satellite.h>
+#include <app_bt_ctrl.h>
+#include <timesync.h>
+#include <zephyr/sys/byteorder.h>
+
+#define STATUS_PERIOD_MS	1000
+// Pad index space of a satellite, as seen by the master
+#define PADS_MAX		8
+
+static struct game_t *this;
+
+// Local pads ready to take commands, written by the game event thread
+static atomic_t pad_ready_mask;
+
+// Master clock, only used from the Bluetooth RX thread and the system work queue
+static struct {
+	bool synced;
+	// Satellite time minus master time
+	int32_t offset_us;
+	uint8_t seq;
+	uint32_t t_rx;
+} m_uplink_ts;
+
+// Latency of the master to satellite hop, from the master sending a command to it arriving here
+static struct {
+	uint32_t relayed;
+	uint32_t count;
+	uint64_t total_us;
+	uint32_t max_us;
+} m_hop;
+static struct k_spinlock hop_lock;
+
+static void status_send(void)
+{
+	struct proto_fed_status_t status;
+	uint8_t frame[PROTO_FRAME_MAX];
+	k_spinlock_key_t key;
+	int len;
+
+	if (app_bt_ctrl_mtu_get() == 0) {
+		return;
+	}
+	status.ready_mask = (uint8_t)atomic_get(&pad_ready_mask);
+	status.num_pads = POPCOUNT(status.ready_mask);
+
+	key = k_spin_lock(&hop_lock);
+	status.relayed = m_hop.relayed;
+	status.hop_avg_us = m_hop.count > 0 ? (uint32_t)(m_hop.total_us / m_hop.count) : 0;
+	status.hop_max_us = m_hop.max_us;
+	k_spin_unlock(&hop_lock, key);
+
+	len = proto_encode(PROTO_MSG_FED_STATUS, &status, frame, sizeof(frame));
+	if (len > 0) {
+		app_bt_ctrl_send_str(frame, len);
+	}
+}
+
+static void timesync_response_func(struct k_work *work)
+{
+	struct proto_timesync_rsp_t rsp = {.seq = m_uplink_ts.seq, .t_rx_us = m_uplink_ts.t_rx};
+	uint8_t frame[PROTO_FRAME_MAX];
+	int len;
+
+	len = proto_encode(PROTO_MSG_TIMESYNC_RSP, &rsp, frame, sizeof(frame));
+	if (len > 0) {
+		app_bt_ctrl_send_str(frame, len);
+	}
+}
+
+K_WORK_DEFINE(m_work_timesync_response, timesync_response_func);
+
+static void hop_update(uint32_t t_tx_master, uint32_t t_rx, bool relayed)
+{
+	k_spinlock_key_t key = k_spin_lock(&hop_lock);
+
+	if (relayed) {
+		m_hop.relayed++;
+	}
+	if (m_uplink_ts.synced) {
+		int32_t hop_us = (int32_t)(t_rx - (t_tx_master + m_uplink_ts.offset_us));
+		hop_us = MAX(hop_us, 0);
+		m_hop.count++;
+		m_hop.total_us += hop_us;
+		m_hop.max_us = MAX(m_hop.max_us, (uint32_t)hop_us);
+	}
+	k_spin_unlock(&hop_lock, key);
+}
+
+static void cmd_relay(const uint8_t *data, uint16_t len, uint32_t t_rx)
+{
+	const struct proto_fed_cmd_hdr_t *hdr = (const struct proto_fed_cmd_hdr_t *)data;
+	const uint8_t *frame = data + sizeof(*hdr);
+	uint16_t frame_len = len - sizeof(*hdr);
+	uint8_t pad_mask = hdr->pad_mask & (uint8_t)atomic_get(&pad_ready_mask);
+	uint8_t buf[PROTO_FRAME_MAX];
+	union proto_msg_t msg;
+	uint8_t type;
+
+	hop_update(sys_get_le32(hdr->t_tx_us), t_rx, pad_mask != 0);
+	if (pad_mask == 0) {
+		return;
+	}
+
+	// Scheduled effects are in master time. Until the first sync they are run straight away.
+	if (proto_type_peek(frame, frame_len) == PROTO_MSG_LED &&
+	    proto_decode(frame, frame_len, &type, &msg) == 0 && msg.led.exec_at_us != 0) {
+		msg.led.exec_at_us = m_uplink_ts.synced ? msg.led.exec_at_us + m_uplink_ts.offset_us : 0;
+		int ret = proto_encode(PROTO_MSG_LED, &msg.led, buf, sizeof(buf));
+		if (ret < 0) {
+			return;
+		}
+		frame = buf;
+		frame_len = ret;
+	}
+
+	if (POPCOUNT(pad_mask) == 1) {
+		this->bt_send(find_lsb_set(pad_mask) - 1, frame, frame_len);
+	}
+	else {
+		this->bt_send_multi(pad_mask, frame, frame_len);
+	}
+}
+
+void fed_satellite_uplink_rx(const uint8_t *data, uint16_t len)
+{
+	uint32_t t_rx = timesync_now_us();
+	union proto_msg_t msg;
+	uint8_t type;
+
+	switch (proto_type_peek(data, len)) {
+		case PROTO_MSG_FED_CMD:
+			if (len > sizeof(struct proto_fed_cmd_hdr_t)) {
+				cmd_relay(data, len, t_rx);
+			}
+			break;
+		case PROTO_MSG_TIMESYNC_REQ:
+			// The master syncs the satellite like a pad, the response can wait
+			if (proto_decode(data, len, &type, &msg) == 0) {
+				m_uplink_ts.t_rx = t_rx;
+				m_uplink_ts.seq = msg.timesync_req.seq;
+				k_work_submit(&m_work_timesync_response);
+			}
+			break;
+		case PROTO_MSG_TIMESYNC_OFFSET:
+			if (proto_decode(data, len, &type, &msg) == 0) {
+				m_uplink_ts.offset_us = msg.timesync_offset.offset_us;
+				m_uplink_ts.synced = true;
+			}
+			break;
+		default:
+			break;
+	}
+}
+
+void fed_satellite_uplink_ready(void)
+{
+	k_spinlock_key_t key = k_spin_lock(&hop_lock);
+
+	memset(&m_hop, 0, sizeof(m_hop));
+	k_spin_unlock(&hop_lock, key);
+	status_send();
+}
+
+static void satellite_bt_rx(struct game_t *game, struct app_bt_evt_t *bt_evt)
+{
+	uint8_t frame[sizeof(struct proto_fed_rx_hdr_t) + CONFIG_APP_GAME_EVT_DATA_MAX];
+	struct proto_fed_rx_hdr_t *hdr = (struct proto_fed_rx_hdr_t *)frame;
+
+	switch (bt_evt->type) {
+		case APP_BT_EVT_CON_NUM_CHANGE:
+			atomic_set(&pad_ready_mask, bt_evt->ready_mask & BIT_MASK(PADS_MAX));
+			status_send();
+			break;
+		case APP_BT_EVT_RX_DATA:
+			if (bt_evt->con_index >= PADS_MAX || sizeof(*hdr) + bt_evt->data_len > sizeof(frame)) {
+				break;
+			}
+			hdr->hdr = PROTO_HDR(PROTO_MSG_FED_RX);
+			hdr->pad = bt_evt->con_index;
+			hdr->rssi = bt_evt->rssi;
+			memcpy(&frame[sizeof(*hdr)], bt_evt->data, bt_evt->data_len);
+			app_bt_ctrl_send_str(frame, sizeof(*hdr) + bt_evt->data_len);
+			break;
+	}
+}
+
+static void satellite_play(struct game_t *game)
+{
+	printk("Federation satellite, relaying the pad commands of the master\n");
+
+	// The satellite does not know when the master runs a game, so the pads stay on the active link parameters
+	this->phase(GAME_PHASE_ACTIVE);
+
+	while (1) {
+		k_sleep(K_MSEC(STATUS_PERIOD_MS));
+		status_send();
+	}
+}
+
+int fed_satellite_init(struct game_t *game)
+{
+	this = game;
+	game->play = satellite_play;
+	game->bt_rx = satellite_bt_rx;
+	atomic_set(&pad_ready_mask, 0);
+
+	return 0;
+}
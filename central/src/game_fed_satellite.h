@@ -0,0 +1,18 @@
+#ifndef __GAME_FED_SATELLITE_H
+#define __GAME_FED_SATELLITE_H
+
+#include <game.h>
+
+/* Satellite side of a federation of centrals (see app_bt_fed.h). Takes the place of the game: the
+ * frames of the local pads are relayed to the master over the control link, and the pad commands
+ * from the master are sent on to the local pads. */
+
+int fed_satellite_init(struct game_t *game);
+
+// Frames from the master, from the Bluetooth RX thread
+void fed_satellite_uplink_rx(const uint8_t *data, uint16_t len);
+
+// The master subscribed to the control link, and can take the status
+void fed_satellite_uplink_ready(void);
+
+#endif
@@ -0,0 +1,234 @@
+#include <game_hiscore.h>
+#include <zephyr/settings/settings.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(game_hiscore, LOG_LEVEL_INF);
+
+#define TOP_N			GAME_HISCORE_TOP_N
+#define HISCORE_SETTINGS_ROOT	"hiscore"
+#define HISCORE_KEY_LEN		(sizeof(HISCORE_SETTINGS_ROOT) + 4)
+// NVS stores the settings name and value as two entries, each with an 8 byte allocation table entry
+#define NVS_OVERHEAD_BYTES	16
+#define WQ_STACK_SIZE		1536
+#define WQ_PRIORITY		K_LOWEST_APPLICATION_THREAD_PRIO
+
+BUILD_ASSERT(TOP_N <= 32, "The dirty slots are tracked in a 32 bit mask");
+
+static struct game_hiscore_entry_t slots[TOP_N];
+static bool slot_used[TOP_N];
+// Slot numbers ordered by rank, the first num_ranked are valid
+static uint8_t rank_index[TOP_N];
+static uint32_t num_ranked;
+static uint32_t seq_next;
+
+static atomic_t dirty_mask;
+static struct game_hiscore_stats_t m_stats;
+static uint64_t write_total_us;
+
+static struct k_spinlock hiscore_lock;
+
+K_THREAD_STACK_DEFINE(m_hiscore_wq_stack, WQ_STACK_SIZE);
+static struct k_work_q m_hiscore_wq;
+
+static void hiscore_save_work_handler(struct k_work *work);
+K_WORK_DEFINE(m_work_hiscore_save, hiscore_save_work_handler);
+
+// True if a ranks above b: higher score, then better average, then the older game
+static bool entry_better(const struct game_hiscore_entry_t *a, const struct game_hiscore_entry_t *b)
+{
+	if (a->score != b->score) {
+		return a->score > b->score;
+	}
+	if (a->avg_ms != b->avg_ms) {
+		return a->avg_ms < b->avg_ms;
+	}
+	return a->seq < b->seq;
+}
+
+// Position a new entry would get in the index, by binary search
+static uint32_t rank_find(const struct game_hiscore_entry_t *entry)
+{
+	uint32_t low = 0, high = num_ranked;
+
+	while (low < high) {
+		uint32_t mid = (low + high) / 2;
+		if (entry_better(entry, &slots[rank_index[mid]])) {
+			high = mid;
+		}
+		else {
+			low = mid + 1;
+		}
+	}
+	return low;
+}
+
+static void rank_insert(uint32_t rank, uint8_t slot)
+{
+	memmove(&rank_index[rank + 1], &rank_index[rank], num_ranked - rank);
+	rank_index[rank] = slot;
+	num_ranked++;
+}
+
+static void index_build(void)
+{
+	num_ranked = 0;
+	for (int i = 0; i < TOP_N; i++) {
+		if (slot_used[i]) {
+			rank_insert(rank_find(&slots[i]), i);
+			seq_next = MAX(seq_next, slots[i].seq + 1);
+		}
+	}
+}
+
+static int hiscore_settings_set(const char *name, size_t len, settings_read_cb read_cb, void *cb_arg)
+{
+	struct game_hiscore_entry_t entry;
+	int index = atoi(name);
+
+	if (index < 0 || index >= TOP_N || len != sizeof(entry)) {
+		return -EINVAL;
+	}
+	if (read_cb(cb_arg, &entry, sizeof(entry)) != sizeof(entry)) {
+		return -EIO;
+	}
+	slots[index] = entry;
+	slot_used[index] = true;
+	return 0;
+}
+
+SETTINGS_STATIC_HANDLER_DEFINE(game_hiscore, HISCORE_SETTINGS_ROOT, NULL, hiscore_settings_set, NULL, NULL);
+
+static void hiscore_save_work_handler(struct k_work *work)
+{
+	char key[HISCORE_KEY_LEN];
+	struct game_hiscore_entry_t entry;
+	uint32_t dirty = atomic_clear(&dirty_mask);
+
+	for (int i = 0; i < TOP_N; i++) {
+		if ((dirty & BIT(i)) == 0) {
+			continue;
+		}
+		k_spinlock_key_t key_lock = k_spin_lock(&hiscore_lock);
+		entry = slots[i];
+		k_spin_unlock(&hiscore_lock, key_lock);
+
+		int key_len = snprintf(key, sizeof(key), HISCORE_SETTINGS_ROOT "/%i", i);
+		uint32_t t_start = k_cycle_get_32();
+		int err = settings_save_one(key, &entry, sizeof(entry));
+		uint32_t write_us = k_cyc_to_us_floor32(k_cycle_get_32() - t_start);
+
+		key_lock = k_spin_lock(&hiscore_lock);
+		if (err) {
+			m_stats.write_errors++;
+		}
+		else {
+			m_stats.writes++;
+			m_stats.bytes_payload += sizeof(entry);
+			m_stats.bytes_flash += ROUND_UP(key_len, 4) + ROUND_UP(sizeof(entry), 4) + NVS_OVERHEAD_BYTES;
+			m_stats.write_max_us = MAX(m_stats.write_max_us, write_us);
+			write_total_us += write_us;
+			m_stats.write_avg_us = write_total_us / m_stats.writes;
+		}
+		k_spin_unlock(&hiscore_lock, key_lock);
+
+		if (err) {
+			LOG_ERR("Failed to save high score %i (err %i)", i, err);
+		}
+		else {
+			LOG_DBG("High score %i saved in %u us", i, write_us);
+		}
+	}
+
+	// The game thread does not wait for the writes, so their counters are reported once they are done
+	struct game_hiscore_stats_t stats;
+	game_hiscore_stats_get(&stats);
+	LOG_INF("High scores written: %u writes, %u errors, %u B flash, write avg %u us, max %u us", stats.writes,
+		stats.write_errors, stats.bytes_flash, stats.write_avg_us, stats.write_max_us);
+}
+
+int game_hiscore_init(void)
+{
+	int err = settings_subsys_init();
+	if (err) {
+		LOG_ERR("Settings init failed (err %i)", err);
+		return err;
+	}
+	err = settings_load_subtree(HISCORE_SETTINGS_ROOT);
+	if (err) {
+		LOG_WRN("High score load failed (err %i)", err);
+	}
+
+	k_spinlock_key_t key = k_spin_lock(&hiscore_lock);
+	index_build();
+	k_spin_unlock(&hiscore_lock, key);
+
+	struct k_work_queue_config wq_cfg = {.name = "hiscore_wq"};
+	k_work_queue_start(&m_hiscore_wq, m_hiscore_wq_stack, K_THREAD_STACK_SIZEOF(m_hiscore_wq_stack),
+			   WQ_PRIORITY, &wq_cfg);
+
+	LOG_INF("High score table loaded, %i entries", num_ranked);
+	return 0;
+}
+
+int game_hiscore_submit(int score, uint32_t best_ms, uint32_t avg_ms)
+{
+	struct game_hiscore_entry_t entry = {.score = CLAMP(score, INT16_MIN, INT16_MAX),
+					      .best_ms = MIN(best_ms, UINT16_MAX),
+					      .avg_ms = MIN(avg_ms, UINT16_MAX)};
+	uint32_t rank;
+	uint8_t slot;
+
+	k_spinlock_key_t key = k_spin_lock(&hiscore_lock);
+	m_stats.submitted++;
+	entry.seq = seq_next++;
+	rank = rank_find(&entry);
+	if (rank >= TOP_N) {
+		m_stats.skipped++;
+		k_spin_unlock(&hiscore_lock, key);
+		return -1;
+	}
+	if (num_ranked < TOP_N) {
+		// Take a free slot
+		for (slot = 0; slot_used[slot]; slot++) {
+		}
+	}
+	else {
+		// Reuse the slot of the entry that drops out of the table
+		slot = rank_index[--num_ranked];
+	}
+	slots[slot] = entry;
+	slot_used[slot] = true;
+	rank_insert(rank, slot);
+	k_spin_unlock(&hiscore_lock, key);
+
+	atomic_or(&dirty_mask, BIT(slot));
+	k_work_submit_to_queue(&m_hiscore_wq, &m_work_hiscore_save);
+	return rank;
+}
+
+int game_hiscore_get(uint32_t rank, struct game_hiscore_entry_t *entry)
+{
+	int err = -ENOENT;
+
+	k_spinlock_key_t key = k_spin_lock(&hiscore_lock);
+	if (rank < num_ranked) {
+		*entry = slots[rank_index[rank]];
+		err = 0;
+	}
+	k_spin_unlock(&hiscore_lock, key);
+	return err;
+}
+
+uint32_t game_hiscore_count(void)
+{
+	return num_ranked;
+}
+
+void game_hiscore_stats_get(struct game_hiscore_stats_t *stats)
+{
+	k_spinlock_key_t key = k_spin_lock(&hiscore_lock);
+	*stats = m_stats;
+	k_spin_unlock(&hiscore_lock, key);
+}
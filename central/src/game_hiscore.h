@@ -0,0 +1,49 @@
+#ifndef __GAME_HISCORE_H
+#define __GAME_HISCORE_H
+
+#include <zephyr/kernel.h>
+
+/* High score table, kept in the settings storage (NVS) so it survives a reset.
+ *
+ * The top N games are stored one per settings key, in fixed slots. A new high score overwrites
+ * the slot of the entry it pushes out, so every qualifying game costs a single record write, and
+ * games that do not make the table cost none. The ranking lives in a small index in RAM, rebuilt
+ * at boot, and the writes are done by a low priority work queue so a flash erase never stalls the
+ * game or the Bluetooth threads. */
+
+#define GAME_HISCORE_TOP_N CONFIG_APP_HISCORE_TOP_N
+
+struct game_hiscore_entry_t {
+	// Game counter, orders equal results by age
+	uint32_t seq;
+	int16_t score;
+	uint16_t best_ms;
+	uint16_t avg_ms;
+};
+
+struct game_hiscore_stats_t {
+	uint32_t submitted;
+	// Games that did not make the table, and were never written
+	uint32_t skipped;
+	uint32_t writes;
+	uint32_t write_errors;
+	// Bytes handed to the settings subsystem, and the estimated flash usage including the NVS overhead
+	uint32_t bytes_payload;
+	uint32_t bytes_flash;
+	uint32_t write_max_us;
+	uint32_t write_avg_us;
+};
+
+int game_hiscore_init(void);
+
+// Submit the result of a game. Returns the rank it got, from 0, or -1 if it did not make the table.
+int game_hiscore_submit(int score, uint32_t best_ms, uint32_t avg_ms);
+
+// Entry at the given rank, from 0
+int game_hiscore_get(uint32_t rank, struct game_hiscore_entry_t *entry);
+
+uint32_t game_hiscore_count(void);
+
+void game_hiscore_stats_get(struct game_hiscore_stats_t *stats);
+
+#endif
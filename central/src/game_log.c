@@ -0,0 +1,378 @@
+#include <game_log.h>
+#include <app_bt_ctrl.h>
+#include <zephyr/devicetree.h>
+#include <zephyr/storage/flash_map.h>
+#include <zephyr/shell/shell.h>
+#include <stdlib.h>
+
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(game_log, LOG_LEVEL_INF);
+
+#define LOG_AREA_ID		DT_FIXED_PARTITION_ID(DT_NODELABEL(game_log_partition))
+#define REC_SIZE		sizeof(struct proto_log_rec_t)
+#define SEQ_ERASED		UINT32_MAX
+#define SECTORS_MAX		32
+// Records written to flash in one go, at most up to the end of the sector
+#define WRITE_BATCH_MAX		8
+// Records in one notification with the largest MTU, after the message header
+#define EXPORT_BATCH_MAX	((CONFIG_BT_L2CAP_TX_MTU - 3 - 1) / REC_SIZE)
+#define SHELL_BATCH_MAX		8
+#define THREAD_STACK_SIZE	2048
+#define THREAD_PRIORITY		K_LOWEST_APPLICATION_THREAD_PRIO
+
+K_MSGQ_DEFINE(m_log_queue, sizeof(struct proto_log_rec_t), CONFIG_APP_GAME_LOG_QUEUE_LEN, 4);
+K_SEM_DEFINE(m_sem_log_wake, 0, 1);
+// Protects the ring state and the flash, taken by the log thread and the shell
+K_MUTEX_DEFINE(m_log_mutex);
+
+static const struct flash_area *fa;
+static uint32_t sector_size;
+static uint32_t sector_count;
+// Ring state: offset of the next record, and the sequence numbers of the oldest and next record
+static uint32_t head_off;
+static uint32_t first_seq;
+static uint32_t seq_next;
+
+static atomic_t export_pending;
+static atomic_t export_from_seq;
+
+static struct game_log_stats_t m_stats;
+static atomic_t appended;
+static atomic_t queue_dropped;
+
+// Called for every batch of records read during an export. Returns 0 to continue.
+typedef int (*log_export_sink_t)(const struct proto_log_rec_t *recs, uint32_t count, void *ctx);
+
+static int seq_read(uint32_t off, uint32_t *seq)
+{
+	return flash_area_read(fa, off + offsetof(struct proto_log_rec_t, seq), seq, sizeof(*seq));
+}
+
+// Offset of a stored record. The records are contiguous in the ring, ending right before the head.
+static uint32_t rec_offset(uint32_t seq)
+{
+	uint32_t slots = fa->fa_size / REC_SIZE;
+	uint32_t back = seq_next - seq;
+
+	return ((head_off / REC_SIZE + slots - back) % slots) * REC_SIZE;
+}
+
+// The oldest records are at the start of the given sector once the ring has wrapped, or at the start of the area before that
+static void first_seq_update(uint32_t oldest_sector)
+{
+	uint32_t seq;
+
+	if (seq_read(oldest_sector * sector_size, &seq) == 0 && seq != SEQ_ERASED && seq < seq_next) {
+		first_seq = seq;
+	}
+	else if (seq_read(0, &seq) == 0 && seq != SEQ_ERASED && seq < seq_next) {
+		first_seq = seq;
+	}
+	else {
+		first_seq = seq_next;
+	}
+}
+
+// Find the head from the sector starting with the highest sequence number, and the first erased record in it
+static void ring_scan(void)
+{
+	uint32_t head_sector = 0, head_seq = 0;
+	bool found = false;
+	uint32_t seq;
+
+	for (uint32_t i = 0; i < sector_count; i++) {
+		if (seq_read(i * sector_size, &seq) == 0 && seq != SEQ_ERASED && (!found || seq > head_seq)) {
+			head_sector = i;
+			head_seq = seq;
+			found = true;
+		}
+	}
+	if (!found) {
+		head_off = 0;
+		seq_next = 0;
+		first_seq = 0;
+		return;
+	}
+
+	// Records are written in order, so the sector is a written prefix followed by erased records
+	uint32_t low = 1, high = sector_size / REC_SIZE;
+	while (low < high) {
+		uint32_t mid = (low + high) / 2;
+		if (seq_read(head_sector * sector_size + mid * REC_SIZE, &seq) == 0 && seq != SEQ_ERASED) {
+			low = mid + 1;
+		}
+		else {
+			high = mid;
+		}
+	}
+	seq_read(head_sector * sector_size + (low - 1) * REC_SIZE, &seq);
+	seq_next = seq + 1;
+	head_off = (head_sector * sector_size + low * REC_SIZE) % fa->fa_size;
+
+	// A head on a sector boundary has not erased the next sector yet, so that one still holds the oldest records
+	uint32_t sector = head_off / sector_size;
+	first_seq_update((head_off % sector_size == 0) ? sector : (sector + 1) % sector_count);
+}
+
+// Erase the sector the head is entering, dropping the oldest records if the ring has wrapped
+static int sector_prepare(void)
+{
+	uint32_t sector = head_off / sector_size;
+	int err = flash_area_erase(fa, head_off, sector_size);
+
+	if (err) {
+		return err;
+	}
+	m_stats.erases++;
+	first_seq_update((sector + 1) % sector_count);
+	return 0;
+}
+
+// Write the queued records to flash. Called with the mutex held.
+static void log_flush(void)
+{
+	struct proto_log_rec_t batch[WRITE_BATCH_MAX];
+
+	while (k_msgq_num_used_get(&m_log_queue) > 0) {
+		if (head_off % sector_size == 0 && sector_prepare() != 0) {
+			LOG_ERR("Sector erase failed at %u", head_off);
+			m_stats.write_errors++;
+			m_stats.dropped += k_msgq_num_used_get(&m_log_queue);
+			k_msgq_purge(&m_log_queue);
+			return;
+		}
+
+		uint32_t room = (sector_size - head_off % sector_size) / REC_SIZE;
+		uint32_t count = 0;
+		while (count < MIN(room, WRITE_BATCH_MAX) && k_msgq_get(&m_log_queue, &batch[count], K_NO_WAIT) == 0) {
+			batch[count].seq = seq_next + count;
+			count++;
+		}
+
+		int err = flash_area_write(fa, head_off, batch, count * REC_SIZE);
+		if (err) {
+			LOG_ERR("Write failed at %u (err %i)", head_off, err);
+			m_stats.write_errors++;
+			m_stats.dropped += count;
+		}
+		// Move on even after a failed write, so the sequence numbers stay contiguous in the ring
+		head_off = (head_off + count * REC_SIZE) % fa->fa_size;
+		seq_next += count;
+	}
+}
+
+static int log_export(uint32_t from_seq, struct proto_log_rec_t *recs, uint32_t batch_max,
+		      log_export_sink_t sink, void *ctx, uint32_t *next_seq)
+{
+	uint32_t count = 0;
+	uint32_t seq, end;
+	int err = 0;
+
+	if (!fa) {
+		*next_seq = from_seq;
+		return -ENODEV;
+	}
+	k_mutex_lock(&m_log_mutex, K_FOREVER);
+	log_flush();
+	seq = MAX(from_seq, first_seq);
+	end = seq_next;
+	k_mutex_unlock(&m_log_mutex);
+
+	while (seq < end) {
+		uint32_t n = MIN(batch_max, end - seq);
+
+		k_mutex_lock(&m_log_mutex, K_FOREVER);
+		// Records appended since the start may have erased the next ones
+		seq = MAX(seq, first_seq);
+		n = MIN(n, end - seq);
+		for (uint32_t i = 0; i < n && err == 0; i++) {
+			err = flash_area_read(fa, rec_offset(seq + i), &recs[i], REC_SIZE);
+		}
+		k_mutex_unlock(&m_log_mutex);
+		if (err || n == 0) {
+			break;
+		}
+
+		err = sink(recs, n, ctx);
+		if (err) {
+			break;
+		}
+		seq += n;
+		count += n;
+
+		k_mutex_lock(&m_log_mutex, K_FOREVER);
+		m_stats.exported += n;
+		m_stats.export_batches++;
+		// Keep up with the game while a long export runs
+		log_flush();
+		k_mutex_unlock(&m_log_mutex);
+	}
+	*next_seq = seq;
+	return err ? err : (int)count;
+}
+
+// Pack the records after the message header, as many as the current MTU allows
+static int ctrl_sink(const struct proto_log_rec_t *recs, uint32_t count, void *ctx)
+{
+	uint8_t *buf = ctx;
+
+	buf[0] = PROTO_HDR(PROTO_MSG_LOG_DATA);
+	return app_bt_ctrl_send_str(buf, 1 + count * REC_SIZE);
+}
+
+static void export_ctrl(uint32_t from_seq)
+{
+	// The records are read straight into the notification, right after the header
+	static uint8_t buf[1 + EXPORT_BATCH_MAX * REC_SIZE];
+	struct proto_log_end_t end = {0};
+	uint8_t frame[PROTO_FRAME_MAX];
+	uint16_t mtu = app_bt_ctrl_mtu_get();
+	uint32_t batch_max = MIN((mtu > 1) ? (mtu - 1) / REC_SIZE : 0, EXPORT_BATCH_MAX);
+
+	if (batch_max == 0) {
+		LOG_WRN("Export requested without a control link");
+		return;
+	}
+	uint32_t t_start = k_uptime_get_32();
+	int ret = log_export(from_seq, (struct proto_log_rec_t *)&buf[1], batch_max, ctrl_sink, buf, &end.next_seq);
+	if (ret < 0) {
+		LOG_WRN("Export aborted at %u (err %i)", end.next_seq, ret);
+		return;
+	}
+	end.count = ret;
+	int len = proto_encode(PROTO_MSG_LOG_END, &end, frame, sizeof(frame));
+	if (len > 0) {
+		app_bt_ctrl_send_str(frame, len);
+	}
+	LOG_INF("Exported %u records in %u ms, %u per notification", end.count, k_uptime_get_32() - t_start,
+		batch_max);
+}
+
+static void game_log_thread(void *p1, void *p2, void *p3)
+{
+	while (1) {
+		k_sem_take(&m_sem_log_wake, K_FOREVER);
+
+		k_mutex_lock(&m_log_mutex, K_FOREVER);
+		log_flush();
+		k_mutex_unlock(&m_log_mutex);
+
+		if (atomic_cas(&export_pending, 1, 0)) {
+			export_ctrl((uint32_t)atomic_get(&export_from_seq));
+		}
+	}
+}
+
+K_THREAD_DEFINE(m_game_log_thread, THREAD_STACK_SIZE, game_log_thread, NULL, NULL, NULL,
+		THREAD_PRIORITY, 0, SYS_FOREVER_MS);
+
+int game_log_init(void)
+{
+	struct flash_sector sectors[SECTORS_MAX];
+	uint32_t count = SECTORS_MAX;
+	int err;
+
+	err = flash_area_open(LOG_AREA_ID, &fa);
+	if (err) {
+		LOG_ERR("Log partition not available (err %i)", err);
+		return err;
+	}
+	err = flash_area_get_sectors(LOG_AREA_ID, &count, sectors);
+	if (err) {
+		LOG_ERR("Log partition layout not available (err %i)", err);
+		return err;
+	}
+	// The oldest sector is erased as a whole, so the ring needs another one to keep the history in
+	if (count < 2 || sectors[0].fs_size % REC_SIZE != 0) {
+		LOG_ERR("Log partition needs at least 2 sectors");
+		return -EINVAL;
+	}
+	sector_size = sectors[0].fs_size;
+	sector_count = count;
+
+	k_mutex_lock(&m_log_mutex, K_FOREVER);
+	ring_scan();
+	k_mutex_unlock(&m_log_mutex);
+
+	k_thread_start(m_game_log_thread);
+
+	LOG_INF("Game log: %u records stored, next %u, room for %u", seq_next - first_seq, seq_next,
+		fa->fa_size / REC_SIZE);
+	return 0;
+}
+
+void game_log_append(struct proto_log_rec_t *rec)
+{
+	rec->t_ms = k_uptime_get_32();
+	atomic_inc(&appended);
+	if (k_msgq_put(&m_log_queue, rec, K_NO_WAIT) != 0) {
+		atomic_inc(&queue_dropped);
+		return;
+	}
+	k_sem_give(&m_sem_log_wake);
+}
+
+void game_log_export_request(uint32_t from_seq)
+{
+	atomic_set(&export_from_seq, from_seq);
+	atomic_set(&export_pending, 1);
+	k_sem_give(&m_sem_log_wake);
+}
+
+void game_log_stats_get(struct game_log_stats_t *stats)
+{
+	k_mutex_lock(&m_log_mutex, K_FOREVER);
+	*stats = m_stats;
+	stats->first_seq = first_seq;
+	stats->next_seq = seq_next;
+	k_mutex_unlock(&m_log_mutex);
+	stats->appended = atomic_get(&appended);
+	stats->dropped += atomic_get(&queue_dropped);
+}
+
+#if defined(CONFIG_APP_GAME_LOG_SHELL)
+// One hex line per batch, so the output can be turned back into records by a script
+static int shell_sink(const struct proto_log_rec_t *recs, uint32_t count, void *ctx)
+{
+	char hex[SHELL_BATCH_MAX * REC_SIZE * 2 + 1];
+
+	bin2hex((const uint8_t *)recs, count * REC_SIZE, hex, sizeof(hex));
+	shell_print((const struct shell *)ctx, "%s", hex);
+	return 0;
+}
+
+static int cmd_export(const struct shell *sh, size_t argc, char **argv)
+{
+	struct proto_log_rec_t recs[SHELL_BATCH_MAX];
+	uint32_t from_seq = (argc > 1) ? strtoul(argv[1], NULL, 0) : 0;
+	uint32_t next_seq;
+
+	int ret = log_export(from_seq, recs, SHELL_BATCH_MAX, shell_sink, (void *)sh, &next_seq);
+	if (ret < 0) {
+		shell_error(sh, "Export failed at %u (err %i)", next_seq, ret);
+		return ret;
+	}
+	shell_print(sh, "end %u %u", ret, next_seq);
+	return 0;
+}
+
+static int cmd_stats(const struct shell *sh, size_t argc, char **argv)
+{
+	struct game_log_stats_t stats;
+
+	game_log_stats_get(&stats);
+	shell_print(sh, "Records %u to %u stored, room for %u", stats.first_seq, stats.next_seq,
+		    fa ? fa->fa_size / REC_SIZE : 0);
+	shell_print(sh, "Dropped %u, write errors %u, erases %u", stats.dropped, stats.write_errors, stats.erases);
+	shell_print(sh, "Exported %u in %u batches", stats.exported, stats.export_batches);
+	return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_gamelog,
+	SHELL_CMD_ARG(export, NULL, "Export the records as hex lines [from_seq]", cmd_export, 1, 1),
+	SHELL_CMD(stats, NULL, "Log statistics", cmd_stats),
+	SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(gamelog, &sub_gamelog, "Game event log", NULL);
+#endif
@@ -0,0 +1,49 @@
+#ifndef __GAME_LOG_H
+#define __GAME_LOG_H
+
+#include <zephyr/kernel.h>
+#include <string.h>
+#include <proto.h>
+
+/* Game event log, one fixed size record per game, round and challenge, kept in a ring in the
+ * game_log_partition flash partition.
+ *
+ * Appending only queues the record, the flash writes and sector erases are done by a low priority
+ * thread, so the game never waits for the flash. When the ring is full the sector holding the
+ * oldest records is erased. The records are exported in bulk, packed into as few notifications
+ * as the MTU of the control link allows, or as hex lines over the shell. */
+
+struct game_log_stats_t {
+	uint32_t appended;
+	// Records lost because the queue was full, or the flash write failed
+	uint32_t dropped;
+	uint32_t write_errors;
+	uint32_t erases;
+	// Records stored, from first_seq to next_seq - 1
+	uint32_t first_seq;
+	uint32_t next_seq;
+	uint32_t exported;
+	uint32_t export_batches;
+};
+
+#if defined(CONFIG_APP_GAME_LOG)
+int game_log_init(void);
+
+// Queue a record for the log. The sequence number and time stamp are filled in by the log.
+void game_log_append(struct proto_log_rec_t *rec);
+
+// Stream the records from from_seq on to the control app, from the log thread
+void game_log_export_request(uint32_t from_seq);
+
+void game_log_stats_get(struct game_log_stats_t *stats);
+#else
+static inline int game_log_init(void) { return 0; }
+
+static inline void game_log_append(struct proto_log_rec_t *rec) {}
+
+static inline void game_log_export_request(uint32_t from_seq) {}
+
+static inline void game_log_stats_get(struct game_log_stats_t *stats) { memset(stats, 0, sizeof(*stats)); }
+#endif
+
+#endif
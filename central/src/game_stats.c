@@ -0,0 +1,110 @@
+#include <game_stats.h>
+#include <string.h>
+
+#define BUCKETS_PR_OCTAVE_LOG2	2
+#define BUCKET_MIN_LOG2		6
+
+BUILD_ASSERT(GAME_STATS_BUCKET_MIN_MS == BIT(BUCKET_MIN_LOG2));
+
+static int bucket_index(uint32_t time_ms)
+{
+	if (time_ms < GAME_STATS_BUCKET_MIN_MS) {
+		return 0;
+	}
+	int msb = 31 - __builtin_clz(time_ms);
+	// The two bits below the most significant one select the bucket within the octave
+	int sub = (time_ms >> (msb - BUCKETS_PR_OCTAVE_LOG2)) & BIT_MASK(BUCKETS_PR_OCTAVE_LOG2);
+	int index = ((msb - BUCKET_MIN_LOG2) << BUCKETS_PR_OCTAVE_LOG2) + sub;
+	return MIN(index, GAME_STATS_BUCKETS - 1);
+}
+
+// Middle of the range covered by a bucket
+static uint32_t bucket_value(int index)
+{
+	int msb = (index >> BUCKETS_PR_OCTAVE_LOG2) + BUCKET_MIN_LOG2;
+	int sub = index & BIT_MASK(BUCKETS_PR_OCTAVE_LOG2);
+	uint32_t low = (uint32_t)(BIT(BUCKETS_PR_OCTAVE_LOG2) + sub) << (msb - BUCKETS_PR_OCTAVE_LOG2);
+	uint32_t step = BIT(msb - BUCKETS_PR_OCTAVE_LOG2);
+	return low + step / 2;
+}
+
+void game_stats_reset(struct game_stats_t *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	stats->min_ms = UINT16_MAX;
+}
+
+void game_stats_add(struct game_stats_t *stats, uint32_t time_ms)
+{
+	int index = bucket_index(time_ms);
+
+	time_ms = MIN(time_ms, UINT16_MAX);
+	if (stats->count == UINT16_MAX) {
+		return;
+	}
+	stats->count++;
+	stats->min_ms = MIN(stats->min_ms, time_ms);
+	stats->max_ms = MAX(stats->max_ms, time_ms);
+	stats->sum_ms += time_ms;
+	stats->sum_sq += (uint64_t)time_ms * time_ms;
+	if (stats->hist[index] < UINT8_MAX) {
+		stats->hist[index]++;
+	}
+}
+
+uint32_t game_stats_mean(const struct game_stats_t *stats)
+{
+	return (stats->count > 0) ? stats->sum_ms / stats->count : 0;
+}
+
+static uint32_t isqrt(uint64_t value)
+{
+	uint64_t root = 0, bit = 1ULL << 62;
+
+	while (bit > value) {
+		bit >>= 2;
+	}
+	while (bit != 0) {
+		if (value >= root + bit) {
+			value -= root + bit;
+			root = (root >> 1) + bit;
+		}
+		else {
+			root >>= 1;
+		}
+		bit >>= 2;
+	}
+	return (uint32_t)root;
+}
+
+uint32_t game_stats_stddev(const struct game_stats_t *stats)
+{
+	if (stats->count < 2) {
+		return 0;
+	}
+	// Sample variance from the sums, exact in integer math
+	uint64_t n = stats->count;
+	uint64_t var = (stats->sum_sq * n - (uint64_t)stats->sum_ms * stats->sum_ms) / (n * (n - 1));
+	return isqrt(var);
+}
+
+uint32_t game_stats_percentile(const struct game_stats_t *stats, uint32_t pct)
+{
+	uint32_t total = 0, rank, seen = 0;
+
+	for (int i = 0; i < GAME_STATS_BUCKETS; i++) {
+		total += stats->hist[i];
+	}
+	if (total == 0) {
+		return 0;
+	}
+	// Nearest rank
+	rank = MAX(DIV_ROUND_UP(total * MIN(pct, 100), 100), 1);
+	for (int i = 0; i < GAME_STATS_BUCKETS; i++) {
+		seen += stats->hist[i];
+		if (seen >= rank) {
+			return CLAMP(bucket_value(i), stats->min_ms, stats->max_ms);
+		}
+	}
+	return stats->max_ms;
+}
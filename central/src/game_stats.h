@@ -0,0 +1,35 @@
+#ifndef __GAME_STATS_H
+#define __GAME_STATS_H
+
+#include <zephyr/kernel.h>
+
+/* Incremental reaction time statistics. Every result updates the running min, max, sum and sum of
+ * squares, and a histogram with 4 log spaced buckets per octave. Percentiles are read from the
+ * histogram, to within about 10 %, so the individual results do not have to be kept. */
+
+#define GAME_STATS_BUCKETS	24
+// Results below this end up in the first bucket, results above 64 times this in the last one
+#define GAME_STATS_BUCKET_MIN_MS 64
+
+struct game_stats_t {
+	uint16_t count;
+	uint16_t min_ms;
+	uint16_t max_ms;
+	uint32_t sum_ms;
+	uint64_t sum_sq;
+	// Saturates at 255 per bucket
+	uint8_t hist[GAME_STATS_BUCKETS];
+};
+
+void game_stats_reset(struct game_stats_t *stats);
+
+void game_stats_add(struct game_stats_t *stats, uint32_t time_ms);
+
+uint32_t game_stats_mean(const struct game_stats_t *stats);
+
+uint32_t game_stats_stddev(const struct game_stats_t *stats);
+
+// Approximate percentile, pct from 0 to 100
+uint32_t game_stats_percentile(const struct game_stats_t *stats, uint32_t pct);
+
+#endif
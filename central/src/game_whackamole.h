@@ -2,7 +2,11 @@
 #define __GAME_WHACKAMOLE_H
 
 #include <game.h>
+#include <game_stats.h>
 
 int whackamole_init(struct game_t *game);
 
+// Copy of the reaction time statistics of the current or last game. Safe to call from any thread.
+int whackamole_stats_get(enum proto_stats_scope_t scope, uint32_t index, struct game_stats_t *out);
+
 #endif
@@ -1,19 +1,47 @@
 #include <game.h>
+#include <timesync.h>
+#include <console_ui.h>
+#include <game_stats.h>
+#include <game_hiscore.h>
+#include <game_log.h>
+#include <game_whackamole.h>
 #include <string.h>
 #include <stdlib.h>
 
-#define CHALLENGE_NUM_MAX 256
 #define MAX_ROUNDS		  6
-#define PERIPHERALS_MAX	  8
+#define PERIPHERALS_MAX	  CONFIG_APP_GAME_PADS_MAX
+#define MOLES_MAX		  MIN(CONFIG_APP_GAME_MOLES_MAX, PERIPHERALS_MAX)
+#define CHALLENGES_PR_ROUND 10
+// Effects are scheduled this far ahead, enough to reach every pad before they execute
+#define EFFECT_LEAD_US	  100000
 
-K_SEM_DEFINE(m_sem_num_players_update, 0, 1);
-K_SEM_DEFINE(m_sem_peripheral_update, 0, 1);
-K_SEM_DEFINE(m_sem_second_tick, 0, 1);
+// Wakes the game thread when an event is posted. Deadlines are handled through the take timeout.
+K_SEM_DEFINE(m_sem_game_wake, 0, 1);
 
 struct game_t *this;
 
-int num_players;
-bool ping_received;
+// Events posted by the game event thread to the game thread
+#define GAME_EVT_NUM_PLAYERS	BIT(0)
+#define GAME_EVT_PING		BIT(1)
+#define GAME_EVT_RESULT		BIT(2)
+
+static atomic_t game_events;
+
+// Written by the game event thread, read by the game thread
+static atomic_t num_players;
+static uint64_t pad_ready_mask;
+static struct k_spinlock pad_ready_lock;
+// Results per pad, flagged in chg_result_mask once written
+static struct {
+	uint32_t time_ms;
+	bool timed_out;
+	uint8_t chg_id;
+} chg_result[PERIPHERALS_MAX];
+static ATOMIC_DEFINE(chg_result_mask, PERIPHERALS_MAX);
+// Pads with an active challenge, written by the game thread
+static ATOMIC_DEFINE(mole_active_mask, PERIPHERALS_MAX);
+// Link RSSI of the last data from each pad
+static int8_t pad_rssi[PERIPHERALS_MAX];
 
 const led_effect_cfg_t led_effect_challenge = {.color1 = LED_COLOR_PURPLE, .color2 = LED_COLOR_ORANGE, .color_end = LED_COLOR_BLACK,
                                                .speed = 45, .num_repeats = LED_REPEAT_INFINITE};
@@ -28,358 +56,720 @@ const led_effect_cfg_t led_effect_result_lose = {.color1 = LED_COLOR_RED, .color
 const led_effect_cfg_t led_effect_new_round   = {.color1 = LED_COLOR_BLACK, .color2 = LED_COLOR_WHITE, .color_end = LED_COLOR_BLACK,
                                                .speed = 30, .num_repeats = 2};
 
+enum game_state_t {
+	// Waiting for a pad to connect and a button press to start the game
+	GAME_STATE_WAIT_PLAYERS,
+	// Game announced, waiting for the first round
+	GAME_STATE_STARTING,
+	// Round announced on the console and the pads, waiting for the first challenge
+	GAME_STATE_ROUND_INTRO,
+	// Challenges running until the round quota is reached and the last one is answered
+	GAME_STATE_ROUND_RUN,
+};
+
 struct whackamole_t {
-    int round_duration_s;
+	enum game_state_t state;
 	int number_of_rounds;
 	int current_round;
 	int challenges_pr_round;
 	int challenge_index;
 	int target_pr_round[MAX_ROUNDS];
-    int time, time_until_challenge;
-    int challenge_int_min, challenge_int_range;
-    int chg_rsp_total, chg_rsp_counter;
+	// Absolute deadline of the state, in kernel ticks
+	int64_t deadline;
+	bool deadline_set;
+	int challenge_int_range_ms;
+	// Number of challenges allowed to run at the same time in this game
+	int moles_max;
+	int moles_active;
+	// The challenge deadline passed while every pad was busy, start it as soon as one is free
+	bool challenge_due;
 	bool game_running;
+	// Game state and challenges finished, as reported to the control app
+	enum proto_game_state_t status;
+	int challenges_done;
+	uint32_t last_ms;
 } whackamole;
 
+// Challenge state per pad
+struct mole_t {
+	bool active;
+	uint8_t chg_id;
+	uint32_t target_ms;
+	int64_t t_start;
+	// The challenge is given up on, and scored as timed out, if the pad has not answered by then
+	int64_t deadline;
+};
+
+static struct mole_t mole[PERIPHERALS_MAX];
+// Id of the last challenge, never 0 so the pads can tell commands without a challenge apart
+static uint8_t chg_id_last;
+
 struct player_t {
     uint32_t per_index;
     uint32_t per_num;
-	int chg_per_index, chg_per_index_previous;
-    bool player_ping_received;
-    int time_until_challenge;
+	int chg_per_index_previous;
 	int score;
 	int missing_scores;
 	int fouls;
-    uint32_t challenge_response_time_list[CHALLENGE_NUM_MAX];
-    uint32_t challenge_counter;
-    uint32_t challenge_average;
-	int challenge_queued_by_peripheral[PERIPHERALS_MAX];
 } player[1];
 
-void game_timer_func(struct k_timer *timer_id); 
-
-K_TIMER_DEFINE(m_timer_game, game_timer_func, NULL);
+// Reaction times of the successful and too slow challenges, timeouts are not included
+static struct {
+	struct game_stats_t game;
+	struct game_stats_t round[MAX_ROUNDS];
+	struct game_stats_t pad[PERIPHERALS_MAX];
+	// Fouls charged to each pad
+	uint16_t pad_fouls[PERIPHERALS_MAX];
+} stats;
+// Stats are updated by the game thread, and can be read from any thread
+static struct k_spinlock stats_lock;
 
 enum {PER_INDEX_ALL = 0x1000, PER_INDEX_ALL_P1, PER_INDEX_ALL_P2};
 
-static void send_color_effect(uint32_t per_index, uint8_t sub_cmd, const led_effect_cfg_t *effect, uint16_t timeout)
+static uint64_t pad_ready_get(void)
+{
+	k_spinlock_key_t key = k_spin_lock(&pad_ready_lock);
+	uint64_t mask = pad_ready_mask;
+
+	k_spin_unlock(&pad_ready_lock, key);
+	return mask;
+}
+
+// Pads that challenges can be given to
+static uint64_t pads_mask(void)
+{
+	return pad_ready_get() & (PERIPHERALS_MAX >= 64 ? UINT64_MAX : BIT64_MASK(PERIPHERALS_MAX));
+}
+
+static void send_all(const uint8_t *data, uint16_t len)
+{
+	uint64_t mask = (atomic_get(&num_players) > 64) ? UINT64_MAX : pad_ready_get();
+
+	// Use multicast when available, so all the peripherals get the command in the same connection events
+	if(this->bt_send_multi) {
+		this->bt_send_multi(mask, data, len);
+	}
+	else {
+		for(int i = 0; i < 64; i++) {
+			if(mask & BIT64(i)) {
+				this->bt_send(i, data, len);
+			}
+		}
+	}
+}
+
+static void set_phase(enum game_phase_t phase)
+{
+	if(this->phase) {
+		this->phase(phase);
+	}
+}
+
+static void send_color_effect(uint32_t per_index, enum proto_trial_t trial, const led_effect_cfg_t *effect, uint16_t timeout,
+			      uint8_t chg_id)
 {
-    static uint8_t led_effect_cmd[LED_EFFECT_CMD_SIZE];
-    led_effect_to_cmd_to(effect, sub_cmd, led_effect_cmd, timeout);
+	static uint8_t frame[PROTO_FRAME_MAX];
+	struct proto_led_t led = {.effect = *effect, .trial = trial, .timeout_ms = timeout,
+				  .exec_at_us = timesync_now_us() + EFFECT_LEAD_US, .chg_id = chg_id};
+	int len = proto_encode(PROTO_MSG_LED, &led, frame, sizeof(frame));
+	if(len < 0) {
+		printk("LED command encode error (err %i)\n", len);
+		return;
+	}
 	if(per_index == PER_INDEX_ALL) {
-         for(int i = 0; i < player[0].per_num; i++) {
-            this->bt_send(i, led_effect_cmd, LED_EFFECT_CMD_SIZE);
-			//k_msleep(2);
-        }       
+		send_all(frame, len);
     }
     else {
-        this->bt_send(per_index, led_effect_cmd, LED_EFFECT_CMD_SIZE);
+        this->bt_send(per_index, frame, len);
     }
 }
 
-static uint8_t per_cmd_buf[20];
+static void send_reset(void)
+{
+	uint8_t frame[PROTO_FRAME_MAX];
+	int len = proto_encode(PROTO_MSG_RESET, NULL, frame, sizeof(frame));
+	if(len > 0) {
+		send_all(frame, len);
+	}
+}
+
 static void send_per_cmd_chg_start(uint8_t p_index, uint16_t target_time)
 {
-	int i = 0;
-	per_cmd_buf[i++] = 'A';
-	per_cmd_buf[i++] = p_index;
-	per_cmd_buf[i++] = (uint8_t)num_players;
-	per_cmd_buf[i++] = (uint8_t)(target_time >> 8);
-	per_cmd_buf[i++] = (uint8_t)target_time;
-	this->bt_ctrl_send(per_cmd_buf, i);
+	struct proto_chg_start_t msg = {.pad = p_index, .num_players = (uint8_t)atomic_get(&num_players),
+					.target_ms = target_time};
+	this->bt_ctrl_send(PROTO_MSG_CHG_START, &msg);
 }
 
 static void send_per_cmd_chg_finish(uint8_t p_index, uint16_t time, uint16_t target, bool success, uint16_t points, uint16_t fouls)
 {
-	int i = 0;
-	per_cmd_buf[i++] = 'B';
-	per_cmd_buf[i++] = p_index;
-	per_cmd_buf[i++] = (uint8_t)(time >> 8);
-	per_cmd_buf[i++] = (uint8_t)time;
-	per_cmd_buf[i++] = (uint8_t)(target >> 8);
-	per_cmd_buf[i++] = (uint8_t)target;
-	per_cmd_buf[i++] = success ? 1 : 0;
-	per_cmd_buf[i++] = (uint8_t)(points >> 8);
-	per_cmd_buf[i++] = (uint8_t)points;
-	per_cmd_buf[i++] = (uint8_t)(fouls >> 8);
-	per_cmd_buf[i++] = (uint8_t)fouls;
-	this->bt_ctrl_send(per_cmd_buf, i);
+	struct proto_chg_finish_t msg = {.pad = p_index, .time_ms = time, .target_ms = target,
+					 .success = success ? 1 : 0, .points = points, .fouls = fouls};
+	this->bt_ctrl_send(PROTO_MSG_CHG_FINISH, &msg);
 }
 
 static void send_per_cmd_round_start(int round_index, int round_total, int target_time)
 {
-	int i = 0;
-	per_cmd_buf[i++] = 'C';
-	per_cmd_buf[i++] = (uint8_t)round_index;
-	per_cmd_buf[i++] = (uint8_t)round_total;
-	per_cmd_buf[i++] = (uint8_t)num_players;
-	per_cmd_buf[i++] = (uint8_t)(target_time >> 8);
-	per_cmd_buf[i++] = (uint8_t)target_time;
-	this->bt_ctrl_send(per_cmd_buf, i);
+	struct proto_round_start_t msg = {.round = round_index, .round_total = round_total,
+					  .num_players = (uint8_t)atomic_get(&num_players), .target_ms = target_time};
+	this->bt_ctrl_send(PROTO_MSG_ROUND_START, &msg);
 }
 
 static void send_per_cmd_game_start()
 {
-	int i = 0;
-	per_cmd_buf[i++] = 'D';
-	this->bt_ctrl_send(per_cmd_buf, i);
+	this->bt_ctrl_send(PROTO_MSG_GAME_START, NULL);
 }
 
 static void send_per_cmd_game_finish(int score, int min, int max, int average)
 {
-	int i = 0;
-	per_cmd_buf[i++] = 'E';
-	per_cmd_buf[i++] = (uint8_t)(score >> 8);
-	per_cmd_buf[i++] = (uint8_t)score;
-	per_cmd_buf[i++] = (uint8_t)(min >> 8);
-	per_cmd_buf[i++] = (uint8_t)min;
-	per_cmd_buf[i++] = (uint8_t)(max >> 8);
-	per_cmd_buf[i++] = (uint8_t)max;
-	per_cmd_buf[i++] = (uint8_t)(average >> 8);
-	per_cmd_buf[i++] = (uint8_t)average;
-	this->bt_ctrl_send(per_cmd_buf, i);
+	struct proto_game_finish_t msg = {.score = score, .min_ms = min, .max_ms = max, .avg_ms = average};
+	this->bt_ctrl_send(PROTO_MSG_GAME_FINISH, &msg);
+}
+
+static void send_per_cmd_stats(enum proto_stats_scope_t scope, uint8_t index, const struct game_stats_t *s, uint16_t fouls)
+{
+	struct proto_stats_t msg = {.scope = scope, .index = index, .count = s->count, .fouls = fouls,
+				    .min_ms = (s->count > 0) ? s->min_ms : 0, .max_ms = s->max_ms,
+				    .mean_ms = game_stats_mean(s), .stddev_ms = game_stats_stddev(s),
+				    .p50_ms = game_stats_percentile(s, 50), .p90_ms = game_stats_percentile(s, 90),
+				    .p99_ms = game_stats_percentile(s, 99)};
+	this->bt_ctrl_send(PROTO_MSG_STATS, &msg);
+}
+
+// State for a control app that reconnects, kept by the control link rather than sent, and for the spectators
+static void send_per_cmd_snapshot(void)
+{
+	int round = MAX(whackamole.current_round, 0);
+	struct proto_snapshot_t msg = {.state = whackamole.status, .round = round, .round_total = MAX_ROUNDS,
+				       .num_players = (uint8_t)atomic_get(&num_players),
+				       .target_ms = whackamole.target_pr_round[round], .score = player[0].score,
+				       .fouls = player[0].fouls, .challenges = whackamole.challenges_done,
+				       .last_ms = MIN(whackamole.last_ms, UINT16_MAX)};
+	this->bt_ctrl_send(PROTO_MSG_SNAPSHOT, &msg);
+}
+
+static void send_per_cmd_flush(void)
+{
+	if (this->bt_ctrl_flush) {
+		this->bt_ctrl_flush();
+	}
 }
 
 static void send_per_cmd_num_con_change(int num_con)
 {
-	int i = 0;
-	per_cmd_buf[i++] = 'F';
-	per_cmd_buf[i++] = (uint8_t)num_con;
-	this->bt_ctrl_send(per_cmd_buf, i);
+	struct proto_num_con_t msg = {.num = num_con};
+	this->bt_ctrl_send(PROTO_MSG_NUM_CON, &msg);
+}
+
+static void log_event(enum proto_log_rec_type_t type, uint8_t index, uint16_t target_ms, uint16_t value,
+		      uint32_t fouls, int8_t rssi)
+{
+	struct proto_log_rec_t rec = {.type = type, .index = index, .target_ms = target_ms, .value = value,
+				      .fouls = MIN(fouls, UINT8_MAX), .rssi = rssi};
+	game_log_append(&rec);
 }
 
-#define CONSOLE_SCORE_PROGRESS_COL 50
-static int console_print_progress = -1;
-static int console_print_goal_line_index;
-static bool challenge_pending = false;
-static int foul_presses = 0;
+// Presses on a pad without a mole while a mole is up elsewhere, counted by the game event thread. With a
+// single mole they are charged to the current result, with several to the next result of the same pad.
+static atomic_t pad_fouls[PERIPHERALS_MAX];
 
-void challenge_finalize(uint32_t time, uint32_t target_time, bool success, int pad_lines)
+// Take the fouls counted on a pad, or on all the pads if per_index is negative, into the pad stats
+static int fouls_take(int per_index)
 {
+	int total = 0;
+
+	k_spinlock_key_t key = k_spin_lock(&stats_lock);
+	for (int i = 0; i < PERIPHERALS_MAX; i++) {
+		if (per_index >= 0 && i != per_index) {
+			continue;
+		}
+		int fouls = (int)atomic_clear(&pad_fouls[i]);
+		stats.pad_fouls[i] += fouls;
+		total += fouls;
+	}
+	k_spin_unlock(&stats_lock, key);
+	return total;
+}
+
+static void fouls_charge(int fouls)
+{
+	player[0].score -= fouls;
+	player[0].fouls += fouls;
+}
+
+void challenge_finalize(uint32_t per_index, uint32_t time, uint32_t target_time, bool success)
+{
+	int fouls = fouls_take((whackamole.moles_max > 1) ? (int)per_index : -1);
+	// With several moles up, the result effect only goes to the pad that was hit
+	uint32_t effect_index = (whackamole.moles_max > 1) ? per_index : PER_INDEX_ALL;
+	fouls_charge(fouls);
  	if(success) {
 		// Response time sufficient, award one point
 		player[0].score++;
-		if(foul_presses > 0) {
-			player[0].score -= foul_presses;
-			player[0].fouls += foul_presses;
-		}
-		printk("+");
-		int goal_line_tmp_index = pad_lines + console_print_goal_line_index - CONSOLE_SCORE_PROGRESS_COL - 1;
-		for(int i = 0; i < pad_lines; i++) (i == goal_line_tmp_index) ? printk("|") : printk(" ");
-		printk("+1 point. Score %i. Time %i ms\n", player[0].score, time);
-		send_color_effect(PER_INDEX_ALL, '0', &led_effect_result_good, 0);
-		send_per_cmd_chg_finish(0, (uint16_t)time, target_time, true, 1, foul_presses);
+		send_color_effect(effect_index, PROTO_TRIAL_NONE, &led_effect_result_good, 0, 0);
+		send_per_cmd_chg_finish(per_index, (uint16_t)time, target_time, true, 1, fouls);
 	}
 	else {
 		// Too slow, no points awarded
-		printk("X");
-		for(int i = 0; i < pad_lines; i++) printk(" ");
-		if(foul_presses > 0) {
-			player[0].score -= foul_presses;
-			player[0].fouls += foul_presses;
-			printk("Fouls: %i. Score %i", foul_presses, player[0].score);
-		}
-		else {
-			printk("-");
-		}
-		printk("\n");
-		send_color_effect(PER_INDEX_ALL, '0', &led_effect_result_bad, 0);
-		send_per_cmd_chg_finish(0, (uint16_t)time, target_time, false, 0, foul_presses);
+		send_color_effect(effect_index, PROTO_TRIAL_NONE, &led_effect_result_bad, 0, 0);
+		send_per_cmd_chg_finish(per_index, (uint16_t)time, target_time, false, 0, fouls);
 	}
-	foul_presses = 0;
+	console_ui_challenge_result(success, time, player[0].score, fouls);
+	whackamole.challenges_done++;
+	whackamole.last_ms = time;
+	send_per_cmd_snapshot();
+
+	// Timed out challenges are finalized with a time of 0
+	log_event(success ? PROTO_LOG_REC_CHG_HIT : (time > 0) ? PROTO_LOG_REC_CHG_SLOW : PROTO_LOG_REC_CHG_TIMEOUT,
+		  per_index, target_time, time, fouls, pad_rssi[per_index]);
+}
+
+static void game_event_post(atomic_val_t event)
+{
+	atomic_or(&game_events, event);
+	k_sem_give(&m_sem_game_wake);
 }
 
 void whackamole_bt_rx(struct game_t *game, struct app_bt_evt_t *bt_evt)
 {
-	static uint32_t last_chg_response_time;
-    switch(bt_evt->type) {
-        case APP_BT_EVT_CON_NUM_CHANGE:
-            num_players = bt_evt->num_connected;
-            k_sem_give(&m_sem_num_players_update); 
-            break;
-        case APP_BT_EVT_RX_DATA:
-            if (memcmp(bt_evt->data, "PING", 4) == 0) {
-				ping_received = true;
-				if(whackamole.game_running) {
-					// If a ping happens very quickly after a valid response, assume it was a dummy double click and not the players fault
-					uint32_t diff_time = k_uptime_get_32() - last_chg_response_time;
+	static uint32_t last_chg_response_time[PERIPHERALS_MAX];
+	uint32_t pad = bt_evt->con_index;
+	union proto_msg_t msg;
+	uint8_t msg_type;
+	if (bt_evt->type == APP_BT_EVT_RX_DATA && pad < PERIPHERALS_MAX) {
+		pad_rssi[pad] = bt_evt->rssi;
+	}
+	switch(bt_evt->type) {
+		case APP_BT_EVT_CON_NUM_CHANGE: {
+			k_spinlock_key_t key = k_spin_lock(&pad_ready_lock);
+			pad_ready_mask = bt_evt->ready_mask;
+			k_spin_unlock(&pad_ready_lock, key);
+			atomic_set(&num_players, bt_evt->num_connected);
+			game_event_post(GAME_EVT_NUM_PLAYERS);
+			break;
+		}
+		case APP_BT_EVT_RX_DATA:
+			if (proto_decode(bt_evt->data, bt_evt->data_len, &msg_type, &msg) != 0) {
+				break;
+			}
+			if (msg_type == PROTO_MSG_PING) {
+				// Hitting a pad without a mole while a mole is up is a foul, except right after a valid response on the same pad,
+				// which is most likely a double click and not the players fault
+				if(whackamole.game_running && whackamole.moles_active > 0 && pad < PERIPHERALS_MAX &&
+				   !atomic_test_bit(mole_active_mask, pad)) {
+					uint32_t diff_time = k_uptime_get_32() - last_chg_response_time[pad];
 					if(diff_time > 400){
-						//player[0].score--;
-						foul_presses++;
-						//printk("Wrong button pressed (%i). -1 point. Score %i\n", bt_evt->con_index, player[0].score);
+						atomic_inc(&pad_fouls[pad]);
 					}
 				}
-            }
-            else if (memcmp(bt_evt->data, "TD:", 3) == 0 && bt_evt->data_len >= 9) {
-                uint32_t response_time = 0;
-				last_chg_response_time = k_uptime_get_32();
-                for(int i = 0; i < 6; i++) {
-                    response_time = response_time * 10 + (bt_evt->data[i+3] - '0');
-                }
-				int pad_spaces_to_print = CONSOLE_SCORE_PROGRESS_COL - console_print_progress;
-				console_print_progress = -1;
-				challenge_pending = false;
-				//printk("Received from index %i, expected %i\n", bt_evt->con_index, player[0].chg_per_index);
-
-				if(response_time < whackamole.target_pr_round[whackamole.current_round]) {
-					challenge_finalize(response_time, whackamole.target_pr_round[whackamole.current_round],
-										true, pad_spaces_to_print);
-				}
-				else {
-					challenge_finalize(response_time, whackamole.target_pr_round[whackamole.current_round],
-										false, pad_spaces_to_print);
-				}
+				game_event_post(GAME_EVT_PING);
+			}
+			else if (pad >= PERIPHERALS_MAX) {
+				break;
+			}
+			else if (msg_type == PROTO_MSG_TRIAL_DONE) {
+				last_chg_response_time[pad] = k_uptime_get_32();
+				chg_result[pad].time_ms = msg.trial_done.time_us / 1000;
+				chg_result[pad].timed_out = false;
+				chg_result[pad].chg_id = msg.trial_done.chg_id;
+				atomic_set_bit(chg_result_mask, pad);
+				game_event_post(GAME_EVT_RESULT);
+			}
+			else if (msg_type == PROTO_MSG_TRIAL_TIMEOUT) {
+				chg_result[pad].time_ms = 0;
+				chg_result[pad].timed_out = true;
+				chg_result[pad].chg_id = msg.trial_timeout.chg_id;
+				atomic_set_bit(chg_result_mask, pad);
+				game_event_post(GAME_EVT_RESULT);
+			}
+			break;
+	}
+}
+
+#define TIMEOUT_BUFFER_MS 300
+// Time for the command to reach the pad and the result to come back, on top of the pad timeout
+#define CHG_LINK_MARGIN_MS CONFIG_APP_GAME_CHG_LINK_MARGIN_MS
+#define GAME_START_DELAY_MS 1000
+#define ROUND_INTRO_DELAY_MS 750
+#define FIRST_CHALLENGE_DELAY_MS 1000
+
+static void deadline_set(int64_t base, uint32_t delay_ms)
+{
+	whackamole.deadline = base + k_ms_to_ticks_ceil64(delay_ms);
+	whackamole.deadline_set = true;
+}
+
+static void game_wait_players_enter(void)
+{
+	whackamole.state = GAME_STATE_WAIT_PLAYERS;
+	whackamole.deadline_set = false;
+	console_ui_text("\nPress any button to start a new game\n");
+}
+
+static void game_start(void)
+{
+	player[0].per_num = __builtin_popcountll(pads_mask());
+	player[0].score = 0;
+	player[0].missing_scores = 0;
+	player[0].fouls = 0;
+	player[0].chg_per_index_previous = -1;
+
+	// More moles at a time means more challenges in the same round time
+	whackamole.moles_max = MAX(MIN(MOLES_MAX, player[0].per_num), 1);
+	whackamole.challenges_pr_round = CHALLENGES_PR_ROUND * whackamole.moles_max;
+	whackamole.moles_active = 0;
+	whackamole.challenge_due = false;
+	memset(mole, 0, sizeof(mole));
+	for (int i = 0; i < PERIPHERALS_MAX; i++) {
+		atomic_clear_bit(mole_active_mask, i);
+		atomic_clear_bit(chg_result_mask, i);
+		atomic_clear(&pad_fouls[i]);
+	}
 
-				// Add the response time to the list
-				if (player[0].challenge_counter < CHALLENGE_NUM_MAX) {
-					player[0].challenge_response_time_list[player[0].challenge_counter++] = response_time;
+	k_spinlock_key_t key = k_spin_lock(&stats_lock);
+	game_stats_reset(&stats.game);
+	for (int i = 0; i < MAX_ROUNDS; i++) {
+		game_stats_reset(&stats.round[i]);
+	}
+	for (int i = 0; i < PERIPHERALS_MAX; i++) {
+		game_stats_reset(&stats.pad[i]);
+		stats.pad_fouls[i] = 0;
+	}
+	k_spin_unlock(&stats_lock, key);
+
+	// Use the uptime to provide a semi random seed to the random generator
+	srand(k_uptime_get_32());
+
+	console_ui_text("\n\nStarting new game\n");
+	set_phase(GAME_PHASE_ACTIVE);
+	send_reset();
+	send_per_cmd_game_start();
+	whackamole.status = PROTO_GAME_RUNNING;
+	whackamole.challenges_done = 0;
+	whackamole.last_ms = 0;
+	log_event(PROTO_LOG_REC_GAME_START, player[0].per_num, 0, 0, 0, 0);
+
+	whackamole.current_round = -1;
+	send_per_cmd_snapshot();
+	whackamole.state = GAME_STATE_STARTING;
+	deadline_set(k_uptime_ticks(), GAME_START_DELAY_MS);
+}
+
+static void round_intro_enter(int64_t now)
+{
+	whackamole.current_round++;
+	whackamole.state = GAME_STATE_ROUND_INTRO;
+	deadline_set(now, ROUND_INTRO_DELAY_MS);
+}
+
+static void round_start(int64_t now)
+{
+	uint32_t target_time = whackamole.target_pr_round[whackamole.current_round];
+
+	console_ui_round_start(whackamole.current_round, target_time);
+	send_color_effect(PER_INDEX_ALL, PROTO_TRIAL_NONE, &led_effect_new_round, 0, 0);
+	send_per_cmd_round_start(whackamole.current_round, MAX_ROUNDS, target_time);
+	log_event(PROTO_LOG_REC_ROUND_START, whackamole.current_round, target_time, 0, 0, 0);
+	send_per_cmd_snapshot();
+
+	whackamole.challenge_index = 0;
+	whackamole.state = GAME_STATE_ROUND_RUN;
+	deadline_set(now, ROUND_INTRO_DELAY_MS + FIRST_CHALLENGE_DELAY_MS);
+}
+
+static int mole_pick(void)
+{
+	int free_pads[PERIPHERALS_MAX];
+	int num_free = 0;
 
-					whackamole.chg_rsp_total += response_time;
-					whackamole.chg_rsp_counter++;
+	uint64_t mask = pads_mask();
+
+	for (int i = 0; i < PERIPHERALS_MAX; i++) {
+		if ((mask & BIT64(i)) && !mole[i].active) {
+			free_pads[num_free++] = i;
+		}
+	}
+	return (num_free > 0) ? free_pads[rand() % num_free] : -1;
+}
+
+static void challenge_start(int64_t now)
+{
+	uint32_t target_time = whackamole.target_pr_round[whackamole.current_round];
+	int per_index = mole_pick();
+	struct mole_t *m;
+
+	if (per_index < 0) {
+		if (whackamole.moles_active > 0) {
+			// Wait for a pad to be freed
+			return;
+		}
+		// No pads left to challenge. Count the challenge as missed, so the round still ends.
+		player[0].missing_scores++;
+	}
+	whackamole.challenge_due = false;
+	if (this->sched_jitter) {
+		this->sched_jitter(whackamole.current_round, whackamole.challenge_index,
+				   (uint32_t)k_ticks_to_us_floor64(now - whackamole.deadline));
+	}
+	whackamole.challenge_index++;
+
+	// Chain the deadlines rather than restarting from the wake up time, so the jitter does not accumulate
+	if (whackamole.challenge_index < whackamole.challenges_pr_round) {
+		deadline_set(whackamole.deadline, (target_time + 200 + rand() % whackamole.challenge_int_range_ms) / whackamole.moles_max);
+	}
+	else {
+		whackamole.deadline_set = false;
+	}
+	if (per_index < 0) {
+		return;
+	}
+
+	chg_id_last = (chg_id_last == UINT8_MAX) ? 1 : chg_id_last + 1;
+	m = &mole[per_index];
+	m->active = true;
+	m->chg_id = chg_id_last;
+	m->target_ms = target_time;
+	m->t_start = now;
+	// The pad starts its timeout when the effect starts, EFFECT_LEAD_US after the command is sent
+	m->deadline = now + k_ms_to_ticks_ceil64(EFFECT_LEAD_US / 1000 + target_time + TIMEOUT_BUFFER_MS +
+						 CHG_LINK_MARGIN_MS);
+	atomic_set_bit(mole_active_mask, per_index);
+	whackamole.moles_active++;
+	player[0].chg_per_index_previous = per_index;
+
+	send_color_effect(per_index, PROTO_TRIAL_START_TIMEOUT, &led_effect_challenge, target_time + TIMEOUT_BUFFER_MS, m->chg_id);
+	if (whackamole.moles_max == 1) {
+		console_ui_challenge_start();
+	}
+	send_per_cmd_chg_start(per_index, target_time);
+}
+
+static void challenge_result(uint32_t per_index, bool timed_out, uint32_t response_time)
+{
+	struct mole_t *m = &mole[per_index];
+
+	m->active = false;
+	atomic_clear_bit(mole_active_mask, per_index);
+	whackamole.moles_active--;
+
+	if (timed_out) {
+		challenge_finalize(per_index, 0, m->target_ms, false);
+		return;
+	}
+	challenge_finalize(per_index, response_time, m->target_ms, response_time < m->target_ms);
+
+	k_spinlock_key_t key = k_spin_lock(&stats_lock);
+	game_stats_add(&stats.game, response_time);
+	game_stats_add(&stats.round[whackamole.current_round], response_time);
+	game_stats_add(&stats.pad[per_index], response_time);
+	k_spin_unlock(&stats_lock, key);
+
+	send_per_cmd_stats(PROTO_STATS_ROUND, whackamole.current_round, &stats.round[whackamole.current_round], 0);
+}
+
+// Results from the pads. Results for a challenge that is no longer active, because it was given up
+// on or a new one was started on the pad, are ignored.
+static void challenge_results_process(void)
+{
+	for (int i = 0; i < PERIPHERALS_MAX; i++) {
+		if (atomic_test_and_clear_bit(chg_result_mask, i) && mole[i].active && chg_result[i].chg_id == mole[i].chg_id) {
+			challenge_result(i, chg_result[i].timed_out, chg_result[i].time_ms);
+		}
+	}
+}
+
+// Give up on challenges the pads did not answer in time, or that are on pads that are gone
+static void challenge_watchdog(int64_t now)
+{
+	uint64_t mask = pads_mask();
+
+	for (int i = 0; i < PERIPHERALS_MAX; i++) {
+		if (!mole[i].active) {
+			continue;
+		}
+		if (now >= mole[i].deadline || !(mask & BIT64(i))) {
+			player[0].missing_scores++;
+			challenge_result(i, true, 0);
+		}
+	}
+}
+
+static void pads_resize(void)
+{
+	player[0].per_num = __builtin_popcountll(pads_mask());
+	whackamole.moles_max = MAX(MIN(MOLES_MAX, player[0].per_num), 1);
+}
+
+// Earliest challenge deadline, or INT64_MAX if there are no active challenges
+static int64_t challenge_deadline_next(void)
+{
+	int64_t next = INT64_MAX;
+
+	for (int i = 0; i < PERIPHERALS_MAX; i++) {
+		if (mole[i].active && mole[i].deadline < next) {
+			next = mole[i].deadline;
+		}
+	}
+	return next;
+}
+
+static void round_finish(void)
+{
+	for (int i = 0; i < PERIPHERALS_MAX; i++) {
+		if (stats.pad[i].count > 0 || stats.pad_fouls[i] > 0) {
+			send_per_cmd_stats(PROTO_STATS_PAD, i, &stats.pad[i], stats.pad_fouls[i]);
+		}
+	}
+	send_per_cmd_stats(PROTO_STATS_GAME, 0, &stats.game, player[0].fouls);
+	send_per_cmd_flush();
+}
+
+static void game_finish(void)
+{
+	const struct game_stats_t *s = &stats.game;
+	uint32_t min = (s->count > 0) ? s->min_ms : 0;
+
+	whackamole.game_running = false;
+	// Fouls on pads that got no result after them
+	fouls_charge(fouls_take(-1));
+
+	// Print an end of round report
+	console_ui_game_finish(s->count, player[0].score, min, s->max_ms, game_stats_mean(s),
+			       game_stats_percentile(s, 50), game_stats_percentile(s, 90));
+
+	send_per_cmd_game_finish(player[0].score, min, s->max_ms, game_stats_mean(s));
+	whackamole.status = PROTO_GAME_FINISHED;
+	send_per_cmd_snapshot();
+	send_per_cmd_flush();
+	log_event(PROTO_LOG_REC_GAME_FINISH, 0, 0, (uint16_t)player[0].score, player[0].fouls, 0);
+
+	if (s->count > 0) {
+		int rank = game_hiscore_submit(player[0].score, min, game_stats_mean(s));
+		if (rank >= 0) {
+			console_ui_hiscore(rank, player[0].score);
+		}
+	}
+
+	// Last, since the idle phase reports the end of game stats, which have to include this game
+	set_phase(GAME_PHASE_IDLE);
+	game_wait_players_enter();
+}
+
+static void game_step(atomic_val_t events, bool expired, int64_t now)
+{
+	switch (whackamole.state) {
+		case GAME_STATE_WAIT_PLAYERS:
+			if (events & GAME_EVT_NUM_PLAYERS) {
+				console_ui_players(atomic_get(&num_players));
+				send_per_cmd_num_con_change(atomic_get(&num_players));
+				send_per_cmd_snapshot();
+			}
+			if ((events & GAME_EVT_PING) && atomic_get(&num_players) >= 1) {
+				game_start();
+			}
+			break;
+
+		case GAME_STATE_STARTING:
+			if (expired) {
+				whackamole.game_running = true;
+				round_intro_enter(now);
+			}
+			break;
+
+		case GAME_STATE_ROUND_INTRO:
+			if (expired) {
+				round_start(now);
+			}
+			break;
+
+		case GAME_STATE_ROUND_RUN:
+			if (events & GAME_EVT_RESULT) {
+				challenge_results_process();
+			}
+			if (events & GAME_EVT_NUM_PLAYERS) {
+				pads_resize();
+			}
+			challenge_watchdog(now);
+			if (expired) {
+				whackamole.challenge_due = true;
+			}
+			if (whackamole.challenge_due && whackamole.moles_active < whackamole.moles_max) {
+				challenge_start(now);
+			}
+			if (whackamole.challenge_index >= whackamole.challenges_pr_round && whackamole.moles_active == 0) {
+				round_finish();
+				if (whackamole.current_round + 1 < MAX_ROUNDS) {
+					round_intro_enter(now);
+				}
+				else {
+					game_finish();
 				}
-				// Clear the challenge peripheral index to avoid double presses giving double points
-				player[0].chg_per_index = -1;
-            }
-			else if (memcmp(bt_evt->data, "TO", 2) == 0) {
-				// Challenge timed out
-				int pad_spaces_to_print = CONSOLE_SCORE_PROGRESS_COL - console_print_progress;
-				console_print_progress = -1;
-				challenge_pending = false;
-				challenge_finalize(0, whackamole.target_pr_round[whackamole.current_round], false, pad_spaces_to_print);
 			}
-            k_sem_give(&m_sem_peripheral_update);
-            break;
-    }
+			break;
+	}
 }
 
-#define TICKS_PR_SEC 20
-#define TIMEOUT_BUFFER_MS 300
-
 static void whackamole_play(struct game_t *game)
 {
 	k_msleep(1000);
-    
-	printk("Welcome to Whack-A-Mole! The most exiting Bluetooth game in the world!!!\n");
-    printk("Waiting for peripherals to connect...\n");
-    
+
+	console_ui_text("Welcome to Whack-A-Mole! The most exiting Bluetooth game in the world!!!\n");
+	console_ui_text("Waiting for peripherals to connect...\n");
+
 	whackamole.target_pr_round[0] = 1200;
 	whackamole.target_pr_round[1] = 1000;
 	whackamole.target_pr_round[2] = 800;
 	whackamole.target_pr_round[3] = 600;
 	whackamole.target_pr_round[4] = 400;
 	whackamole.target_pr_round[5] = 300;
-    whackamole.round_duration_s = 20 * TICKS_PR_SEC;
-    whackamole.time = 0;
-    whackamole.challenge_int_min = 2 * TICKS_PR_SEC;
-    whackamole.challenge_int_range = 3 * TICKS_PR_SEC / 2;
-	whackamole.challenges_pr_round = 10;
-    whackamole.chg_rsp_total = whackamole.chg_rsp_counter = 0;
+	whackamole.challenge_int_range_ms = 1500;
 	whackamole.game_running = false;
+	whackamole.status = PROTO_GAME_IDLE;
+	whackamole.state = GAME_STATE_WAIT_PLAYERS;
+	whackamole.deadline_set = false;
 
+	// Sleep until the next deadline or an event, whichever comes first
 	while (1) {
-		// Waiting for players to connect
-		ping_received = false;
-		while (num_players < 1 || !ping_received) {
-			if (k_sem_take(&m_sem_num_players_update, K_MSEC(100)) == 0) {
-				printk("\rControllers connected: %i   ", num_players);
-				send_per_cmd_num_con_change(num_players);	
-			}
+		int64_t wake_at = challenge_deadline_next();
+		if (whackamole.deadline_set) {
+			wake_at = MIN(wake_at, whackamole.deadline);
 		}
+		k_sem_take(&m_sem_game_wake, (wake_at == INT64_MAX) ? K_FOREVER : K_TIMEOUT_ABS_TICKS(wake_at));
 
-		player[0].per_num = num_players;
-		player[0].score = 0;
-		player[0].missing_scores = 0;
-		player[0].fouls = 0;
-		player[0].chg_per_index = -1;
-
-		// Use the uptime to provide a semi random seed to the random generator
-		srand(k_uptime_get_32());
-
-		printk("\n\nStarting new game\n");
-		for(int i = 0; i < player[0].per_num; i++) {
-			game->bt_send(i, "RST", 3);
-		}
-		send_per_cmd_game_start();
-
-		k_msleep(1000);
-
-		whackamole.game_running = true;
-
-		// Starting first round
-		k_timer_start(&m_timer_game, K_MSEC(1000 / TICKS_PR_SEC), K_MSEC(1000 / TICKS_PR_SEC));
-
-		for(whackamole.current_round = 0; whackamole.current_round < MAX_ROUNDS; whackamole.current_round++) {
-			uint32_t target_time = whackamole.target_pr_round[whackamole.current_round];
-			k_msleep(750);
-			
-			printk("\nRound %i starting... Respond quicker than %i ms!\n", (whackamole.current_round + 1), target_time);
-			send_color_effect(PER_INDEX_ALL, '0', &led_effect_new_round, 0);
-			send_per_cmd_round_start(whackamole.current_round, MAX_ROUNDS, target_time);
-
-			console_print_goal_line_index = (target_time / 50) + 2;
-			for (int i = 0; i < (console_print_goal_line_index - 1); i++) printk(" ");
-			printk("|\n");
-
-			k_msleep(750);
-			
-			whackamole.time = 0;
-			whackamole.time_until_challenge = 20;
-			whackamole.challenge_index = 0;
-			do {			
-				k_sem_take(&m_sem_second_tick, K_FOREVER);
-				if (whackamole.time >= whackamole.time_until_challenge) {	
-					// Start a new challenge
-					int random_peripheral_index = rand() % player[0].per_num;
-					player[0].chg_per_index_previous = player[0].chg_per_index;
-					player[0].chg_per_index = random_peripheral_index;
-					foul_presses = 0;
-					challenge_pending = true;
-					send_color_effect(random_peripheral_index, '2', &led_effect_challenge, target_time + TIMEOUT_BUFFER_MS);
-					console_print_progress = true;
-					whackamole.time_until_challenge = whackamole.time + (target_time + 200) / TICKS_PR_SEC + rand() % whackamole.challenge_int_range;
-					send_per_cmd_chg_start(random_peripheral_index, target_time);
-					whackamole.challenge_index++;
-				}
-			} while(whackamole.challenge_index < whackamole.challenges_pr_round || challenge_pending);
+		atomic_val_t events = atomic_clear(&game_events);
+		int64_t now = k_uptime_ticks();
+		bool expired = whackamole.deadline_set && now >= whackamole.deadline;
+		if (expired) {
+			whackamole.deadline_set = false;
 		}
-
-		// Print an end of round report
-		printk("Game complete!\n");
-		k_timer_stop(&m_timer_game);
-		whackamole.game_running = false;
-
-		int result, min = 1000000000, max = 0, total = 0;
-		if (player[0].challenge_counter > 0) {
-			printk("\nResults: \n");
-			for (int i = 0; i < player[0].challenge_counter; i++) {
-				result = player[0].challenge_response_time_list[i];
-				//printk("  Challenge %i: Time %i ms\n", (i+1), result);
-				if (result < min) min = result;
-				if (result > max) max = result;
-				total += result; 
-			}
-			printk("  Total score:  %i points\n", player[0].score);
-			printk("  Best result:  %i ms\n", min);
-			printk("  Worst result: %i ms\n", max);
-			player[0].challenge_average = total / player[0].challenge_counter;
-			printk("  Average:      %i ms\n", player[0].challenge_average);
-		}
-		
-		send_per_cmd_game_finish(player[0].score, min, max, player[0].challenge_average);
-
-		printk("\nPress any button to start a new game\n");
+		game_step(events, expired, now);
 	}
-
 }
 
-void game_timer_func(struct k_timer *timer_id)
+int whackamole_stats_get(enum proto_stats_scope_t scope, uint32_t index, struct game_stats_t *out)
 {
-    whackamole.time++;
-    k_sem_give(&m_sem_second_tick);
-	if(console_print_progress >= 0) {
-		(console_print_progress == console_print_goal_line_index) ? printk("|") : printk("-");
-		console_print_progress++;
+	const struct game_stats_t *src;
+
+	switch (scope) {
+		case PROTO_STATS_GAME:
+			src = &stats.game;
+			break;
+		case PROTO_STATS_ROUND:
+			src = (index < MAX_ROUNDS) ? &stats.round[index] : NULL;
+			break;
+		case PROTO_STATS_PAD:
+			src = (index < PERIPHERALS_MAX) ? &stats.pad[index] : NULL;
+			break;
+		default:
+			src = NULL;
+			break;
 	}
+	if (!src) {
+		return -EINVAL;
+	}
+	k_spinlock_key_t key = k_spin_lock(&stats_lock);
+	*out = *src;
+	k_spin_unlock(&stats_lock, key);
+	return 0;
 }
 
 int whackamole_init(struct game_t *game)
@@ -387,7 +777,7 @@ int whackamole_init(struct game_t *game)
 	this = game;
     game->play = whackamole_play;
     game->bt_rx = whackamole_bt_rx;
-    num_players = 0;
+    atomic_set(&num_players, 0);
 
     return 0;
-}
\ No newline at end of file
+}
@@ -7,13 +7,89 @@
  */
 
 #include <stdint.h>
+#include <string.h>
 #include <app_bt.h>
 #include <app_bt_ctrl.h>
+#include <app_bt_fed.h>
+#include <app_bt_health.h>
+#include <app_bt_pawr.h>
+#include <app_bt_spectator.h>
+#include <console_ui.h>
+#include <game_hiscore.h>
+#include <game_log.h>
 #include <dk_buttons_and_leds.h>
 #include <game_whackamole.h>
+#include <game_fed_satellite.h>
 
 static struct game_t mygame;
 
+/* Game events are queued by the Bluetooth threads and handled by the game event thread, so a slow
+ * console or a full TX queue in the game never holds up Bluetooth reception. The RX payload is
+ * copied into the queue entry, as the NUS client only lends it for the duration of the callback. */
+#define GAME_EVT_DATA_MAX	CONFIG_APP_GAME_EVT_DATA_MAX
+#define GAME_EVT_STACK_SIZE	2048
+#define GAME_EVT_PRIORITY	5
+
+struct game_evt_t {
+	struct app_bt_evt_t evt;
+	uint8_t data[GAME_EVT_DATA_MAX];
+};
+
+K_MSGQ_DEFINE(m_game_evt_queue, sizeof(struct game_evt_t), CONFIG_APP_GAME_EVT_QUEUE_LEN, 4);
+
+static atomic_t game_evt_dropped;
+static atomic_t game_evt_high_water;
+
+static void game_evt_put(const struct app_bt_evt_t *event)
+{
+	struct game_evt_t entry;
+	uint32_t used;
+
+	entry.evt = *event;
+	if (event->type == APP_BT_EVT_RX_DATA) {
+		if (event->data_len > GAME_EVT_DATA_MAX) {
+			atomic_inc(&game_evt_dropped);
+			return;
+		}
+		memcpy(entry.data, event->data, event->data_len);
+	}
+	if (k_msgq_put(&m_game_evt_queue, &entry, K_NO_WAIT) != 0) {
+		atomic_inc(&game_evt_dropped);
+		return;
+	}
+
+	used = k_msgq_num_used_get(&m_game_evt_queue);
+	atomic_val_t high_water = atomic_get(&game_evt_high_water);
+	while (used > high_water && !atomic_cas(&game_evt_high_water, high_water, used)) {
+		high_water = atomic_get(&game_evt_high_water);
+	}
+}
+
+static void game_evt_thread(void *p1, void *p2, void *p3)
+{
+	struct game_evt_t entry;
+	atomic_val_t dropped_reported = 0, high_water_reported = 0;
+
+	while (1) {
+		k_msgq_get(&m_game_evt_queue, &entry, K_FOREVER);
+		entry.evt.data = entry.data;
+		mygame.bt_rx(&mygame, &entry.evt);
+
+		// Reported from here rather than from the producers, to keep the Bluetooth threads short
+		atomic_val_t dropped = atomic_get(&game_evt_dropped);
+		atomic_val_t high_water = atomic_get(&game_evt_high_water);
+		if (dropped != dropped_reported || high_water != high_water_reported) {
+			printk("Game event queue: high water %i of %i, dropped %i\n", (int)high_water,
+			       CONFIG_APP_GAME_EVT_QUEUE_LEN, (int)dropped);
+			dropped_reported = dropped;
+			high_water_reported = high_water;
+		}
+	}
+}
+
+K_THREAD_DEFINE(m_game_evt_thread, GAME_EVT_STACK_SIZE, game_evt_thread, NULL, NULL, NULL,
+		GAME_EVT_PRIORITY, 0, SYS_FOREVER_MS);
+
 static void button_changed(uint32_t button_state, uint32_t has_changed)
 {
 	uint32_t changed_and_pressed = button_state & has_changed;
@@ -26,17 +102,49 @@ static void button_changed(uint32_t button_state, uint32_t has_changed)
 
 void on_app_bt_ctrl_event(struct app_bt_ctrl_evt_t *event)
 {
+	union proto_msg_t msg;
+	uint8_t type;
 
+#if defined(CONFIG_APP_FED_SATELLITE)
+	// The control link is the uplink to the master
+	if (event->type == APP_BT_CTRL_EVT_RX_DATA) {
+		fed_satellite_uplink_rx(event->data, event->data_len);
+	}
+	else if (event->type == APP_BT_CTRL_EVT_SUBSCRIBED) {
+		fed_satellite_uplink_ready();
+	}
+	return;
+#endif
+	if (event->type != APP_BT_CTRL_EVT_RX_DATA ||
+	    proto_decode(event->data, event->data_len, &type, &msg) != 0) {
+		return;
+	}
+	if (type == PROTO_MSG_LOG_EXPORT) {
+		game_log_export_request(msg.log_export.from_seq);
+	}
+	else if (type == PROTO_MSG_LINK_HEALTH_REQ) {
+		app_bt_health_report_request(msg.link_health_req.subscribe);
+	}
 }
 
+#if defined(CONFIG_APP_FED_MASTER)
+// Events of the direct pads and the satellite pads, in the global pad index space
+void on_app_bt_fed_event(struct app_bt_evt_t *event)
+{
+	game_evt_put(event);
+}
+#endif
+
 void on_app_bt_event(struct app_bt_evt_t *event)
 {
 	switch(event->type) {
 		case APP_BT_EVT_CON_NUM_CHANGE:
-			mygame.bt_rx(&mygame, event);
-			break; 
 		case APP_BT_EVT_RX_DATA:
-			mygame.bt_rx(&mygame, event);
+#if defined(CONFIG_APP_FED_MASTER)
+			app_bt_fed_evt(event);
+#else
+			game_evt_put(event);
+#endif
 			break;
 		case APP_BT_EVT_CTRL_CONNECTED:
 			app_bt_ctrl_connected(event->ctrl_conn);
@@ -47,9 +155,35 @@ void on_app_bt_event(struct app_bt_evt_t *event)
 	}
 }
 
-void on_game_bt_ctrl_send(const uint8_t *data, uint16_t len)
+void on_game_bt_ctrl_send(uint8_t type, const void *msg)
+{
+	if (type == PROTO_MSG_SNAPSHOT) {
+		app_bt_spectator_update(msg);
+	}
+	app_bt_ctrl_send_msg(type, msg);
+}
+
+static enum app_bt_tx_prio_t game_cmd_prio(const uint8_t *data, uint16_t len)
+{
+	union proto_msg_t msg;
+	uint8_t type;
+
+	// Plain LED effects are cosmetic, and can be delayed or replaced by a newer effect
+	if (proto_type_peek(data, len) == PROTO_MSG_LED && proto_decode(data, len, &type, &msg) == 0 &&
+	    msg.led.trial == PROTO_TRIAL_NONE) {
+		return APP_BT_TX_PRIO_EFFECT;
+	}
+	return APP_BT_TX_PRIO_CMD;
+}
+
+void on_game_bt_send_multi(uint64_t con_mask, const uint8_t *data, uint16_t len)
 {
-	app_bt_ctrl_send_str(data, len);
+#if defined(CONFIG_APP_FED_MASTER)
+	app_bt_fed_send_multi(con_mask, data, len, game_cmd_prio(data, len));
+#else
+	// Connected pads have a con_index below CONFIG_BT_MAX_CONN
+	app_bt_send_multi((uint32_t)con_mask, data, len, game_cmd_prio(data, len), NULL);
+#endif
 }
 
 void on_game_bt_send(uint32_t con_index, const uint8_t *data, uint16_t len)
@@ -62,9 +196,104 @@ void on_game_bt_send(uint32_t con_index, const uint8_t *data, uint16_t len)
 	} 
 	printk("\n");
 #endif
-	app_bt_send_str(con_index, data, len);
+#if defined(CONFIG_APP_FED_MASTER)
+	app_bt_fed_send(con_index, data, len, game_cmd_prio(data, len));
+#else
+	app_bt_send_prio(con_index, data, len, game_cmd_prio(data, len));
+#endif
 }
 
+static struct {
+	uint32_t count;
+	uint32_t late_max_us;
+	uint64_t late_total_us;
+} m_sched_jitter;
+
+void on_game_sched_jitter(uint32_t round, uint32_t challenge, uint32_t late_us)
+{
+	m_sched_jitter.count++;
+	m_sched_jitter.late_total_us += late_us;
+	if (late_us > m_sched_jitter.late_max_us) {
+		m_sched_jitter.late_max_us = late_us;
+	}
+}
+
+void on_game_phase(enum game_phase_t phase)
+{
+#if !defined(CONFIG_APP_BT_PAWR)
+	app_bt_conn_mode_set(phase == GAME_PHASE_ACTIVE ? APP_BT_CONN_MODE_ACTIVE : APP_BT_CONN_MODE_IDLE);
+#endif
+	if (phase == GAME_PHASE_ACTIVE) {
+		memset(&m_sched_jitter, 0, sizeof(m_sched_jitter));
+	}
+	else {
+		struct console_ui_stats_t ui_stats;
+		console_ui_stats_get(&ui_stats);
+		if (m_sched_jitter.count > 0) {
+			printk("Challenge scheduling: %i challenges, late by avg %i us, max %i us\n", m_sched_jitter.count,
+			       (uint32_t)(m_sched_jitter.late_total_us / m_sched_jitter.count), m_sched_jitter.late_max_us);
+		}
+		printk("Console: %i lines, longest %i us, %i events dropped\n", ui_stats.rendered,
+		       ui_stats.render_max_us, ui_stats.dropped);
+
+#if !defined(CONFIG_APP_BT_PAWR)
+		struct app_bt_airtime_stats_t air;
+		app_bt_airtime_stats_get(&air);
+		printk("On air: %i LED commands avg %i us (%i us on 1M/27 B), %i results avg %i us (%i us on 1M/27 B)\n",
+		       air.led_count, air.led_avg_us, air.led_avg_us_base, air.td_count, air.td_avg_us,
+		       air.td_avg_us_base);
+#endif
+
+		// The write of this game may still be running, the high score module reports it when it is done
+		struct game_hiscore_stats_t hs_stats;
+		game_hiscore_stats_get(&hs_stats);
+		printk("High scores: %i games, %i written, %i skipped, %i B payload, %i B flash, write avg %i us, max %i us\n",
+		       hs_stats.submitted, hs_stats.writes, hs_stats.skipped, hs_stats.bytes_payload,
+		       hs_stats.bytes_flash, hs_stats.write_avg_us, hs_stats.write_max_us);
+
+		struct app_bt_ctrl_tx_stats_t ctrl_stats;
+		app_bt_ctrl_tx_stats_get(&ctrl_stats);
+		printk("Ctrl link: %i frames in %i notifications, %i B, flushed %i full, %i deadline, %i round end\n",
+		       ctrl_stats.frames, ctrl_stats.notifications, ctrl_stats.bytes, ctrl_stats.flush_full,
+		       ctrl_stats.flush_deadline, ctrl_stats.flush_explicit);
+		if (ctrl_stats.catchups > 0) {
+			printk("Ctrl link: %i catch-ups, %i updates replayed, %i lost\n", ctrl_stats.catchups,
+			       ctrl_stats.replayed, ctrl_stats.replay_lost);
+		}
+
+		struct game_log_stats_t log_stats;
+		game_log_stats_get(&log_stats);
+		printk("Game log: %i records appended, %i dropped, %i stored, %i erases\n", log_stats.appended,
+		       log_stats.dropped, log_stats.next_seq - log_stats.first_seq, log_stats.erases);
+
+#if defined(CONFIG_APP_FED_MASTER)
+		// The relayed commands reach the satellite pads this much later, out of the lead time of the effects
+		for (int i = 0; i < CONFIG_APP_FED_SATELLITES_MAX; i++) {
+			struct app_bt_fed_sat_stats_t fed_stats;
+			if (app_bt_fed_sat_stats_get(i, &fed_stats) == 0) {
+				printk("Satellite %i (link %i): %i pads, %i commands sent, %i relayed, %i results, "
+				       "hop avg %i us, max %i us, budget %i us%s\n", i, fed_stats.con_index,
+				       fed_stats.num_pads, fed_stats.sent, fed_stats.relayed, fed_stats.rx,
+				       fed_stats.hop_avg_us, fed_stats.hop_max_us, CONFIG_APP_FED_HOP_BUDGET_US,
+				       fed_stats.hop_max_us > CONFIG_APP_FED_HOP_BUDGET_US ? ", OVER BUDGET" : "");
+			}
+		}
+#endif
+	}
+}
+
+#if defined(CONFIG_APP_BT_PAWR)
+void on_game_bt_send_pawr(uint32_t con_index, const uint8_t *data, uint16_t len)
+{
+	app_bt_pawr_send_str(con_index, data, len);
+}
+
+void on_game_bt_send_multi_pawr(uint64_t con_mask, const uint8_t *data, uint16_t len)
+{
+	app_bt_pawr_send_multi(con_mask, data, len);
+}
+#endif
+
 void main(void)
 {
 	int ret;
@@ -75,21 +304,58 @@ void main(void)
 		return;
 	}
 
+#if defined(CONFIG_APP_BT_PAWR)
+	ret = app_bt_pawr_init(on_app_bt_event);
+#else
 	ret = app_bt_init(on_app_bt_event);
+#endif
 	if (ret < 0) {
 		printk("BT init failed!\n");
 		return;
 	}
 
+#if defined(CONFIG_APP_FED_MASTER)
+	app_bt_fed_init(on_app_bt_fed_event);
+#endif
+
 	ret = app_bt_ctrl_init(on_app_bt_ctrl_event);
 	if (ret < 0) {
 		printk("BT Peripheral init failed!\n");
 		return;
 	}
 
+	ret = app_bt_spectator_init();
+	if (ret < 0) {
+		printk("Spectator broadcast init failed (err %d)\n", ret);
+	}
+
+	ret = game_hiscore_init();
+	if (ret < 0) {
+		printk("High score init failed (err %d)\n", ret);
+	}
+
+	ret = game_log_init();
+	if (ret < 0) {
+		printk("Game log init failed (err %d)\n", ret);
+	}
+
+#if defined(CONFIG_APP_BT_PAWR)
+	mygame.bt_send = on_game_bt_send_pawr;
+	mygame.bt_send_multi = on_game_bt_send_multi_pawr;
+#else
 	mygame.bt_send = on_game_bt_send;
+	mygame.bt_send_multi = on_game_bt_send_multi;
+#endif
+	mygame.phase = on_game_phase;
+	mygame.sched_jitter = on_game_sched_jitter;
 	mygame.bt_ctrl_send = on_game_bt_ctrl_send;
+	mygame.bt_ctrl_flush = app_bt_ctrl_flush;
+#if defined(CONFIG_APP_FED_SATELLITE)
+	fed_satellite_init(&mygame);
+#else
 	whackamole_init(&mygame);
+#endif
+	k_thread_start(m_game_evt_thread);
 
 	mygame.play(&mygame);
 }
@@ -0,0 +1,136 @@
+#!/usr/bin/env bash
+# SPDX-License-Identifier: Apache-2.0
+#
+# BabbleSim scenario of the federated mode with three centrals: a master and two satellites, with
+# the pads all on the satellites, so every command and result takes the extra hop.
+#
+# The satellites and the pads start first, and the master 5 s later, so the satellites have taken
+# the pads by the time the master scans. The pads press their button on a fixed cadence from 8 s
+# on, which starts a game and answers the challenges. At the end of the game the master prints the
+# latency budget report of each satellite, and the scenario passes if:
+#   - both satellites are reported, with all the pads between them
+#   - the commands were relayed to, and results came back from, every satellite with pads
+#   - no hop went over CONFIG_APP_FED_HOP_BUDGET_US
+#
+# Needs ZEPHYR_BASE, BSIM_OUT_PATH and BSIM_COMPONENTS_PATH set up as for the Zephyr BabbleSim tests.
+# Run from anywhere: central/tests/bsim/fed_3_centrals.sh [-n] (-n skips the build)
+
+set -eu
+
+: "${ZEPHYR_BASE:?ZEPHYR_BASE must be set}"
+: "${BSIM_OUT_PATH:?BSIM_OUT_PATH must be set}"
+
+REPO_DIR=$(cd "$(dirname "$0")/../../.." && pwd)
+BOARD=nrf52_bsim
+SIM_ID=whackamole_fed_3_centrals
+PADS=6
+SIM_LENGTH_US=$((150 * 1000000))
+MASTER_START_OFFSET_US=$((5 * 1000000))
+# The pad button is button0 of the board, P0.11, active low
+BUTTON_PORT=0
+BUTTON_PIN=11
+PRESS_START_US=$((8 * 1000000))
+PRESS_PERIOD_US=150000
+PRESS_LEN_US=30000
+
+WORK_DIR=${WORK_DIR:-${REPO_DIR}/build-bsim/${SIM_ID}}
+BIN_DIR=${WORK_DIR}/bin
+LOG_DIR=${WORK_DIR}/log
+mkdir -p "${BIN_DIR}" "${LOG_DIR}"
+
+build()
+{
+	local app=$1 name=$2 overlay=${3:-}
+
+	west build -p auto -b ${BOARD} -d "${WORK_DIR}/build_${name}" "${REPO_DIR}/${app}" -- \
+		${overlay:+-DOVERLAY_CONFIG=${overlay}}
+	cp "${WORK_DIR}/build_${name}/zephyr/zephyr.exe" "${BIN_DIR}/${name}.exe"
+}
+
+if [ "${1:-}" != "-n" ]; then
+	build central master overlay-fed-master.conf
+	build central satellite overlay-fed-satellite.conf
+	build peripheral pad
+fi
+
+# Button presses of one pad, offset per pad so they do not all land in the same connection event
+press_file()
+{
+	awk -v start=$((PRESS_START_US + $1 * 17000)) -v end=${SIM_LENGTH_US} -v period=${PRESS_PERIOD_US} \
+	    -v len=${PRESS_LEN_US} -v port=${BUTTON_PORT} -v pin=${BUTTON_PIN} 'BEGIN {
+		for (t = start; t + len < end; t += period) {
+			printf "%d %d %d 0\n%d %d %d 1\n", t, port, pin, t + len, port, pin
+		}
+	}' > "${WORK_DIR}/pad_$1.gpio"
+}
+
+pids=()
+run()
+{
+	local exe=$1 dev=$2
+	shift 2
+
+	"${BIN_DIR}/${exe}.exe" -s=${SIM_ID} -d=${dev} "$@" > "${LOG_DIR}/d_${dev}_${exe}.log" 2>&1 &
+	pids+=($!)
+}
+
+run master 0 -start_offset=${MASTER_START_OFFSET_US}
+run satellite 1
+run satellite 2
+for i in $(seq 0 $((PADS - 1))); do
+	press_file ${i}
+	run pad $((3 + i)) -gpio_in_file="${WORK_DIR}/pad_${i}.gpio"
+done
+
+cd "${BSIM_OUT_PATH}/bin"
+./bs_2G4_phy_v1 -s=${SIM_ID} -D=$((3 + PADS)) -sim_length=${SIM_LENGTH_US} > "${LOG_DIR}/phy.log" 2>&1 &
+pids+=($!)
+
+status=0
+for pid in "${pids[@]}"; do
+	wait ${pid} || status=1
+done
+if [ ${status} -ne 0 ]; then
+	echo "FAIL: a simulated device exited with an error, see ${LOG_DIR}"
+	exit 1
+fi
+
+# The last report of each satellite, from the last game played
+awk -v pads=${PADS} '
+	match($0, /Satellite [0-9]+ \(link [0-9]+\): .*/) {
+		line = substr($0, RSTART, RLENGTH)
+		split(line, f, /[ ,():]+/)
+		sat = f[2]
+		report[sat] = line
+		num_pads[sat] = f[5]; relayed[sat] = f[10]; results[sat] = f[12]
+		over[sat] = (line ~ /OVER BUDGET/)
+	}
+	END {
+		fail = 0
+		total = 0
+		for (s = 0; s < 2; s++) {
+			if (!(s in report)) {
+				print "FAIL: no report of satellite " s
+				fail = 1
+				continue
+			}
+			print report[s]
+			total += num_pads[s]
+			if (num_pads[s] > 0 && (relayed[s] == 0 || results[s] == 0)) {
+				print "FAIL: nothing relayed through satellite " s
+				fail = 1
+			}
+			if (over[s]) {
+				print "FAIL: satellite " s " over the hop latency budget"
+				fail = 1
+			}
+		}
+		if (total != pads) {
+			print "FAIL: " total " pads on the satellites, expected " pads
+			fail = 1
+		}
+		if (!fail) {
+			print "PASS"
+		}
+		exit fail
+	}' "${LOG_DIR}/d_0_master.log"
@@ -0,0 +1,44 @@
+#ifndef __PAWR_PROTO_H
+#define __PAWR_PROTO_H
+
+#include <proto.h>
+
+/* Framing shared by the central and the peripherals when running over
+ * Periodic Advertising with Responses instead of connections.
+ *
+ * Every pad owns one response slot in one subevent. The last slot of subevent 0
+ * is shared by pads that have not been given an index yet.
+ */
+
+#define PAWR_ADV_NAME		"Whack-A-Mole PAwR"
+
+#define PAWR_NUM_SUBEVENTS	5
+#define PAWR_NUM_RSP_SLOTS	11
+#define PAWR_JOIN_SUBEVENT	0
+#define PAWR_JOIN_SLOT		(PAWR_NUM_RSP_SLOTS - 1)
+#define PAWR_PAD_MAX		(PAWR_NUM_SUBEVENTS * (PAWR_NUM_RSP_SLOTS - 1))
+
+#define PAWR_PAD_SUBEVENT(index) ((index) % PAWR_NUM_SUBEVENTS)
+#define PAWR_PAD_SLOT(index)	 ((index) / PAWR_NUM_SUBEVENTS)
+
+/* Subevent data is a list of records: [pad index] [cmd seq] [rsp ack] [len] [data...]
+ * A pad executes a command once per new cmd seq, and repeats its own response until
+ * the central echoes the response seq in rsp ack. */
+#define PAWR_REC_HDR_LEN	4
+#define PAWR_REC_DATA_MAX	PROTO_FRAME_MAX
+
+/* Multicast record, executed by every pad once per cmd seq */
+#define PAWR_INDEX_ALL		0xFF
+/* Index assignment record, with data [address type] [address (6)] [pad index] */
+#define PAWR_INDEX_ASSIGN	0xFE
+#define PAWR_ASSIGN_LEN		8
+
+/* Response data: [cmd ack] [rsp seq] [data...]. An empty data field is a keepalive.
+ * In the join slot the response is [address type] [address (6)] */
+#define PAWR_RSP_HDR_LEN	2
+#define PAWR_JOIN_LEN		7
+
+/* Seq 0 is never used, so a freshly joined pad does not ack a command it never got */
+#define PAWR_SEQ_NEXT(seq)	((uint8_t)((seq) == 0xFF ? 1 : (seq) + 1))
+
+#endif
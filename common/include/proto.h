@@ -0,0 +1,301 @@
+#ifndef __PROTO_H
+#define __PROTO_H
+
+#include <zephyr/kernel.h>
+#include <color.h>
+
+/* Binary protocol shared by the central, the pads and the control app.
+ *
+ * Frame:  [header] [field]...
+ * Header: version (2 bits, MSB) | message type (6 bits)
+ * Field:  tag (4 bits, MSB) | length (4 bits), followed by the value, little endian
+ *
+ * Every message type has a table of fields, mapping each tag to a struct member. Fields with
+ * the value 0 are not sent, and the decoder clears the message first, so they read back as 0.
+ * Tags the decoder does not know are skipped, so fields can be added without a version bump.
+ *
+ * PROTO_MSG_LOG_DATA is the exception: the header is followed by whole proto_log_rec_t records,
+ * as many as fit the link MTU, so bulk exports are not limited by PROTO_FRAME_MAX.
+ *
+ * On the control link several frames can share a notification. The notification then starts with
+ * a PROTO_MSG_CTRL_BATCH header, followed by each frame prefixed with its length in one byte.
+ *
+ * Between federated centrals PROTO_MSG_FED_CMD and PROTO_MSG_FED_RX wrap a whole pad frame behind
+ * a short fixed header, see proto_fed_cmd_hdr_t and proto_fed_rx_hdr_t.
+ */
+
+#define PROTO_VERSION		1
+#define PROTO_FRAME_MAX		32
+
+#define PROTO_HDR(type)		((PROTO_VERSION << 6) | (type))
+#define PROTO_HDR_VERSION(hdr)	((hdr) >> 6)
+#define PROTO_HDR_TYPE(hdr)	((hdr) & 0x3F)
+
+enum proto_msg_type_t {
+	// Central -> pad
+	PROTO_MSG_LED = 1,
+	PROTO_MSG_RESET,
+	PROTO_MSG_TIMESYNC_REQ,
+	PROTO_MSG_TIMESYNC_OFFSET,
+	// Pad -> central
+	PROTO_MSG_PING = 16,
+	PROTO_MSG_TRIAL_DONE,
+	PROTO_MSG_TRIAL_TIMEOUT,
+	PROTO_MSG_TIMESYNC_RSP,
+	// Central -> control app
+	PROTO_MSG_CHG_START = 32,
+	PROTO_MSG_CHG_FINISH,
+	PROTO_MSG_ROUND_START,
+	PROTO_MSG_GAME_START,
+	PROTO_MSG_GAME_FINISH,
+	PROTO_MSG_NUM_CON,
+	PROTO_MSG_STATS,
+	PROTO_MSG_LOG_DATA,
+	PROTO_MSG_LOG_END,
+	PROTO_MSG_CTRL_BATCH,
+	PROTO_MSG_SNAPSHOT,
+	PROTO_MSG_LINK_HEALTH,
+	// Control app -> central
+	PROTO_MSG_LOG_EXPORT = 48,
+	PROTO_MSG_LINK_HEALTH_REQ,
+	// Federation, master <-> satellite central
+	PROTO_MSG_FED_CMD = 56,
+	PROTO_MSG_FED_RX,
+	PROTO_MSG_FED_STATUS,
+};
+
+// Trial started by an LED command
+enum proto_trial_t {PROTO_TRIAL_NONE, PROTO_TRIAL_START, PROTO_TRIAL_START_TIMEOUT};
+
+struct proto_led_t {
+	led_effect_cfg_t effect;
+	uint8_t trial;
+	uint16_t timeout_ms;
+	// Central time to execute the command at, 0 to execute it straight away
+	uint32_t exec_at_us;
+	// Challenge the trial belongs to, echoed in the result so late results can be told apart
+	uint8_t chg_id;
+};
+
+struct proto_timesync_req_t {
+	uint8_t seq;
+};
+
+struct proto_timesync_offset_t {
+	// Pad time minus central time
+	int32_t offset_us;
+};
+
+struct proto_trial_done_t {
+	uint32_t time_us;
+	uint8_t chg_id;
+};
+
+struct proto_trial_timeout_t {
+	uint8_t chg_id;
+};
+
+struct proto_timesync_rsp_t {
+	uint8_t seq;
+	uint32_t t_rx_us;
+};
+
+struct proto_chg_start_t {
+	uint8_t pad;
+	uint8_t num_players;
+	uint16_t target_ms;
+};
+
+struct proto_chg_finish_t {
+	uint8_t pad;
+	uint8_t success;
+	uint16_t time_ms;
+	uint16_t target_ms;
+	uint16_t points;
+	uint16_t fouls;
+};
+
+struct proto_round_start_t {
+	uint8_t round;
+	uint8_t round_total;
+	uint8_t num_players;
+	uint16_t target_ms;
+};
+
+struct proto_game_finish_t {
+	int16_t score;
+	uint16_t min_ms;
+	uint16_t max_ms;
+	uint16_t avg_ms;
+};
+
+struct proto_num_con_t {
+	uint8_t num;
+};
+
+enum proto_stats_scope_t {PROTO_STATS_GAME, PROTO_STATS_ROUND, PROTO_STATS_PAD};
+
+// Reaction time statistics for the game so far, one round or one pad
+struct proto_stats_t {
+	uint8_t scope;
+	uint8_t index;
+	uint16_t count;
+	// Fouls charged to the game or the pad, not counted per round
+	uint16_t fouls;
+	uint16_t min_ms;
+	uint16_t max_ms;
+	uint16_t mean_ms;
+	uint16_t stddev_ms;
+	uint16_t p50_ms;
+	uint16_t p90_ms;
+	uint16_t p99_ms;
+};
+
+enum proto_game_state_t {PROTO_GAME_IDLE, PROTO_GAME_RUNNING, PROTO_GAME_FINISHED};
+
+// State of the game, sent to a reconnecting control app ahead of the updates it missed, and broadcast to spectators
+struct proto_snapshot_t {
+	uint8_t state;
+	uint8_t round;
+	uint8_t round_total;
+	uint8_t num_players;
+	uint16_t target_ms;
+	int16_t score;
+	uint16_t fouls;
+	// Challenges finished in the game so far
+	uint16_t challenges;
+	// Reaction time of the last challenge, 0 if it timed out
+	uint16_t last_ms;
+};
+
+// Game event log record, stored in flash and exported as is in PROTO_MSG_LOG_DATA, little endian
+enum proto_log_rec_type_t {
+	PROTO_LOG_REC_GAME_START = 1,
+	PROTO_LOG_REC_ROUND_START,
+	PROTO_LOG_REC_CHG_HIT,
+	PROTO_LOG_REC_CHG_SLOW,
+	PROTO_LOG_REC_CHG_TIMEOUT,
+	PROTO_LOG_REC_GAME_FINISH,
+};
+
+struct proto_log_rec_t {
+	// Record sequence number, increasing by one per record
+	uint32_t seq;
+	// Central uptime
+	uint32_t t_ms;
+	// Round start: round target. Challenge: challenge target.
+	uint16_t target_ms;
+	// Challenge: response time. Game finish: score, as a signed value.
+	uint16_t value;
+	uint8_t type;
+	// Challenge: pad index. Round start: round index. Game start: number of pads.
+	uint8_t index;
+	uint8_t fouls;
+	int8_t rssi;
+} __packed;
+
+BUILD_ASSERT(sizeof(struct proto_log_rec_t) == 16, "Log records are 16 bytes on the wire and in flash");
+
+// End of a log export
+struct proto_log_end_t {
+	uint32_t count;
+	// Sequence number to continue the next export from
+	uint32_t next_seq;
+};
+
+// Request a log export, starting at the given sequence number or the oldest record still stored
+struct proto_log_export_t {
+	uint32_t from_seq;
+};
+
+enum proto_link_state_t {PROTO_LINK_GOOD, PROTO_LINK_WEAK, PROTO_LINK_BAD};
+
+// Health of a pad link over the last evaluation period
+struct proto_link_health_t {
+	uint8_t pad;
+	uint8_t state;
+	// Averaged RSSI in dBm
+	int8_t rssi;
+	// Mitigation steps applied, see app_bt_health.h
+	uint8_t mitigation;
+	// TX PHY, as BT_GAP_LE_PHY_*
+	uint8_t phy;
+	// TX power of the link in dBm, 0 for the controller default
+	int8_t tx_power;
+	// Connection events missed, packets retransmitted and packets received with a CRC error, per mille
+	uint16_t miss_permille;
+	uint16_t retx_permille;
+	uint16_t crc_permille;
+	// Time from a command being queued to it being transmitted
+	uint32_t tx_latency_avg_us;
+	uint32_t tx_latency_max_us;
+};
+
+// Request the health of all the pad links. With subscribe set, the central also sends it when a link changes state.
+struct proto_link_health_req_t {
+	uint8_t subscribe;
+};
+
+// Master -> satellite: pad frame to send to the satellite pads in pad_mask
+struct proto_fed_cmd_hdr_t {
+	uint8_t hdr;
+	uint8_t pad_mask;
+	// Master time the frame was sent at, little endian, to measure the hop latency
+	uint8_t t_tx_us[4];
+} __packed;
+
+// Satellite -> master: pad frame received from a satellite pad
+struct proto_fed_rx_hdr_t {
+	uint8_t hdr;
+	uint8_t pad;
+	int8_t rssi;
+} __packed;
+
+// Satellite -> master, on pad connection changes and periodically
+struct proto_fed_status_t {
+	uint8_t ready_mask;
+	uint8_t num_pads;
+	// Commands relayed to the pads since the master connected
+	uint32_t relayed;
+	// One way latency of the master to satellite hop
+	uint32_t hop_avg_us;
+	uint32_t hop_max_us;
+};
+
+union proto_msg_t {
+	struct proto_led_t led;
+	struct proto_timesync_req_t timesync_req;
+	struct proto_timesync_offset_t timesync_offset;
+	struct proto_trial_done_t trial_done;
+	struct proto_trial_timeout_t trial_timeout;
+	struct proto_timesync_rsp_t timesync_rsp;
+	struct proto_chg_start_t chg_start;
+	struct proto_chg_finish_t chg_finish;
+	struct proto_round_start_t round_start;
+	struct proto_game_finish_t game_finish;
+	struct proto_num_con_t num_con;
+	struct proto_stats_t stats;
+	struct proto_snapshot_t snapshot;
+	struct proto_log_end_t log_end;
+	struct proto_log_export_t log_export;
+	struct proto_fed_status_t fed_status;
+	struct proto_link_health_t link_health;
+	struct proto_link_health_req_t link_health_req;
+};
+
+// Encode a message. Messages without fields take a NULL msg. Returns the frame length, or a negative error code.
+int proto_encode(uint8_t type, const void *msg, uint8_t *buf, size_t buf_size);
+
+// Decode a frame into msg. Returns 0, -EPROTO on a version mismatch, -ENOMSG for unknown types, or -EBADMSG.
+int proto_decode(const uint8_t *buf, size_t len, uint8_t *type, union proto_msg_t *msg);
+
+// Message type of a frame, without decoding it. Returns 0 if the frame is not of this protocol version.
+static inline uint8_t proto_type_peek(const uint8_t *buf, size_t len)
+{
+	if (len < 1 || PROTO_HDR_VERSION(buf[0]) != PROTO_VERSION) {
+		return 0;
+	}
+	return PROTO_HDR_TYPE(buf[0]);
+}
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef __TIMESYNC_H
+#define __TIMESYNC_H
+
+#include <zephyr/kernel.h>
+
+/* Time sync between the central and the pads.
+ *
+ * The central sends a request, and timestamps it when the stack reports it as
+ * transmitted. The pad timestamps the reception and returns its own time. Both
+ * stamps are taken right after the same connection event, so the difference is the
+ * clock offset plus a small, mostly constant, processing delay. The central takes the
+ * median over a few rounds and sends the offset back to the pad, which tracks the
+ * drift between consecutive offsets and converts central timestamps to its own clock.
+ *
+ * Messages (see proto.h):
+ *   Central -> pad: PROTO_MSG_TIMESYNC_REQ      seq
+ *   Pad -> central: PROTO_MSG_TIMESYNC_RSP      seq, t_rx
+ *   Central -> pad: PROTO_MSG_TIMESYNC_OFFSET   Offset to apply, pad time minus central time
+ */
+
+// Microsecond timestamp used on both sides. Wraps every ~71 minutes, so only compare differences.
+static inline uint32_t timesync_now_us(void)
+{
+	return (uint32_t)k_ticks_to_us_floor64(k_uptime_ticks());
+}
+
+#endif
@@ -0,0 +1,282 @@
+#include <proto.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+
+struct proto_field_t {
+	uint8_t tag;
+	uint8_t wire_size;
+	uint8_t mem_size;
+	uint8_t offset;
+};
+
+struct proto_msg_desc_t {
+	uint8_t type;
+	uint8_t num_fields;
+	const struct proto_field_t *fields;
+};
+
+#define FIELD(tag, wire_size, msg_type, member) \
+	{tag, wire_size, sizeof(((msg_type *)0)->member), offsetof(msg_type, member)}
+
+#define MSG(type, fields) {type, ARRAY_SIZE(fields), fields}
+#define MSG_EMPTY(type)   {type, 0, NULL}
+
+static const struct proto_field_t led_fields[] = {
+	FIELD(1, 1, struct proto_led_t, effect.type),
+	FIELD(2, 3, struct proto_led_t, effect.color1),
+	FIELD(3, 3, struct proto_led_t, effect.color2),
+	FIELD(4, 3, struct proto_led_t, effect.color_end),
+	FIELD(5, 1, struct proto_led_t, effect.speed),
+	FIELD(6, 1, struct proto_led_t, effect.num_repeats),
+	FIELD(7, 1, struct proto_led_t, trial),
+	FIELD(8, 2, struct proto_led_t, timeout_ms),
+	FIELD(9, 4, struct proto_led_t, exec_at_us),
+	FIELD(10, 1, struct proto_led_t, chg_id),
+};
+
+static const struct proto_field_t timesync_req_fields[] = {
+	FIELD(1, 1, struct proto_timesync_req_t, seq),
+};
+
+static const struct proto_field_t timesync_offset_fields[] = {
+	FIELD(1, 4, struct proto_timesync_offset_t, offset_us),
+};
+
+static const struct proto_field_t trial_done_fields[] = {
+	FIELD(1, 4, struct proto_trial_done_t, time_us),
+	FIELD(2, 1, struct proto_trial_done_t, chg_id),
+};
+
+static const struct proto_field_t trial_timeout_fields[] = {
+	FIELD(1, 1, struct proto_trial_timeout_t, chg_id),
+};
+
+static const struct proto_field_t timesync_rsp_fields[] = {
+	FIELD(1, 1, struct proto_timesync_rsp_t, seq),
+	FIELD(2, 4, struct proto_timesync_rsp_t, t_rx_us),
+};
+
+static const struct proto_field_t chg_start_fields[] = {
+	FIELD(1, 1, struct proto_chg_start_t, pad),
+	FIELD(2, 1, struct proto_chg_start_t, num_players),
+	FIELD(3, 2, struct proto_chg_start_t, target_ms),
+};
+
+static const struct proto_field_t chg_finish_fields[] = {
+	FIELD(1, 1, struct proto_chg_finish_t, pad),
+	FIELD(2, 2, struct proto_chg_finish_t, time_ms),
+	FIELD(3, 2, struct proto_chg_finish_t, target_ms),
+	FIELD(4, 1, struct proto_chg_finish_t, success),
+	FIELD(5, 2, struct proto_chg_finish_t, points),
+	FIELD(6, 2, struct proto_chg_finish_t, fouls),
+};
+
+static const struct proto_field_t round_start_fields[] = {
+	FIELD(1, 1, struct proto_round_start_t, round),
+	FIELD(2, 1, struct proto_round_start_t, round_total),
+	FIELD(3, 1, struct proto_round_start_t, num_players),
+	FIELD(4, 2, struct proto_round_start_t, target_ms),
+};
+
+static const struct proto_field_t game_finish_fields[] = {
+	FIELD(1, 2, struct proto_game_finish_t, score),
+	FIELD(2, 2, struct proto_game_finish_t, min_ms),
+	FIELD(3, 2, struct proto_game_finish_t, max_ms),
+	FIELD(4, 2, struct proto_game_finish_t, avg_ms),
+};
+
+static const struct proto_field_t num_con_fields[] = {
+	FIELD(1, 1, struct proto_num_con_t, num),
+};
+
+static const struct proto_field_t stats_fields[] = {
+	FIELD(1, 1, struct proto_stats_t, scope),
+	FIELD(2, 1, struct proto_stats_t, index),
+	FIELD(3, 2, struct proto_stats_t, count),
+	FIELD(4, 2, struct proto_stats_t, min_ms),
+	FIELD(5, 2, struct proto_stats_t, max_ms),
+	FIELD(6, 2, struct proto_stats_t, mean_ms),
+	FIELD(7, 2, struct proto_stats_t, stddev_ms),
+	FIELD(8, 2, struct proto_stats_t, p50_ms),
+	FIELD(9, 2, struct proto_stats_t, p90_ms),
+	FIELD(10, 2, struct proto_stats_t, p99_ms),
+	FIELD(11, 2, struct proto_stats_t, fouls),
+};
+
+static const struct proto_field_t snapshot_fields[] = {
+	FIELD(1, 1, struct proto_snapshot_t, state),
+	FIELD(2, 1, struct proto_snapshot_t, round),
+	FIELD(3, 1, struct proto_snapshot_t, round_total),
+	FIELD(4, 1, struct proto_snapshot_t, num_players),
+	FIELD(5, 2, struct proto_snapshot_t, target_ms),
+	FIELD(6, 2, struct proto_snapshot_t, score),
+	FIELD(7, 2, struct proto_snapshot_t, fouls),
+	FIELD(8, 2, struct proto_snapshot_t, challenges),
+	FIELD(9, 2, struct proto_snapshot_t, last_ms),
+};
+
+static const struct proto_field_t log_end_fields[] = {
+	FIELD(1, 4, struct proto_log_end_t, count),
+	FIELD(2, 4, struct proto_log_end_t, next_seq),
+};
+
+static const struct proto_field_t log_export_fields[] = {
+	FIELD(1, 4, struct proto_log_export_t, from_seq),
+};
+
+static const struct proto_field_t link_health_fields[] = {
+	FIELD(1, 1, struct proto_link_health_t, pad),
+	FIELD(2, 1, struct proto_link_health_t, state),
+	FIELD(3, 1, struct proto_link_health_t, rssi),
+	FIELD(4, 1, struct proto_link_health_t, mitigation),
+	FIELD(5, 1, struct proto_link_health_t, phy),
+	FIELD(6, 1, struct proto_link_health_t, tx_power),
+	FIELD(7, 2, struct proto_link_health_t, miss_permille),
+	FIELD(8, 2, struct proto_link_health_t, retx_permille),
+	FIELD(9, 2, struct proto_link_health_t, crc_permille),
+	FIELD(10, 4, struct proto_link_health_t, tx_latency_avg_us),
+	FIELD(11, 4, struct proto_link_health_t, tx_latency_max_us),
+};
+
+static const struct proto_field_t link_health_req_fields[] = {
+	FIELD(1, 1, struct proto_link_health_req_t, subscribe),
+};
+
+static const struct proto_field_t fed_status_fields[] = {
+	FIELD(1, 1, struct proto_fed_status_t, ready_mask),
+	FIELD(2, 1, struct proto_fed_status_t, num_pads),
+	FIELD(3, 4, struct proto_fed_status_t, relayed),
+	FIELD(4, 4, struct proto_fed_status_t, hop_avg_us),
+	FIELD(5, 4, struct proto_fed_status_t, hop_max_us),
+};
+
+static const struct proto_msg_desc_t msg_desc[] = {
+	MSG(PROTO_MSG_LED, led_fields),
+	MSG_EMPTY(PROTO_MSG_RESET),
+	MSG(PROTO_MSG_TIMESYNC_REQ, timesync_req_fields),
+	MSG(PROTO_MSG_TIMESYNC_OFFSET, timesync_offset_fields),
+	MSG_EMPTY(PROTO_MSG_PING),
+	MSG(PROTO_MSG_TRIAL_DONE, trial_done_fields),
+	MSG(PROTO_MSG_TRIAL_TIMEOUT, trial_timeout_fields),
+	MSG(PROTO_MSG_TIMESYNC_RSP, timesync_rsp_fields),
+	MSG(PROTO_MSG_CHG_START, chg_start_fields),
+	MSG(PROTO_MSG_CHG_FINISH, chg_finish_fields),
+	MSG(PROTO_MSG_ROUND_START, round_start_fields),
+	MSG_EMPTY(PROTO_MSG_GAME_START),
+	MSG(PROTO_MSG_GAME_FINISH, game_finish_fields),
+	MSG(PROTO_MSG_NUM_CON, num_con_fields),
+	MSG(PROTO_MSG_STATS, stats_fields),
+	MSG(PROTO_MSG_SNAPSHOT, snapshot_fields),
+	MSG(PROTO_MSG_LOG_END, log_end_fields),
+	MSG(PROTO_MSG_LINK_HEALTH, link_health_fields),
+	MSG(PROTO_MSG_LOG_EXPORT, log_export_fields),
+	MSG(PROTO_MSG_LINK_HEALTH_REQ, link_health_req_fields),
+	MSG(PROTO_MSG_FED_STATUS, fed_status_fields),
+};
+
+static const struct proto_msg_desc_t *msg_desc_find(uint8_t type)
+{
+	for (int i = 0; i < ARRAY_SIZE(msg_desc); i++) {
+		if (msg_desc[i].type == type) {
+			return &msg_desc[i];
+		}
+	}
+	return NULL;
+}
+
+// Members are read and written through their own size, the wire size can be smaller (ie. 24 bit colors)
+static uint32_t member_get(const void *msg, const struct proto_field_t *field)
+{
+	const uint8_t *p = (const uint8_t *)msg + field->offset;
+	switch (field->mem_size) {
+		case 1: return *p;
+		case 2: return *(const uint16_t *)p;
+		default: return *(const uint32_t *)p;
+	}
+}
+
+static void member_set(void *msg, const struct proto_field_t *field, uint32_t value)
+{
+	uint8_t *p = (uint8_t *)msg + field->offset;
+	switch (field->mem_size) {
+		case 1: *p = (uint8_t)value; break;
+		case 2: *(uint16_t *)p = (uint16_t)value; break;
+		default: *(uint32_t *)p = value; break;
+	}
+}
+
+int proto_encode(uint8_t type, const void *msg, uint8_t *buf, size_t buf_size)
+{
+	const struct proto_msg_desc_t *desc = msg_desc_find(type);
+	size_t len = 0;
+
+	if (!desc) {
+		return -ENOMSG;
+	}
+	if (buf_size < 1) {
+		return -ENOMEM;
+	}
+	buf[len++] = PROTO_HDR(type);
+
+	for (int i = 0; i < desc->num_fields; i++) {
+		const struct proto_field_t *field = &desc->fields[i];
+		uint32_t value = member_get(msg, field);
+		if (value == 0) {
+			continue;
+		}
+		if (len + 1 + field->wire_size > buf_size) {
+			return -ENOMEM;
+		}
+		buf[len++] = (field->tag << 4) | field->wire_size;
+		for (int b = 0; b < field->wire_size; b++) {
+			buf[len++] = (uint8_t)(value >> (8 * b));
+		}
+	}
+	return (int)len;
+}
+
+int proto_decode(const uint8_t *buf, size_t len, uint8_t *type, union proto_msg_t *msg)
+{
+	const struct proto_msg_desc_t *desc;
+	size_t pos = 1;
+
+	if (len < 1) {
+		return -EBADMSG;
+	}
+	if (PROTO_HDR_VERSION(buf[0]) != PROTO_VERSION) {
+		return -EPROTO;
+	}
+	*type = PROTO_HDR_TYPE(buf[0]);
+	desc = msg_desc_find(*type);
+	if (!desc) {
+		return -ENOMSG;
+	}
+	memset(msg, 0, sizeof(*msg));
+
+	while (pos < len) {
+		uint8_t tag = buf[pos] >> 4;
+		uint8_t field_len = buf[pos] & 0x0F;
+		pos++;
+		if (pos + field_len > len) {
+			return -EBADMSG;
+		}
+		for (int i = 0; i < desc->num_fields; i++) {
+			const struct proto_field_t *field = &desc->fields[i];
+			if (field->tag != tag) {
+				continue;
+			}
+			if (field_len != field->wire_size) {
+				return -EBADMSG;
+			}
+			uint32_t value = 0;
+			for (int b = 0; b < field_len; b++) {
+				value |= (uint32_t)buf[pos + b] << (8 * b);
+			}
+			member_set(msg, field, value);
+			break;
+		}
+		pos += field_len;
+	}
+	return 0;
+}
@@ -0,0 +1,14 @@
+#ifndef __HOST_ZEPHYR_KERNEL_H
+#define __HOST_ZEPHYR_KERNEL_H
+
+/* The few Zephyr definitions the common sources need, so they can be built and tested on the host */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define ARRAY_SIZE(array)	(sizeof(array) / sizeof((array)[0]))
+#define BUILD_ASSERT(cond, ...)	_Static_assert(cond, "" __VA_ARGS__)
+#define __packed		__attribute__((__packed__))
+
+#endif
@@ -0,0 +1,67 @@
+#include <proto.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/* Encode and decode timing of the frames sent most often: the LED command to the pads, the trial
+ * result back, and the stats frame on the control link. Run with the number of iterations as the
+ * optional argument. The host figures only compare code changes, they do not carry over to the target. */
+
+#define ITERATIONS_DEFAULT	1000000
+
+static volatile uint32_t sink;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void bench(const char *name, uint8_t type, const void *msg, long iterations)
+{
+	uint8_t frame[PROTO_FRAME_MAX];
+	union proto_msg_t out;
+	uint8_t out_type;
+	uint64_t t_start, t_encode = 0, t_decode = 0;
+	int len = 0;
+
+	for (long i = 0; i < iterations; i++) {
+		t_start = now_ns();
+		len = proto_encode(type, msg, frame, sizeof(frame));
+		t_encode += now_ns() - t_start;
+
+		t_start = now_ns();
+		if (proto_decode(frame, len, &out_type, &out) != 0) {
+			printf("%s: decode failed\n", name);
+			exit(1);
+		}
+		t_decode += now_ns() - t_start;
+		sink += out_type;
+	}
+	printf("%-12s %2i bytes  encode %6.1f ns  decode %6.1f ns\n", name, len,
+	       (double)t_encode / iterations, (double)t_decode / iterations);
+}
+
+int main(int argc, char **argv)
+{
+	long iterations = (argc > 1) ? atol(argv[1]) : ITERATIONS_DEFAULT;
+
+	struct proto_led_t led = {.effect = {.color1 = LED_COLOR_PURPLE, .color2 = LED_COLOR_ORANGE, .speed = 45},
+				  .trial = PROTO_TRIAL_START_TIMEOUT, .timeout_ms = 1500,
+				  .exec_at_us = 123456789, .chg_id = 42};
+	struct proto_trial_done_t trial_done = {.time_us = 456789, .chg_id = 42};
+	struct proto_stats_t stats = {.scope = PROTO_STATS_PAD, .index = 3, .count = 60, .fouls = 2,
+				      .min_ms = 180, .max_ms = 950, .mean_ms = 410, .stddev_ms = 120,
+				      .p50_ms = 390, .p90_ms = 640, .p99_ms = 900};
+
+	if (iterations <= 0) {
+		printf("usage: %s [iterations]\n", argv[0]);
+		return 1;
+	}
+	bench("led", PROTO_MSG_LED, &led, iterations);
+	bench("trial_done", PROTO_MSG_TRIAL_DONE, &trial_done, iterations);
+	bench("stats", PROTO_MSG_STATS, &stats, iterations);
+	return 0;
+}
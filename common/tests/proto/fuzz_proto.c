@@ -0,0 +1,51 @@
+#include <proto.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* libFuzzer target for the decoder. Every frame it accepts must encode again, and decode back to the
+ * same message. Run with: cmake -DPROTO_FUZZ=ON -DCMAKE_C_COMPILER=clang, then ./fuzz_proto corpus/ */
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	union proto_msg_t msg, msg_again;
+	uint8_t type, type_again;
+	// Larger than PROTO_FRAME_MAX, a decoded frame can hold every field of its type
+	uint8_t frame[64];
+	int len;
+
+	if (proto_decode(data, size, &type, &msg) != 0) {
+		return 0;
+	}
+	len = proto_encode(type, &msg, frame, sizeof(frame));
+	if (len < 1) {
+		abort();
+	}
+	if (proto_decode(frame, len, &type_again, &msg_again) != 0 || type_again != type ||
+	    memcmp(&msg, &msg_again, sizeof(msg)) != 0) {
+		abort();
+	}
+	return 0;
+}
+
+#if defined(PROTO_FUZZ_STANDALONE)
+#define REPLAY_FRAMES	200000
+
+// Replays random frames with a valid header through the fuzz target, for builds without libFuzzer
+int main(void)
+{
+	uint8_t frame[PROTO_FRAME_MAX];
+
+	srand(1);
+	for (int i = 0; i < REPLAY_FRAMES; i++) {
+		size_t len = rand() % (sizeof(frame) + 1);
+		for (size_t b = 0; b < len; b++) {
+			frame[b] = (uint8_t)rand();
+		}
+		if (len > 0 && (i & 1)) {
+			frame[0] = PROTO_HDR(frame[0] & 0x3F);
+		}
+		LLVMFuzzerTestOneInput(frame, len);
+	}
+	return 0;
+}
+#endif
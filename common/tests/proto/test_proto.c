@@ -0,0 +1,254 @@
+#include <proto.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+/* Host tests of the protocol codec: every message type is encoded, decoded and compared, with the
+ * largest values each field can carry so the frames are checked against PROTO_FRAME_MAX, and the
+ * decoder is fed truncated frames, bad field lengths and other protocol versions. */
+
+static int failures;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		printf("%s:%i: check failed: %s\n", __FILE__, __LINE__, #cond); \
+		failures++; \
+	} \
+} while (0)
+
+static void round_trip(const char *name, uint8_t type, const void *msg, size_t msg_size)
+{
+	uint8_t frame[PROTO_FRAME_MAX];
+	union proto_msg_t out;
+	uint8_t out_type;
+	int len, err;
+
+	len = proto_encode(type, msg, frame, sizeof(frame));
+	if (len < 1) {
+		printf("%s: encode failed (err %i)\n", name, len);
+		failures++;
+		return;
+	}
+	CHECK(proto_type_peek(frame, len) == type);
+	err = proto_decode(frame, len, &out_type, &out);
+	if (err) {
+		printf("%s: decode failed (err %i)\n", name, err);
+		failures++;
+		return;
+	}
+	CHECK(out_type == type);
+	if (msg && memcmp(&out, msg, msg_size) != 0) {
+		printf("%s: decoded message differs\n", name);
+		failures++;
+	}
+}
+
+#define ROUND_TRIP(type, msg) round_trip(#type, type, &(msg), sizeof(msg))
+
+static void test_round_trip(void)
+{
+	// Every struct is cleared first, so the padding compares equal to the decoded message
+	struct proto_led_t led;
+	memset(&led, 0, sizeof(led));
+	led.effect.type = LED_EFFECT_BLINK;
+	led.effect.color1 = 0xFFFFFF;
+	led.effect.color2 = 0x123456;
+	led.effect.color_end = 0xABCDEF;
+	led.effect.speed = 0xFF;
+	led.effect.num_repeats = 0xFF;
+	led.trial = PROTO_TRIAL_START_TIMEOUT;
+	led.timeout_ms = 0xFFFF;
+	led.exec_at_us = 0xFFFFFFFF;
+	led.chg_id = 0xFF;
+	ROUND_TRIP(PROTO_MSG_LED, led);
+
+	round_trip("PROTO_MSG_RESET", PROTO_MSG_RESET, NULL, 0);
+	round_trip("PROTO_MSG_PING", PROTO_MSG_PING, NULL, 0);
+	round_trip("PROTO_MSG_GAME_START", PROTO_MSG_GAME_START, NULL, 0);
+
+	struct proto_timesync_req_t timesync_req = {.seq = 0xFF};
+	ROUND_TRIP(PROTO_MSG_TIMESYNC_REQ, timesync_req);
+
+	struct proto_timesync_offset_t timesync_offset = {.offset_us = -123456789};
+	ROUND_TRIP(PROTO_MSG_TIMESYNC_OFFSET, timesync_offset);
+
+	struct proto_trial_done_t trial_done;
+	memset(&trial_done, 0, sizeof(trial_done));
+	trial_done.time_us = 0xFFFFFFFF;
+	trial_done.chg_id = 0xFF;
+	ROUND_TRIP(PROTO_MSG_TRIAL_DONE, trial_done);
+
+	struct proto_trial_timeout_t trial_timeout = {.chg_id = 0xFF};
+	ROUND_TRIP(PROTO_MSG_TRIAL_TIMEOUT, trial_timeout);
+
+	struct proto_timesync_rsp_t timesync_rsp;
+	memset(&timesync_rsp, 0, sizeof(timesync_rsp));
+	timesync_rsp.seq = 0xFF;
+	timesync_rsp.t_rx_us = 0xFFFFFFFF;
+	ROUND_TRIP(PROTO_MSG_TIMESYNC_RSP, timesync_rsp);
+
+	struct proto_chg_start_t chg_start = {.pad = 0xFF, .num_players = 0xFF, .target_ms = 0xFFFF};
+	ROUND_TRIP(PROTO_MSG_CHG_START, chg_start);
+
+	struct proto_chg_finish_t chg_finish = {.pad = 0xFF, .success = 1, .time_ms = 0xFFFF, .target_ms = 0xFFFF,
+						.points = 0xFFFF, .fouls = 0xFFFF};
+	ROUND_TRIP(PROTO_MSG_CHG_FINISH, chg_finish);
+
+	struct proto_round_start_t round_start = {.round = 0xFF, .round_total = 0xFF, .num_players = 0xFF,
+						  .target_ms = 0xFFFF};
+	ROUND_TRIP(PROTO_MSG_ROUND_START, round_start);
+
+	struct proto_game_finish_t game_finish = {.score = -1234, .min_ms = 0xFFFF, .max_ms = 0xFFFF, .avg_ms = 0xFFFF};
+	ROUND_TRIP(PROTO_MSG_GAME_FINISH, game_finish);
+
+	struct proto_num_con_t num_con = {.num = 0xFF};
+	ROUND_TRIP(PROTO_MSG_NUM_CON, num_con);
+
+	struct proto_stats_t stats = {.scope = PROTO_STATS_PAD, .index = 0xFF, .count = 0xFFFF, .fouls = 0xFFFF,
+				      .min_ms = 0xFFFF, .max_ms = 0xFFFF, .mean_ms = 0xFFFF, .stddev_ms = 0xFFFF,
+				      .p50_ms = 0xFFFF, .p90_ms = 0xFFFF, .p99_ms = 0xFFFF};
+	ROUND_TRIP(PROTO_MSG_STATS, stats);
+
+	struct proto_snapshot_t snapshot = {.state = PROTO_GAME_FINISHED, .round = 0xFF, .round_total = 0xFF,
+					    .num_players = 0xFF, .target_ms = 0xFFFF, .score = -32768, .fouls = 0xFFFF,
+					    .challenges = 0xFFFF, .last_ms = 0xFFFF};
+	ROUND_TRIP(PROTO_MSG_SNAPSHOT, snapshot);
+
+	struct proto_log_end_t log_end = {.count = 0xFFFFFFFF, .next_seq = 0xFFFFFFFF};
+	ROUND_TRIP(PROTO_MSG_LOG_END, log_end);
+
+	struct proto_log_export_t log_export = {.from_seq = 0xFFFFFFFF};
+	ROUND_TRIP(PROTO_MSG_LOG_EXPORT, log_export);
+
+	struct proto_link_health_t link_health = {.pad = 0xFF, .state = PROTO_LINK_BAD, .rssi = -127, .mitigation = 0xFF,
+						  .phy = 0xFF, .tx_power = -40, .miss_permille = 0xFFFF,
+						  .retx_permille = 0xFFFF, .crc_permille = 0xFFFF,
+						  .tx_latency_avg_us = 0xFFFFFFFF, .tx_latency_max_us = 0xFFFFFFFF};
+	ROUND_TRIP(PROTO_MSG_LINK_HEALTH, link_health);
+
+	struct proto_link_health_req_t link_health_req = {.subscribe = 1};
+	ROUND_TRIP(PROTO_MSG_LINK_HEALTH_REQ, link_health_req);
+
+	struct proto_fed_status_t fed_status;
+	memset(&fed_status, 0, sizeof(fed_status));
+	fed_status.ready_mask = 0xFF;
+	fed_status.num_pads = 0xFF;
+	fed_status.relayed = 0xFFFFFFFF;
+	fed_status.hop_avg_us = 0xFFFFFFFF;
+	fed_status.hop_max_us = 0xFFFFFFFF;
+	ROUND_TRIP(PROTO_MSG_FED_STATUS, fed_status);
+}
+
+static void test_zero_fields_omitted(void)
+{
+	struct proto_chg_finish_t chg_finish = {.time_ms = 500};
+	uint8_t frame[PROTO_FRAME_MAX];
+
+	// Header, then one tag/length byte and the two bytes of time_ms
+	CHECK(proto_encode(PROTO_MSG_CHG_FINISH, &chg_finish, frame, sizeof(frame)) == 4);
+	CHECK(frame[0] == PROTO_HDR(PROTO_MSG_CHG_FINISH));
+	CHECK(frame[1] == ((2 << 4) | 2));
+	CHECK(frame[2] == 0xF4 && frame[3] == 0x01);
+}
+
+static void test_truncated(void)
+{
+	struct proto_led_t led = {.effect = {.color1 = LED_COLOR_WHITE, .speed = 10}, .timeout_ms = 1000,
+				  .exec_at_us = 0x01020304};
+	uint8_t frame[PROTO_FRAME_MAX];
+	union proto_msg_t out;
+	uint8_t type;
+	int len;
+
+	len = proto_encode(PROTO_MSG_LED, &led, frame, sizeof(frame));
+	CHECK(len > 1);
+	CHECK(proto_decode(frame, 0, &type, &out) == -EBADMSG);
+	// Cut inside the last field
+	CHECK(proto_decode(frame, len - 1, &type, &out) == -EBADMSG);
+	// Cut right after the tag/length byte of the first field
+	CHECK(proto_decode(frame, 2, &type, &out) == -EBADMSG);
+	// Cut on a field boundary, the fields that made it through are kept
+	CHECK(proto_decode(frame, 5, &type, &out) == 0);
+	CHECK(out.led.effect.color1 == LED_COLOR_WHITE && out.led.timeout_ms == 0);
+	// A header alone is a message with every field 0
+	CHECK(proto_decode(frame, 1, &type, &out) == 0 && type == PROTO_MSG_LED && out.led.exec_at_us == 0);
+}
+
+static void test_oversized_length(void)
+{
+	union proto_msg_t out;
+	uint8_t type;
+
+	// Field length reaching past the end of the frame
+	const uint8_t past_end[] = {PROTO_HDR(PROTO_MSG_NUM_CON), (1 << 4) | 0x0F, 0x01, 0x02};
+	CHECK(proto_decode(past_end, sizeof(past_end), &type, &out) == -EBADMSG);
+
+	// Known tag with a length other than its wire size
+	const uint8_t wrong_size[] = {PROTO_HDR(PROTO_MSG_NUM_CON), (1 << 4) | 2, 0x01, 0x02};
+	CHECK(proto_decode(wrong_size, sizeof(wrong_size), &type, &out) == -EBADMSG);
+
+	// Unknown tags are skipped, whatever their length
+	const uint8_t unknown_tag[] = {PROTO_HDR(PROTO_MSG_NUM_CON), (9 << 4) | 3, 0xAA, 0xBB, 0xCC, (1 << 4) | 1, 0x05};
+	CHECK(proto_decode(unknown_tag, sizeof(unknown_tag), &type, &out) == 0);
+	CHECK(type == PROTO_MSG_NUM_CON && out.num_con.num == 5);
+}
+
+static void test_wrong_version(void)
+{
+	struct proto_num_con_t num_con = {.num = 3};
+	uint8_t frame[PROTO_FRAME_MAX];
+	union proto_msg_t out;
+	uint8_t type;
+	int len;
+
+	len = proto_encode(PROTO_MSG_NUM_CON, &num_con, frame, sizeof(frame));
+	CHECK(len == 3);
+	for (int version = 0; version < 4; version++) {
+		if (version == PROTO_VERSION) {
+			continue;
+		}
+		frame[0] = (version << 6) | PROTO_MSG_NUM_CON;
+		CHECK(proto_decode(frame, len, &type, &out) == -EPROTO);
+		CHECK(proto_type_peek(frame, len) == 0);
+	}
+}
+
+static void test_unknown_type(void)
+{
+	struct proto_num_con_t num_con = {.num = 1};
+	uint8_t frame[PROTO_FRAME_MAX];
+	union proto_msg_t out;
+	uint8_t type;
+
+	CHECK(proto_encode(0x3F, &num_con, frame, sizeof(frame)) == -ENOMSG);
+	frame[0] = PROTO_HDR(0x3F);
+	CHECK(proto_decode(frame, 1, &type, &out) == -ENOMSG);
+}
+
+static void test_buffer_too_small(void)
+{
+	struct proto_timesync_rsp_t rsp = {.seq = 1, .t_rx_us = 1000};
+	uint8_t frame[PROTO_FRAME_MAX];
+
+	CHECK(proto_encode(PROTO_MSG_TIMESYNC_RSP, &rsp, frame, 0) == -ENOMEM);
+	CHECK(proto_encode(PROTO_MSG_TIMESYNC_RSP, &rsp, frame, 4) == -ENOMEM);
+	CHECK(proto_encode(PROTO_MSG_TIMESYNC_RSP, &rsp, frame, 8) == 8);
+}
+
+int main(void)
+{
+	test_round_trip();
+	test_zero_fields_omitted();
+	test_truncated();
+	test_oversized_length();
+	test_wrong_version();
+	test_unknown_type();
+	test_buffer_too_small();
+
+	if (failures) {
+		printf("%i checks failed\n", failures);
+		return 1;
+	}
+	printf("All protocol tests passed\n");
+	return 0;
+}
@@ -7,7 +7,7 @@
 
 int app_led_init(void);
 
-int app_led_set_effect(led_effect_cfg_t *cfg);
+int app_led_set_effect(const led_effect_cfg_t *cfg);
 
 int app_led_set(led_color_t color);
 
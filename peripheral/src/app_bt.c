@@ -6,10 +6,15 @@
 #include <zephyr/bluetooth/hci.h>
 
 #include <bluetooth/services/nus.h>
+#include <proto.h>
 
 #define DEVICE_NAME CONFIG_BT_DEVICE_NAME
 #define DEVICE_NAME_LEN	(sizeof(DEVICE_NAME) - 1)
 
+// The ACL buffers are sized for one command per packet, which also sets the ATT MTU of the pad
+BUILD_ASSERT(PROTO_FRAME_MAX + 3 <= CONFIG_BT_L2CAP_RX_MTU,
+	     "A whole frame plus the ATT write command header must fit the L2CAP RX MTU");
+
 static const struct bt_data ad[] = {
 	BT_DATA_BYTES(BT_DATA_FLAGS, (BT_LE_AD_GENERAL | BT_LE_AD_NO_BREDR)),
 	BT_DATA(BT_DATA_NAME_COMPLETE, DEVICE_NAME, DEVICE_NAME_LEN),
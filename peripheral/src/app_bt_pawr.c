@@ -0,0 +1,311 @@
+#include <app_bt.h>
+#include <pawr_proto.h>
+
+#include <zephyr/bluetooth/bluetooth.h>
+#include <zephyr/bluetooth/hci.h>
+#include <zephyr/random/rand32.h>
+
+/* Connectionless variant of app_bt, following the PAwR train of the central instead of
+ * connecting to it. Selected with CONFIG_APP_BT_PAWR. */
+
+#define RSP_QUEUE_LEN	4
+#define JOIN_BACKOFF	4	/* Respond in the join slot in 1 of this many events */
+#define UNADDRESSED_MAX	20	/* Events without a record for this pad before rejoining */
+
+static app_bt_callback_t m_callback;
+
+static app_bt_event_t m_event;
+
+static struct bt_le_per_adv_sync *pawr_sync;
+static bt_addr_le_t own_addr;
+static int pad_index = -1;
+static uint8_t unaddressed_count;
+static uint8_t last_cmd_seq, last_mcast_seq;
+
+static struct {
+	uint8_t len;
+	uint8_t data[PAWR_REC_DATA_MAX];
+} rsp_queue[RSP_QUEUE_LEN];
+static uint8_t rsp_head, rsp_count, rsp_seq;
+static struct k_spinlock rsp_lock;
+
+static uint8_t rsp_data[PAWR_RSP_HDR_LEN + PAWR_REC_DATA_MAX];
+static struct net_buf_simple rsp_buf;
+
+static void trigger_app_callback(app_bt_evt_type_t type)
+{
+	m_event.type = type;
+	m_callback(&m_event);
+}
+
+static void trigger_rx_callback(const uint8_t *data, uint16_t len)
+{
+	m_event.type = APP_BT_EVT_RX;
+	m_event.buf = data;
+	m_event.length = (uint32_t)len;
+	m_callback(&m_event);
+}
+
+static void select_subevent(uint8_t subevent)
+{
+	struct bt_le_per_adv_sync_subevent_params params = {
+		.properties = 0,
+		.num_subevents = 1,
+		.subevents = &subevent,
+	};
+	int err = bt_le_per_adv_sync_subevent(pawr_sync, &params);
+	if (err) {
+		printk("Failed to select subevent %i (err %d)\n", subevent, err);
+	}
+}
+
+static void set_unassigned(void)
+{
+	if (pad_index >= 0) {
+		pad_index = -1;
+		trigger_app_callback(APP_BT_EVT_DISCONNECTED);
+	}
+	select_subevent(PAWR_JOIN_SUBEVENT);
+}
+
+static bool parse_records(struct net_buf_simple *buf)
+{
+	bool addressed = false;
+
+	while (buf->len >= PAWR_REC_HDR_LEN) {
+		uint8_t index = net_buf_simple_pull_u8(buf);
+		uint8_t cmd_seq = net_buf_simple_pull_u8(buf);
+		uint8_t rsp_ack = net_buf_simple_pull_u8(buf);
+		uint8_t len = net_buf_simple_pull_u8(buf);
+		const uint8_t *data;
+
+		if (buf->len < len) {
+			break;
+		}
+		data = net_buf_simple_pull_mem(buf, len);
+
+		if (index == PAWR_INDEX_ASSIGN && len == PAWR_ASSIGN_LEN) {
+			if (pad_index < 0 && data[0] == own_addr.type && memcmp(&data[1], own_addr.a.val, 6) == 0) {
+				pad_index = data[7];
+				last_cmd_seq = 0;
+				unaddressed_count = 0;
+				select_subevent(PAWR_PAD_SUBEVENT(pad_index));
+				trigger_app_callback(APP_BT_EVT_CONNECTED);
+			}
+		}
+		else if (index == PAWR_INDEX_ALL) {
+			if (pad_index >= 0 && cmd_seq != last_mcast_seq) {
+				last_mcast_seq = cmd_seq;
+				trigger_rx_callback(data, len);
+			}
+		}
+		else if (index == pad_index) {
+			addressed = true;
+			if (cmd_seq != 0 && cmd_seq != last_cmd_seq) {
+				last_cmd_seq = cmd_seq;
+				trigger_rx_callback(data, len);
+			}
+			k_spinlock_key_t key = k_spin_lock(&rsp_lock);
+			if (rsp_count > 0 && rsp_ack == rsp_seq) {
+				rsp_head = (rsp_head + 1) % RSP_QUEUE_LEN;
+				rsp_count--;
+				if (rsp_count > 0) {
+					rsp_seq = PAWR_SEQ_NEXT(rsp_seq);
+				}
+			}
+			k_spin_unlock(&rsp_lock, key);
+		}
+	}
+	return addressed;
+}
+
+static void send_response(const struct bt_le_per_adv_sync_recv_info *info, uint8_t slot)
+{
+	struct bt_le_per_adv_response_params params = {
+		.request_event = info->periodic_event_counter,
+		.request_subevent = info->subevent,
+		.response_subevent = info->subevent,
+		.response_slot = slot,
+	};
+	int err;
+
+	err = bt_le_per_adv_set_response_data(pawr_sync, &params, &rsp_buf);
+	if (err) {
+		printk("Failed to send response (err %d)\n", err);
+	}
+}
+
+static void sync_recv_cb(struct bt_le_per_adv_sync *sync, const struct bt_le_per_adv_sync_recv_info *info,
+			 struct net_buf_simple *buf)
+{
+	bool addressed;
+
+	if (!buf || buf->len == 0) {
+		return;
+	}
+
+	addressed = parse_records(buf);
+
+	net_buf_simple_init_with_data(&rsp_buf, rsp_data, sizeof(rsp_data));
+	net_buf_simple_reset(&rsp_buf);
+
+	if (pad_index < 0) {
+		// Random backoff, in case several pads try to join at the same time
+		if (info->subevent == PAWR_JOIN_SUBEVENT && (sys_rand32_get() % JOIN_BACKOFF) == 0) {
+			net_buf_simple_add_u8(&rsp_buf, own_addr.type);
+			net_buf_simple_add_mem(&rsp_buf, own_addr.a.val, 6);
+			send_response(info, PAWR_JOIN_SLOT);
+		}
+		return;
+	}
+
+	if (info->subevent != PAWR_PAD_SUBEVENT(pad_index)) {
+		return;
+	}
+
+	// The central stopped addressing this pad, ie. it was dropped after missing too many responses
+	if (!addressed && ++unaddressed_count > UNADDRESSED_MAX) {
+		set_unassigned();
+		return;
+	}
+	if (addressed) {
+		unaddressed_count = 0;
+	}
+
+	// The pending response is repeated until the central acks its sequence number
+	net_buf_simple_add_u8(&rsp_buf, last_cmd_seq);
+	k_spinlock_key_t key = k_spin_lock(&rsp_lock);
+	if (rsp_count > 0) {
+		net_buf_simple_add_u8(&rsp_buf, rsp_seq);
+		net_buf_simple_add_mem(&rsp_buf, rsp_queue[rsp_head].data, rsp_queue[rsp_head].len);
+	}
+	else {
+		net_buf_simple_add_u8(&rsp_buf, rsp_seq);
+	}
+	k_spin_unlock(&rsp_lock, key);
+	send_response(info, PAWR_PAD_SLOT(pad_index));
+}
+
+static void start_scan(void);
+
+static void sync_synced_cb(struct bt_le_per_adv_sync *sync, struct bt_le_per_adv_sync_synced_info *info)
+{
+	printk("Synced to PAwR train\n");
+	pad_index = -1;
+	select_subevent(PAWR_JOIN_SUBEVENT);
+}
+
+static void sync_term_cb(struct bt_le_per_adv_sync *sync, const struct bt_le_per_adv_sync_term_info *info)
+{
+	printk("PAwR sync lost (reason %d)\n", info->reason);
+	pawr_sync = NULL;
+	if (pad_index >= 0) {
+		pad_index = -1;
+		trigger_app_callback(APP_BT_EVT_DISCONNECTED);
+	}
+	start_scan();
+}
+
+static struct bt_le_per_adv_sync_cb sync_callbacks = {
+	.synced = sync_synced_cb,
+	.term = sync_term_cb,
+	.recv = sync_recv_cb,
+};
+
+static bool adv_name_match(struct bt_data *data, void *user_data)
+{
+	bool *match = user_data;
+	if (data->type == BT_DATA_NAME_COMPLETE) {
+		*match = (data->data_len == sizeof(PAWR_ADV_NAME) - 1 &&
+			  memcmp(data->data, PAWR_ADV_NAME, data->data_len) == 0);
+		return false;
+	}
+	return true;
+}
+
+static void scan_recv_cb(const struct bt_le_scan_recv_info *info, struct net_buf_simple *buf)
+{
+	struct bt_le_per_adv_sync_param param = {0};
+	bool match = false;
+	int err;
+
+	// Only advertisers with a periodic train are of interest
+	if (pawr_sync || info->interval == 0) {
+		return;
+	}
+	bt_data_parse(buf, adv_name_match, &match);
+	if (!match) {
+		return;
+	}
+
+	bt_addr_le_copy(&param.addr, info->addr);
+	param.sid = info->sid;
+	param.skip = 0;
+	param.timeout = 1000; /* 10 s */
+	err = bt_le_per_adv_sync_create(&param, &pawr_sync);
+	if (err) {
+		printk("Failed to create sync (err %d)\n", err);
+		pawr_sync = NULL;
+		return;
+	}
+	bt_le_scan_stop();
+}
+
+static struct bt_le_scan_cb scan_callbacks = {
+	.recv = scan_recv_cb,
+};
+
+static void start_scan(void)
+{
+	int err = bt_le_scan_start(BT_LE_SCAN_PASSIVE, NULL);
+	if (err && err != -EALREADY) {
+		printk("Scanning failed to start (err %d)\n", err);
+	}
+}
+
+int app_bt_init(app_bt_callback_t callback)
+{
+	size_t count = 1;
+	int ret;
+
+	m_callback = callback;
+
+	ret = bt_enable(NULL);
+	if (ret < 0) {
+		return ret;
+	}
+
+	bt_id_get(&own_addr, &count);
+
+	bt_le_scan_cb_register(&scan_callbacks);
+	bt_le_per_adv_sync_cb_register(&sync_callbacks);
+
+	start_scan();
+
+	return 0;
+}
+
+int app_bt_send(const uint8_t *data, uint16_t len)
+{
+	int ret = 0;
+
+	if (len > PAWR_REC_DATA_MAX) {
+		return -EINVAL;
+	}
+
+	k_spinlock_key_t key = k_spin_lock(&rsp_lock);
+	if (rsp_count >= RSP_QUEUE_LEN) {
+		ret = -ENOMEM;
+	}
+	else {
+		int i = (rsp_head + rsp_count) % RSP_QUEUE_LEN;
+		memcpy(rsp_queue[i].data, data, len);
+		rsp_queue[i].len = len;
+		if (rsp_count == 0) {
+			rsp_seq = PAWR_SEQ_NEXT(rsp_seq);
+		}
+		rsp_count++;
+	}
+	k_spin_unlock(&rsp_lock, key);
+	return ret;
+}
@@ -15,6 +15,9 @@ static const gpio_pin_t rgb_pins[] = {
 	GREEN_LED,
 	BLUE_LED,
 };
+#elif defined(CONFIG_BOARD_NRF52_BSIM)
+// The simulated board has no PWM, the LEDs are on for any non zero channel
+static const struct gpio_dt_spec gpio_leds[3] = {GPIO_DT_SPEC_GET(DT_NODELABEL(led0), gpios), GPIO_DT_SPEC_GET(DT_NODELABEL(led1), gpios), GPIO_DT_SPEC_GET(DT_NODELABEL(led2), gpios)};
 #else
 #include <zephyr/drivers/pwm.h>
 static const struct pwm_dt_spec pwm_leds[3] = {PWM_DT_SPEC_GET(DT_NODELABEL(pwm_led0)), PWM_DT_SPEC_GET(DT_NODELABEL(pwm_led1)), PWM_DT_SPEC_GET(DT_NODELABEL(pwm_led2))};
@@ -57,6 +60,13 @@ int app_led_init(void)
 			return ret;
 		}
 	}
+#elif defined(CONFIG_BOARD_NRF52_BSIM)
+	for (int i = 0; i < NUMBER_OF_LEDS; i++) {
+		ret = gpio_pin_configure_dt(&gpio_leds[i], GPIO_OUTPUT_INACTIVE);
+		if (ret < 0) {
+			return ret;
+		}
+	}
 #else
 	for (int i = 0; i < NUMBER_OF_LEDS; i++) {
 		if (!device_is_ready(pwm_leds[i].dev)) {
@@ -82,6 +92,14 @@ static int led_set_color(led_color_t color)
 	if (ret == 0) {
 		ret = sx1509b_led_intensity_pin_set(dev_sx1509b, BLUE_LED, COLOR_CH_BLUE(color));	
 	}
+#elif defined(CONFIG_BOARD_NRF52_BSIM)
+	ret = gpio_pin_set_dt(&gpio_leds[0], COLOR_CH_RED(color) > 0);
+	if (ret == 0) {
+		ret = gpio_pin_set_dt(&gpio_leds[1], COLOR_CH_GREEN(color) > 0);
+	}
+	if (ret == 0) {
+		ret = gpio_pin_set_dt(&gpio_leds[2], COLOR_CH_BLUE(color) > 0);
+	}
 #else 
 	ret = pwm_set_dt(&pwm_leds[0], 255, COLOR_CH_RED(color));
 	if (ret == 0) {
@@ -112,7 +130,7 @@ int app_led_toggle(led_color_t color1)
 	return led_set_color(led_on ? color1 : LED_COLOR_BLACK);
 }
 
-int app_led_set_effect(led_effect_cfg_t *cfg)
+int app_led_set_effect(const led_effect_cfg_t *cfg)
 {
 	memcpy(&m_led_effect_status.config, cfg, sizeof(led_effect_cfg_t));
 	m_led_effect_status.runtime = 0;
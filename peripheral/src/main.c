@@ -10,8 +10,9 @@
 #include <app_sensors.h>
 #include <app_bt.h>
 #include <app_led.h>
+#include <timesync.h>
+#include <proto.h>
 #include <string.h>
-#include <stdio.h>
 
 /* 1000 msec = 1 sec */
 #define SLEEP_TIME_MS   1000
@@ -20,43 +21,109 @@
 
 static const struct gpio_dt_spec button = GPIO_DT_SPEC_GET(BUTTON0_NODE, gpios);
 
+// Commands scheduled further ahead than this are considered bogus and executed immediately
+#define EXEC_AT_MAX_DELAY_US 2000000
+// Scheduled commands waiting at the same time, ie. a result effect and the start of the next challenge
+#define LED_CMD_QUEUE_LEN 4
+
 static struct {
 	bool trial_started;
-	uint32_t start_time;
-	uint32_t time; 
+	uint8_t chg_id;
+	uint32_t start_us;
+	uint32_t time_us;
 } m_trial_data = {0};
 
+static struct {
+	bool synced;
+	uint8_t seq;
+	uint32_t t_rx;
+	int32_t offset_us;
+	// Drift of the local clock relative to the central, in parts per million
+	int32_t drift_ppm;
+	uint32_t t_offset_local;
+} m_timesync = {0};
+
+// Commands waiting for their execute at time, in local time order. Filled from the Bluetooth RX
+// thread, and run from the system work queue.
+static struct {
+	struct proto_led_t cmd;
+	uint32_t exec_at;
+} m_led_cmd_queue[LED_CMD_QUEUE_LEN];
+static uint32_t m_led_cmd_count;
+static struct k_spinlock m_led_cmd_lock;
+
 void challenge_timeout_func(struct k_timer *timer_id); 
 K_TIMER_DEFINE(m_timer_challenge_timeout, challenge_timeout_func, NULL);
 
+static void send_msg(uint8_t type, const void *msg)
+{
+	uint8_t frame[PROTO_FRAME_MAX];
+	int len = proto_encode(type, msg, frame, sizeof(frame));
+	if (len > 0) {
+		app_bt_send(frame, len);
+	}
+}
+
 void trial_done_func(struct k_work *work)
 {
-	static uint8_t rsp_string[32];
+	struct proto_trial_done_t msg = {.time_us = m_trial_data.time_us, .chg_id = m_trial_data.chg_id};
 	app_led_set(LED_COLOR_BLACK);
-	printk("Trial completed in %i milliseconds\n", m_trial_data.time);
-	sprintf(rsp_string, "TD:%.6i", m_trial_data.time);
-	app_bt_send(rsp_string, strlen(rsp_string));
+	printk("Trial completed in %i milliseconds\n", m_trial_data.time_us / 1000);
+	send_msg(PROTO_MSG_TRIAL_DONE, &msg);
 }
 
 void trial_timeout_func(struct k_work *work)
 {
+	struct proto_trial_timeout_t msg = {.chg_id = m_trial_data.chg_id};
 	app_led_set(LED_COLOR_BLACK);
-	app_bt_send("TO", 2);
+	send_msg(PROTO_MSG_TRIAL_TIMEOUT, &msg);
 }
 
 void send_ping_func(struct k_work *work)
 {
-	app_bt_send("PING", 4);
+	send_msg(PROTO_MSG_PING, NULL);
 }
 
 K_WORK_DEFINE(m_work_trial_done, trial_done_func);
 K_WORK_DEFINE(m_work_trial_timeout, trial_timeout_func);
 K_WORK_DEFINE(m_work_send_ping, send_ping_func);
 
+void timesync_response_func(struct k_work *work)
+{
+	struct proto_timesync_rsp_t rsp = {.seq = m_timesync.seq, .t_rx_us = m_timesync.t_rx};
+	send_msg(PROTO_MSG_TIMESYNC_RSP, &rsp);
+}
+
+K_WORK_DEFINE(m_work_timesync_response, timesync_response_func);
+
+static void timesync_offset_update(int32_t offset_us)
+{
+	uint32_t now = timesync_now_us();
+
+	if (m_timesync.synced) {
+		uint32_t elapsed_us = now - m_timesync.t_offset_local;
+		if (elapsed_us > 0) {
+			m_timesync.drift_ppm = (int32_t)((int64_t)(offset_us - m_timesync.offset_us) * 1000000 / elapsed_us);
+		}
+	}
+	m_timesync.offset_us = offset_us;
+	m_timesync.t_offset_local = now;
+	m_timesync.synced = true;
+	printk("Time sync offset %i us, drift %i ppm\n", offset_us, m_timesync.drift_ppm);
+}
+
+// Convert a timestamp in central time to local time, extrapolating the drift since the last sync
+static uint32_t timesync_central_to_local(uint32_t t_central)
+{
+	uint32_t t_local = t_central + m_timesync.offset_us;
+	int32_t since_sync = (int32_t)(t_local - m_timesync.t_offset_local);
+	return t_local + (int32_t)((int64_t)since_sync * m_timesync.drift_ppm / 1000000);
+}
+
 void on_button_pressed(const struct device *port, struct gpio_callback *cb, gpio_port_pins_t pins)
 {
 	if(m_trial_data.trial_started) {
-		m_trial_data.time = k_uptime_get_32() - m_trial_data.start_time;
+		m_trial_data.time_us = timesync_now_us() - m_trial_data.start_us;
 		m_trial_data.trial_started = false;		
 		k_work_submit(&m_work_trial_done);
 	}
@@ -106,6 +173,112 @@ static int button_led_init(void)
 	return 0;
 }
 
+static void led_cmd_execute(const struct proto_led_t *cmd)
+{
+	// A trial for a new challenge replaces a running one, the central has already given up on that one
+	bool trial_free = !m_trial_data.trial_started || cmd->chg_id != m_trial_data.chg_id;
+
+	// Check if a new challenge/trial should be started. The timeout of a trial it replaces must not end it.
+	if(cmd->trial == PROTO_TRIAL_START && trial_free) {
+		k_timer_stop(&m_timer_challenge_timeout);
+		m_trial_data.trial_started = true;
+		m_trial_data.chg_id = cmd->chg_id;
+		m_trial_data.start_us = timesync_now_us();
+	}
+	// Check if a new challenge/trial with timeout should be started
+	else if(cmd->trial == PROTO_TRIAL_START_TIMEOUT && trial_free) {
+		m_trial_data.trial_started = true;
+		m_trial_data.chg_id = cmd->chg_id;
+		m_trial_data.start_us = timesync_now_us();
+		k_timer_start(&m_timer_challenge_timeout, K_MSEC(cmd->timeout_ms), K_MSEC(0));
+	}
+	if(cmd->effect.type == LED_EFFECT_PULSE) {
+		app_led_set_effect(&cmd->effect);
+	}
+}
+
+void led_cmd_pending_func(struct k_work *work);
+K_WORK_DELAYABLE_DEFINE(m_work_led_cmd, led_cmd_pending_func);
+
+// Run the work at the time of the first command in the queue. Called with m_led_cmd_lock held,
+// so the work is never left scheduled for a later command than the first one.
+static void led_cmd_queue_reschedule(void)
+{
+	if (m_led_cmd_count > 0) {
+		int32_t delay_us = (int32_t)(m_led_cmd_queue[0].exec_at - timesync_now_us());
+		k_work_reschedule(&m_work_led_cmd, K_USEC(MAX(delay_us, 0)));
+	}
+}
+
+void led_cmd_pending_func(struct k_work *work)
+{
+	struct proto_led_t due[LED_CMD_QUEUE_LEN];
+	uint32_t num_due = 0;
+	uint32_t now = timesync_now_us();
+
+	k_spinlock_key_t key = k_spin_lock(&m_led_cmd_lock);
+	while (num_due < m_led_cmd_count && (int32_t)(m_led_cmd_queue[num_due].exec_at - now) <= 0) {
+		due[num_due] = m_led_cmd_queue[num_due].cmd;
+		num_due++;
+	}
+	m_led_cmd_count -= num_due;
+	memmove(&m_led_cmd_queue[0], &m_led_cmd_queue[num_due], m_led_cmd_count * sizeof(m_led_cmd_queue[0]));
+	led_cmd_queue_reschedule();
+	k_spin_unlock(&m_led_cmd_lock, key);
+
+	for (int i = 0; i < num_due; i++) {
+		led_cmd_execute(&due[i]);
+	}
+}
+
+static int led_cmd_queue_add(const struct proto_led_t *cmd, uint32_t exec_at)
+{
+	uint32_t pos;
+
+	k_spinlock_key_t key = k_spin_lock(&m_led_cmd_lock);
+	if (m_led_cmd_count >= LED_CMD_QUEUE_LEN) {
+		k_spin_unlock(&m_led_cmd_lock, key);
+		return -ENOMEM;
+	}
+	// Commands for the same time run in the order they arrived
+	for (pos = m_led_cmd_count; pos > 0 && (int32_t)(exec_at - m_led_cmd_queue[pos - 1].exec_at) < 0; pos--) {
+	}
+	memmove(&m_led_cmd_queue[pos + 1], &m_led_cmd_queue[pos], (m_led_cmd_count - pos) * sizeof(m_led_cmd_queue[0]));
+	m_led_cmd_queue[pos].cmd = *cmd;
+	m_led_cmd_queue[pos].exec_at = exec_at;
+	m_led_cmd_count++;
+	if (pos == 0) {
+		led_cmd_queue_reschedule();
+	}
+	k_spin_unlock(&m_led_cmd_lock, key);
+	return 0;
+}
+
+static void led_cmd_queue_clear(void)
+{
+	k_spinlock_key_t key = k_spin_lock(&m_led_cmd_lock);
+	m_led_cmd_count = 0;
+	k_spin_unlock(&m_led_cmd_lock, key);
+	k_work_cancel_delayable(&m_work_led_cmd);
+}
+
+// Commands carrying an execute at time are delayed until that time, so that all the pads 
+// light up together regardless of when each of them received the command
+static void led_cmd_schedule(const struct proto_led_t *cmd)
+{
+	if (cmd->exec_at_us != 0 && m_timesync.synced) {
+		uint32_t exec_at = timesync_central_to_local(cmd->exec_at_us);
+		int32_t delay_us = (int32_t)(exec_at - timesync_now_us());
+		if (delay_us > 0 && delay_us < EXEC_AT_MAX_DELAY_US) {
+			if (led_cmd_queue_add(cmd, exec_at) == 0) {
+				return;
+			}
+			printk("LED command queue full, executing now\n");
+		}
+	}
+	led_cmd_execute(cmd);
+}
+
 void sensors_callback(app_sensors_event_t *event)
 {
 
@@ -120,10 +293,15 @@ void bluetooth_callback(app_bt_event_t *event)
 			m_trial_data.trial_started = false;
 			break;
 		case APP_BT_EVT_DISCONNECTED:
+			led_cmd_queue_clear();
+			m_timesync.synced = false;
+			m_timesync.drift_ppm = 0;
 			printk("Bluetooth disconnected\n");
 			app_led_blink(LED_COLOR_BLUE, LED_COLOR_BLACK, 250);
 			break;
-		case APP_BT_EVT_RX:
+		case APP_BT_EVT_RX: {
+			union proto_msg_t msg;
+			uint8_t type;
 #if 0
 			printk("BT RX:");
 			for(int i = 0; i < event->length; i++) {
@@ -132,41 +310,34 @@ void bluetooth_callback(app_bt_event_t *event)
 			} 
 			printk("\n");
 #endif
-			// LED command 
-			// L - Start trial (0/1) - Led mode (P/B) - Color 1 RGB - Color 2 RGB - Color End RGB - Speed - Num repeats (255 - infinite)
-			// 0 - 1                 - 2              - 3 4 5       -  6 7 8      - 9 10 11       - 12    - 13      
-			if(event->buf[0] == 'L' && event->length >= 14) {
-				led_effect_cfg_t led_effect;
-				// Check if a new challenge/trial should be started
-				if(event->buf[1] == '1' && !m_trial_data.trial_started) {
-					m_trial_data.trial_started = true;
-					m_trial_data.start_time = k_uptime_get_32();
-				}
-				// Check if a new challenge/trial with timeout should be started
-				else if(event->buf[1] == '2' && !m_trial_data.trial_started && event->length >= 16) {
-					m_trial_data.trial_started = true;
-					m_trial_data.start_time = k_uptime_get_32();
-
-					uint16_t timeout_ms = (uint16_t)event->buf[14] << 8 | (uint16_t)event->buf[15];
-					k_timer_start(&m_timer_challenge_timeout, K_MSEC(timeout_ms), K_MSEC(0));
-				}
-				// Check if we should blink the LED
-				if(event->buf[2] == 'P') {
-					led_effect.type = LED_EFFECT_PULSE;
-					led_effect.color1 = COLOR_FROM_BUF(event->buf, 3);
-					led_effect.color2 = COLOR_FROM_BUF(event->buf, 6);
-					led_effect.color_end = COLOR_FROM_BUF(event->buf, 9);
-					led_effect.speed = event->buf[12];
-					led_effect.num_repeats = event->buf[13];
-					app_led_set_effect(&led_effect);
-				}
+			// Stamp sync requests as early as possible, before the decoding
+			uint32_t t_rx = timesync_now_us();
+			int err = proto_decode(event->buf, event->length, &type, &msg);
+			if(err) {
+				printk("Unsupported command (err %i)\n", err);
+				break;
 			}
-			// Reset command
-			else if(memcmp(event->buf, "RST", 3) == 0) {
-				app_led_off();
-				m_trial_data.trial_started = false;
+			switch(type) {
+				case PROTO_MSG_LED:
+					led_cmd_schedule(&msg.led);
+					break;
+				case PROTO_MSG_TIMESYNC_REQ:
+					// The response can wait
+					m_timesync.t_rx = t_rx;
+					m_timesync.seq = msg.timesync_req.seq;
+					k_work_submit(&m_work_timesync_response);
+					break;
+				case PROTO_MSG_TIMESYNC_OFFSET:
+					timesync_offset_update(msg.timesync_offset.offset_us);
+					break;
+				case PROTO_MSG_RESET:
+					led_cmd_queue_clear();
+					app_led_off();
+					m_trial_data.trial_started = false;
+					break;
 			}
 			break;
+		}
 	}
 }
 